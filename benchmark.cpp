@@ -1,18 +1,85 @@
 #include "clock.h"
+#include "cpu.h"
+#include "cuckoo_map.h"
 #include "map.h"
 #include "memory.h"
+#include "perf_counters.h"
 #include "random.h"
 
-#include <cstdio>
+#include <cctype>
 #include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
 #include <unordered_map>
 
-typedef std::unordered_map<void*, void*, std::hash<void*>> hash_t;
+// This counts what std::unordered_map allocates, to compare with what Map
+// allocates through its Heap.
+
+struct AllocationCount
+{
+    u64 bytes_in_use;
+    u64 peak_bytes;
+};
+
+namespace
+{
+    AllocationCount unordered_map_allocations;
+}
+
+template<typename T>
+struct CountingAllocator
+{
+    typedef T value_type;
+
+    CountingAllocator() {}
+
+    template<typename U>
+    CountingAllocator(const CountingAllocator<U>& other) {}
+
+    T* allocate(size_t count)
+    {
+        AllocationCount* allocations = &unordered_map_allocations;
+        allocations->bytes_in_use += sizeof(T) * count;
+        if(allocations->bytes_in_use > allocations->peak_bytes)
+        {
+            allocations->peak_bytes = allocations->bytes_in_use;
+        }
+        return static_cast<T*>(::operator new(sizeof(T) * count));
+    }
+
+    void deallocate(T* memory, size_t count)
+    {
+        unordered_map_allocations.bytes_in_use -= sizeof(T) * count;
+        ::operator delete(memory);
+    }
+};
+
+template<typename T, typename U>
+bool operator==(const CountingAllocator<T>& a, const CountingAllocator<U>& b)
+{
+    return true;
+}
+
+template<typename T, typename U>
+bool operator!=(const CountingAllocator<T>& a, const CountingAllocator<U>& b)
+{
+    return false;
+}
+
+typedef std::unordered_map<void*, void*, std::hash<void*>,
+    std::equal_to<void*>, CountingAllocator<std::pair<void* const, void*>>>
+    hash_t;
 
 // Benchmark Structure..........................................................
 
 enum class Subject
 {
+    Cuckoo_Map,
     Map,
     Unordered_Map,
 };
@@ -20,7 +87,7 @@ enum class Subject
 namespace
 {
     const int table_counts_cap = 15;
-    const int subjects_cap = 2;
+    const int subjects_cap = 3;
 
     int table_counts[table_counts_cap] =
     {
@@ -44,12 +111,24 @@ namespace
     Subject subjects[subjects_cap] =
     {
         Subject::Map,
+        Subject::Cuckoo_Map,
         Subject::Unordered_Map,
     };
+
+    // These are the sizes for suites that are too slow to run at every size.
+    const int sampled_table_counts_cap = 3;
+
+    int sampled_table_counts[sampled_table_counts_cap] =
+    {
+        200000,
+        1000000,
+        3000000,
+    };
 }
 
 enum class BenchmarkType
 {
+    Batch_Deletion,
     Deletion,
     Insertion,
     Iteration,
@@ -60,24 +139,121 @@ enum class BenchmarkType
 
 enum class TableType
 {
+    Arena_Pointers,
+    Heap_Pointers,
+    Pathological,
     Random,
     Random_Both_Tables,
     Random_With_Reserve,
     Shuffle,
+    Strided_Pointers,
+};
+
+namespace
+{
+    const int benchmarks_cap = 19;
+    const int sizes_cap = 32;
+}
+
+// The spread of times over every repetition of one benchmark, one subject,
+// and one table size, all in nanoseconds.
+struct BenchmarkResult
+{
+    double median;
+    double mean;
+    double standard_deviation;
+    s64 min;
+    s64 max;
+};
+
+// A workload mixes gets, adds, and removes in the style of YCSB, each given as
+// a percentage of all operations.
+struct Workload
+{
+    const char* name;
+    int get_percent;
+    int add_percent;
+    int remove_percent;
+};
+
+enum class KeyDistribution
+{
+    Uniform,
+    Zipfian,
+    Hotspot,
 };
 
+namespace
+{
+    const int workloads_cap = 3;
+    const int distributions_cap = 3;
+
+    Workload workloads[workloads_cap] =
+    {
+        {"Read Only", 100, 0, 0},
+        {"Read Mostly", 90, 5, 5},
+        {"Write Heavy", 50, 25, 25},
+    };
+
+    KeyDistribution distributions[distributions_cap] =
+    {
+        KeyDistribution::Uniform,
+        KeyDistribution::Zipfian,
+        KeyDistribution::Hotspot,
+    };
+}
+
 struct Benchmark
 {
-    s64 milliseconds[subjects_cap][table_counts_cap];
+    BenchmarkResult results[subjects_cap][sizes_cap];
+    double counts_per_operation[subjects_cap][sizes_cap][perf_counters_cap];
     BenchmarkType type;
     TableType table_type;
 };
 
+enum class OutputFormat
+{
+    None,
+    Csv,
+    Json,
+};
+
+struct BenchmarkOptions
+{
+    int table_counts[sizes_cap];
+    Subject subjects[subjects_cap];
+    bool selected[benchmarks_cap];
+    bool distributions_selected[distributions_cap];
+    bool counted[perf_counters_cap];
+    const char* output_path;
+    const char* save_baseline_path;
+    const char* compare_baseline_path;
+    double threshold;
+    Workload workload;
+    int table_counts_count;
+    int subjects_count;
+    int warm_ups;
+    int repetitions;
+    int cpu;
+    int threads;
+    OutputFormat output_format;
+    bool table_counts_chosen;
+    bool workload_chosen;
+    bool count_events;
+    bool pin;
+    bool run_throughput;
+    bool run_latency;
+    bool run_mixed;
+    bool run_threads;
+    bool run_memory;
+};
+
 static const char* describe_benchmark_type(BenchmarkType type)
 {
     switch(type)
     {
         default:
+        case BenchmarkType::Batch_Deletion: return "Batch Deletion";
         case BenchmarkType::Deletion: return "Deletion";
         case BenchmarkType::Insertion: return "Insertion";
         case BenchmarkType::Iteration: return "Iteration";
@@ -87,11 +263,23 @@ static const char* describe_benchmark_type(BenchmarkType type)
     }
 }
 
+static const char* describe_key_distribution(KeyDistribution distribution)
+{
+    switch(distribution)
+    {
+        default:
+        case KeyDistribution::Uniform: return "Uniform";
+        case KeyDistribution::Zipfian: return "Zipfian";
+        case KeyDistribution::Hotspot: return "Hotspot";
+    }
+}
+
 static const char* describe_subject(Subject subject)
 {
     switch(subject)
     {
         default:
+        case Subject::Cuckoo_Map: return "Cuckoo Map";
         case Subject::Map: return "Map";
         case Subject::Unordered_Map: return "Unordered Map";
     }
@@ -102,10 +290,14 @@ static const char* describe_table_type(TableType type)
     switch(type)
     {
         default:
+        case TableType::Arena_Pointers: return "Arena Pointers";
+        case TableType::Heap_Pointers: return "Heap Pointers";
+        case TableType::Pathological: return "Pathological";
         case TableType::Random: return "Random";
         case TableType::Random_Both_Tables: return "Random Both Tables";
         case TableType::Random_With_Reserve: return "Random With Reserve";
         case TableType::Shuffle: return "Shuffle";
+        case TableType::Strided_Pointers: return "Strided Pointers";
     }
 }
 
@@ -119,29 +311,334 @@ static void fill_counting_upward(void** array, int count)
     }
 }
 
+namespace
+{
+    // Big tables are set up in blocks of this many keys, each drawing from
+    // its own random stream, so that the blocks can be done on separate
+    // threads. A table comes out the same however many threads there are.
+    const int setup_block = 1 << 16;
+
+    // how many numbers are drawn at once while filling a block
+    const int setup_numbers_cap = 4096;
+}
+
+static int count_setup_blocks(int count)
+{
+    return (count + setup_block - 1) / setup_block;
+}
+
+// Each block's stream is a jump ahead of the block before's.
+static Sequence* make_block_streams(Sequence* sequence, int blocks_count)
+{
+    Sequence* streams = HEAP_ALLOCATE(nullptr, Sequence, blocks_count);
+    for(int i = 0; i < blocks_count; i += 1)
+    {
+        streams[i] = *sequence;
+        jump(sequence);
+    }
+    return streams;
+}
+
+// This does the work for every block, spread over a helper thread for each
+// processor the process is allowed. Helpers take on the affinity of the
+// benchmark thread, which may be pinned, so each is pinned to one of those
+// processors of its own. A helper that can't be pinned still does its share.
+template<typename Work>
+static void for_each_setup_block(int blocks_count, Work work)
+{
+    int cpus[allowed_cpus_cap];
+    int threads_count = get_allowed_cpus(cpus, allowed_cpus_cap);
+    if(threads_count > blocks_count)
+    {
+        threads_count = blocks_count;
+    }
+    if(threads_count <= 1)
+    {
+        for(int i = 0; i < blocks_count; i += 1)
+        {
+            work(i);
+        }
+        return;
+    }
+
+    std::atomic<int> next_block(0);
+    std::thread* threads = new std::thread[threads_count];
+    for(int i = 0; i < threads_count; i += 1)
+    {
+        threads[i] = std::thread([&, i]()
+        {
+            pin_thread_to_cpu(cpus[i]);
+            for(int block = next_block.fetch_add(1); block < blocks_count;
+                block = next_block.fetch_add(1))
+            {
+                work(block);
+            }
+        });
+    }
+    for(int i = 0; i < threads_count; i += 1)
+    {
+        threads[i].join();
+    }
+    delete[] threads;
+}
+
 static void fill_randomly(void** array, int count)
+{
+    Sequence sequence;
+    const u64 a_prime = 1685777;
+    seed(&sequence, a_prime);
+
+    int blocks_count = count_setup_blocks(count);
+    Sequence* streams = make_block_streams(&sequence, blocks_count);
+    for_each_setup_block(blocks_count, [=](int block)
+    {
+        u64 numbers[setup_numbers_cap];
+        int first = block * setup_block;
+        int end = std::min(first + setup_block, count);
+        for(int i = first; i < end; i += setup_numbers_cap)
+        {
+            int drawn = std::min(end - i, setup_numbers_cap);
+            generate_n(&streams[block], numbers, drawn);
+            for(int j = 0; j < drawn; j += 1)
+            {
+                int key = static_cast<int>(numbers[j]);
+                array[i + j] = reinterpret_cast<void*>(key);
+            }
+        }
+    });
+    SAFE_HEAP_DEALLOCATE(nullptr, streams);
+}
+
+// This picks from 0 up to the bound by scaling down the top half of a random
+// number, which is quicker than dividing for the remainder.
+static int pick_below(u64 number, int bound)
+{
+    return static_cast<int>(((number >> 32) * bound) >> 32);
+}
+
+// This shuffles in three steps. First, each block sends each of its keys to a
+// random bucket, of which there are as many as blocks. Second, the buckets
+// are laid out end to end, and the keys are scattered into them by drawing
+// the same random picks again. Last, each bucket is shuffled on its own.
+// Picking buckets independently and then shuffling within them makes every
+// order equally likely, just as shuffling the whole array at once would.
+static void shuffle(void** array, int count)
+{
+    Sequence sequence;
+    const u64 a_prime = 1685777;
+    seed(&sequence, a_prime);
+
+    int blocks_count = count_setup_blocks(count);
+    int buckets_count = blocks_count;
+    Sequence* streams = make_block_streams(&sequence, blocks_count);
+    long_jump(&sequence);
+    Sequence* bucket_streams = make_block_streams(&sequence, buckets_count);
+
+    // The counts are laid out by block, so that each block only writes to
+    // its own row.
+    int* offsets = HEAP_ALLOCATE(nullptr, int, blocks_count * buckets_count);
+    for_each_setup_block(blocks_count, [=](int block)
+    {
+        u64 numbers[setup_numbers_cap];
+        Sequence stream = streams[block];
+        int* row = &offsets[block * buckets_count];
+        int first = block * setup_block;
+        int end = std::min(first + setup_block, count);
+        for(int i = first; i < end; i += setup_numbers_cap)
+        {
+            int drawn = std::min(end - i, setup_numbers_cap);
+            generate_n(&stream, numbers, drawn);
+            for(int j = 0; j < drawn; j += 1)
+            {
+                row[pick_below(numbers[j], buckets_count)] += 1;
+            }
+        }
+    });
+
+    // A bucket's keys go in block order, so each block's share of a bucket
+    // starts after the shares of the blocks before it.
+    int* bucket_starts = HEAP_ALLOCATE(nullptr, int, buckets_count + 1);
+    int total = 0;
+    for(int bucket = 0; bucket < buckets_count; bucket += 1)
+    {
+        bucket_starts[bucket] = total;
+        for(int block = 0; block < blocks_count; block += 1)
+        {
+            int* share = &offsets[block * buckets_count + bucket];
+            int share_count = *share;
+            *share = total;
+            total += share_count;
+        }
+    }
+    bucket_starts[buckets_count] = total;
+
+    void** scattered = HEAP_ALLOCATE(nullptr, void*, count);
+    for_each_setup_block(blocks_count, [=](int block)
+    {
+        u64 numbers[setup_numbers_cap];
+        Sequence stream = streams[block];
+        int* row = &offsets[block * buckets_count];
+        int first = block * setup_block;
+        int end = std::min(first + setup_block, count);
+        for(int i = first; i < end; i += setup_numbers_cap)
+        {
+            int drawn = std::min(end - i, setup_numbers_cap);
+            generate_n(&stream, numbers, drawn);
+            for(int j = 0; j < drawn; j += 1)
+            {
+                int bucket = pick_below(numbers[j], buckets_count);
+                scattered[row[bucket]] = array[i + j];
+                row[bucket] += 1;
+            }
+        }
+    });
+
+    for_each_setup_block(buckets_count, [=](int bucket)
+    {
+        u64 numbers[setup_numbers_cap];
+        Sequence* stream = &bucket_streams[bucket];
+        int first = bucket_starts[bucket];
+        int end = bucket_starts[bucket + 1];
+        for(int i = first; i < end; i += setup_numbers_cap)
+        {
+            int drawn = std::min(end - i, setup_numbers_cap);
+            generate_n(stream, numbers, drawn);
+            for(int k = i; k < i + drawn; k += 1)
+            {
+                int j = k + pick_below(numbers[k - i], end - k);
+                array[k] = scattered[j];
+                scattered[j] = scattered[k];
+            }
+        }
+    });
+
+    HEAP_DEALLOCATE(nullptr, scattered);
+    SAFE_HEAP_DEALLOCATE(nullptr, bucket_starts);
+    SAFE_HEAP_DEALLOCATE(nullptr, offsets);
+    SAFE_HEAP_DEALLOCATE(nullptr, bucket_streams);
+    SAFE_HEAP_DEALLOCATE(nullptr, streams);
+}
+
+// Real pointer keys aren't like counting numbers or random integers. They're
+// 16-byte aligned, about 48 bits wide, and bunched up in a few address ranges.
+// These make tables of keys like that, so map_hash_key gets the same kind of
+// input it does in production.
+
+namespace
+{
+    // This is around where a 64-bit Linux process maps its larger blocks.
+    const u64 mapped_region_base = UINT64_C(0x00007f3a5c000000);
+    const u64 pointer_alignment = 16;
+    const u64 page_stride = 4096;
+    const int arenas_cap = 4;
+}
+
+static u64 pick_object_size(Sequence* sequence)
+{
+    int size = random_int_range(sequence, 1, 128);
+    return (size + pointer_alignment - 1) & ~(pointer_alignment - 1);
+}
+
+// These are the addresses of objects that are really allocated, one by one,
+// and so have to be freed with free_heap_pointers afterward.
+static void fill_heap_pointers(void** array, int count)
 {
     Sequence sequence;
     const u64 a_prime = 1685777;
     seed(&sequence, a_prime);
     for(int i = 0; i < count; i += 1)
     {
-        int j = generate(&sequence);
-        array[i] = reinterpret_cast<void*>(j);
+        array[i] = malloc(pick_object_size(&sequence));
     }
 }
 
-static void shuffle(void** array, int count)
+static void free_heap_pointers(void** array, int count)
+{
+    for(int i = 0; i < count; i += 1)
+    {
+        free(array[i]);
+    }
+}
+
+// These are as though objects of mixed sizes were bump-allocated from a few
+// arenas, each in its own far-off address range. Nothing is actually
+// allocated, since the keys are never dereferenced.
+static void fill_arena_pointers(void** array, int count)
 {
     Sequence sequence;
     const u64 a_prime = 1685777;
     seed(&sequence, a_prime);
+
+    u64 tops[arenas_cap];
+    for(int i = 0; i < arenas_cap; i += 1)
+    {
+        const u64 arena_spacing = UINT64_C(0x0000000400000000);
+        tops[i] = mapped_region_base + (arena_spacing * i);
+    }
+
+    for(int i = 0; i < count; i += 1)
+    {
+        int arena = random_int_range(&sequence, 0, arenas_cap - 1);
+        array[i] = reinterpret_cast<void*>(tops[arena]);
+        tops[arena] += pick_object_size(&sequence);
+    }
+}
+
+// These are a page apart, like a header at the start of each page.
+static void fill_strided_pointers(void** array, int count)
+{
+    for(int i = 0; i < count; i += 1)
+    {
+        u64 address = mapped_region_base + (page_stride * i);
+        array[i] = reinterpret_cast<void*>(address);
+    }
+}
+
+// These are keys made to all have the same low half of their map_hash_key,
+// as someone flooding a table with collisions would pick them. Each step of
+// the hash can be undone, so a key can be worked back from any result.
+// Results that differ only in their top half give keys that all have the same
+// home slot in any table that stores its hashes.
+
+static u64 invert_odd(u64 x)
+{
+    // Each round of Newton's method doubles the number of correct low bits.
+    u64 inverse = x;
+    for(int i = 0; i < 5; i += 1)
+    {
+        inverse *= 2 - x * inverse;
+    }
+    return inverse;
+}
+
+static u64 undo_xor_shift(u64 x, int shift)
+{
+    u64 result = x;
+    for(int i = shift; i < 64; i += shift)
+    {
+        result = x ^ (result >> shift);
+    }
+    return result;
+}
+
+static u64 unhash_key(u64 hash)
+{
+    u64 key = hash;
+    key = undo_xor_shift(key, 22);
+    key *= invert_odd(65);
+    key = undo_xor_shift(key, 11);
+    key *= invert_odd(21);
+    key = undo_xor_shift(key, 31);
+    key = (key + 1) * invert_odd((UINT64_C(1) << 18) - 1);
+    return key;
+}
+
+static void fill_colliding(void** array, int count)
+{
     for(int i = 0; i < count; i += 1)
     {
-        int j = random_int_range(&sequence, i, count - 1);
-        void* temp = array[i];
-        array[i] = array[j];
-        array[j] = temp;
+        u64 hash = static_cast<u64>(i + 1) << 32;
+        array[i] = reinterpret_cast<void*>(unhash_key(hash));
     }
 }
 
@@ -200,6 +697,62 @@ static void iterate_map(Map* map)
     }
 }
 
+// Helpers for CuckooMap........................................................
+
+static void delete_table(CuckooMap* map, void** table, int table_count)
+{
+    for(int i = 0; i < table_count; i += 1)
+    {
+        cuckoo_map_remove(map, table[i]);
+    }
+}
+
+static void insert_table(CuckooMap* map, void** table, int table_count,
+    Heap* heap)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < table_count; i += 1)
+    {
+        cuckoo_map_add(map, table[i], dummy, heap);
+    }
+}
+
+static void search_table(CuckooMap* map, void** table, int table_count)
+{
+    for(int i = 0; i < table_count; i += 1)
+    {
+        void* value;
+        bool got = cuckoo_map_get(map, table[i], &value);
+        if(got)
+        {
+            escape(value);
+        }
+    }
+}
+
+static void delete_random_half_and_shuffle(CuckooMap* map, void** table,
+    int table_count)
+{
+    shuffle(table, table_count);
+
+    int half = table_count / 2;
+    for(int i = 0; i < half; i += 1)
+    {
+        cuckoo_map_remove(map, table[i]);
+    }
+
+    shuffle(table, table_count);
+}
+
+static void iterate_map(CuckooMap* map)
+{
+    ITERATE_CUCKOO_MAP(it, map)
+    {
+        void* value = cuckoo_map_iterator_get_value(it);
+        escape(value);
+    }
+}
+
 // Helpers for std::unordered_map...............................................
 
 static void delete_table(hash_t* map, void** table, int table_count)
@@ -253,10 +806,47 @@ static void iterate_map(hash_t* map)
     }
 }
 
+// Unless particular sizes were asked for, this gives only a few sizes to run.
+static int choose_sampled_table_counts(BenchmarkOptions* options,
+    int** table_counts)
+{
+    if(options->table_counts_chosen)
+    {
+        *table_counts = options->table_counts;
+        return options->table_counts_count;
+    }
+    *table_counts = sampled_table_counts;
+    return sampled_table_counts_cap;
+}
+
+// Timing and Counting..........................................................
+
+// The hardware counters are optional, and are skipped when counters is null.
+
+static s64 start_measuring(Clock* clock, PerfCounters* counters)
+{
+    if(counters)
+    {
+        perf_counters_start(counters);
+    }
+    return start_timing(clock);
+}
+
+static s64 stop_measuring(Clock* clock, PerfCounters* counters, s64 start)
+{
+    s64 nanoseconds = stop_timing_nanoseconds(clock, start);
+    if(counters)
+    {
+        perf_counters_stop(counters);
+    }
+    return nanoseconds;
+}
+
 // The Actual Benchmark.........................................................
 
 static void setup_tables(Benchmark* benchmark, void** table, void*** miss_table,
-    int table_count, Subject subject, Map* map, hash_t* u_map, Heap* heap)
+    int table_count, Subject subject, Map* map, CuckooMap* cuckoo_map,
+    hash_t* u_map, Heap* heap)
 {
     switch(benchmark->table_type)
     {
@@ -277,9 +867,14 @@ static void setup_tables(Benchmark* benchmark, void** table, void*** miss_table,
             fill_randomly(table, table_count);
             switch(subject)
             {
-                case Subject::Map:
+                case Subject::Cuckoo_Map:
                 {
-                    map_reserve(map, table_count, heap);
+                    cuckoo_map_reserve(cuckoo_map, table_count, heap);
+                    break;
+                }
+                case Subject::Map:
+                {
+                    map_reserve(map, table_count, heap);
                     break;
                 }
                 case Subject::Unordered_Map:
@@ -296,40 +891,80 @@ static void setup_tables(Benchmark* benchmark, void** table, void*** miss_table,
             shuffle(table, table_count);
             break;
         }
+        case TableType::Arena_Pointers:
+        {
+            fill_arena_pointers(table, table_count);
+            break;
+        }
+        case TableType::Heap_Pointers:
+        {
+            fill_heap_pointers(table, table_count);
+            break;
+        }
+        case TableType::Strided_Pointers:
+        {
+            fill_strided_pointers(table, table_count);
+            break;
+        }
+        case TableType::Pathological:
+        {
+            fill_colliding(table, table_count);
+            break;
+        }
+    }
+}
+
+static void tear_down_tables(Benchmark* benchmark, void** table,
+    int table_count)
+{
+    if(benchmark->table_type == TableType::Heap_Pointers)
+    {
+        free_heap_pointers(table, table_count);
     }
 }
 
 static s64 benchmark_map(Benchmark* benchmark, Map* map, void** table,
-    void** miss_table, int table_count, Clock* clock, Heap* heap)
+    void** miss_table, int table_count, Clock* clock, PerfCounters* counters,
+    Heap* heap)
 {
-    s64 milliseconds = 0;
+    s64 nanoseconds = 0;
 
     switch(benchmark->type)
     {
+        case BenchmarkType::Batch_Deletion:
+        {
+            insert_table(map, table, table_count, heap);
+            shuffle(table, table_count);
+
+            s64 start = start_measuring(clock, counters);
+            map_remove_batch(map, table, table_count);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
         case BenchmarkType::Deletion:
         {
             insert_table(map, table, table_count, heap);
             shuffle(table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             delete_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Insertion:
         {
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             insert_table(map, table, table_count, heap);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Iteration:
         {
             insert_table(map, table, table_count, heap);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             iterate_map(map);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Search:
@@ -337,18 +972,18 @@ static s64 benchmark_map(Benchmark* benchmark, Map* map, void** table,
             insert_table(map, table, table_count, heap);
             shuffle(table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             search_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Search_Misses:
         {
             insert_table(map, table, table_count, heap);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             search_table(map, miss_table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Search_Half_Misses:
@@ -356,47 +991,121 @@ static s64 benchmark_map(Benchmark* benchmark, Map* map, void** table,
             insert_table(map, table, table_count, heap);
             delete_random_half_and_shuffle(map, table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
+            search_table(map, table, table_count);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
+    }
+
+    return nanoseconds;
+}
+
+static s64 benchmark_cuckoo_map(Benchmark* benchmark, CuckooMap* map,
+    void** table, void** miss_table, int table_count, Clock* clock,
+    PerfCounters* counters, Heap* heap)
+{
+    s64 nanoseconds = 0;
+
+    switch(benchmark->type)
+    {
+        // CuckooMap has no batch removal either.
+        case BenchmarkType::Batch_Deletion:
+        case BenchmarkType::Deletion:
+        {
+            insert_table(map, table, table_count, heap);
+            shuffle(table, table_count);
+
+            s64 start = start_measuring(clock, counters);
+            delete_table(map, table, table_count);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
+        case BenchmarkType::Insertion:
+        {
+            s64 start = start_measuring(clock, counters);
+            insert_table(map, table, table_count, heap);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
+        case BenchmarkType::Iteration:
+        {
+            insert_table(map, table, table_count, heap);
+
+            s64 start = start_measuring(clock, counters);
+            iterate_map(map);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
+        case BenchmarkType::Search:
+        {
+            insert_table(map, table, table_count, heap);
+            shuffle(table, table_count);
+
+            s64 start = start_measuring(clock, counters);
+            search_table(map, table, table_count);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
+        case BenchmarkType::Search_Misses:
+        {
+            insert_table(map, table, table_count, heap);
+
+            s64 start = start_measuring(clock, counters);
+            search_table(map, miss_table, table_count);
+            nanoseconds = stop_measuring(clock, counters, start);
+            break;
+        }
+        case BenchmarkType::Search_Half_Misses:
+        {
+            insert_table(map, table, table_count, heap);
+            delete_random_half_and_shuffle(map, table, table_count);
+
+            s64 start = start_measuring(clock, counters);
             search_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
     }
 
-    return milliseconds;
+    return nanoseconds;
 }
 
 static s64 benchmark_unordered_map(Benchmark* benchmark, hash_t* map,
-    void** table, void** miss_table, int table_count, Clock* clock)
+    void** table, void** miss_table, int table_count, Clock* clock,
+    PerfCounters* counters)
 {
-    s64 milliseconds = 0;
+    s64 nanoseconds = 0;
 
     switch(benchmark->type)
     {
+        // There's no batch removal for std::unordered_map, so it deletes
+        // one key at a time in both.
+        case BenchmarkType::Batch_Deletion:
         case BenchmarkType::Deletion:
         {
             insert_table(map, table, table_count);
             shuffle(table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             delete_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Insertion:
         {
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             insert_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Iteration:
         {
             insert_table(map, table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             iterate_map(map);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Search:
@@ -404,18 +1113,18 @@ static s64 benchmark_unordered_map(Benchmark* benchmark, hash_t* map,
             insert_table(map, table, table_count);
             shuffle(table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             search_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Search_Misses:
         {
             insert_table(map, table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             search_table(map, miss_table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
         case BenchmarkType::Search_Half_Misses:
@@ -423,26 +1132,18 @@ static s64 benchmark_unordered_map(Benchmark* benchmark, hash_t* map,
             insert_table(map, table, table_count);
             delete_random_half_and_shuffle(map, table, table_count);
 
-            s64 start = start_timing(clock);
+            s64 start = start_measuring(clock, counters);
             search_table(map, table, table_count);
-            milliseconds = stop_timing(clock, start);
+            nanoseconds = stop_measuring(clock, counters, start);
             break;
         }
     }
 
-    return milliseconds;
+    return nanoseconds;
 }
 
-static void run_benchmark(Heap* heap, FILE* file)
+static void set_up_benchmarks(Benchmark* benchmarks)
 {
-    // Set up for the benchmarks.
-
-    Clock clock;
-    set_up_clock(&clock);
-
-    const int benchmarks_count = 9;
-    Benchmark benchmarks[benchmarks_count];
-
     benchmarks[0].type = BenchmarkType::Insertion;
     benchmarks[0].table_type = TableType::Shuffle;
 
@@ -470,83 +1171,2570 @@ static void run_benchmark(Heap* heap, FILE* file)
     benchmarks[8].type = BenchmarkType::Iteration;
     benchmarks[8].table_type = TableType::Random;
 
-    // Go through all the benchmark specifications and run each of their
-    // benchmarks accordingly.
+    benchmarks[9].type = BenchmarkType::Insertion;
+    benchmarks[9].table_type = TableType::Heap_Pointers;
+
+    benchmarks[10].type = BenchmarkType::Search;
+    benchmarks[10].table_type = TableType::Heap_Pointers;
+
+    benchmarks[11].type = BenchmarkType::Deletion;
+    benchmarks[11].table_type = TableType::Heap_Pointers;
+
+    benchmarks[12].type = BenchmarkType::Insertion;
+    benchmarks[12].table_type = TableType::Arena_Pointers;
+
+    benchmarks[13].type = BenchmarkType::Search;
+    benchmarks[13].table_type = TableType::Arena_Pointers;
+
+    benchmarks[14].type = BenchmarkType::Insertion;
+    benchmarks[14].table_type = TableType::Strided_Pointers;
 
-    for(int i = 0; i < benchmarks_count; i += 1)
+    benchmarks[15].type = BenchmarkType::Search;
+    benchmarks[15].table_type = TableType::Strided_Pointers;
+
+    benchmarks[16].type = BenchmarkType::Batch_Deletion;
+    benchmarks[16].table_type = TableType::Random;
+
+    benchmarks[17].type = BenchmarkType::Insertion;
+    benchmarks[17].table_type = TableType::Pathological;
+
+    benchmarks[18].type = BenchmarkType::Search;
+    benchmarks[18].table_type = TableType::Pathological;
+}
+
+// Sets up fresh tables and runs the benchmark once, giving how long its timed
+// part took in nanoseconds.
+static s64 run_benchmark_once(Benchmark* benchmark, Subject subject,
+    int table_count, Clock* clock, PerfCounters* counters, Heap* heap)
+{
+    Map map = {};
+    map_create(&map, heap);
+    CuckooMap cuckoo_map = {};
+    cuckoo_map_create(&cuckoo_map, heap);
+    hash_t u_map;
+    void** table = HEAP_ALLOCATE(heap, void*, table_count);
+    void** miss_table = nullptr;
+
+    setup_tables(benchmark, table, &miss_table, table_count, subject, &map,
+            &cuckoo_map, &u_map, heap);
+
+    s64 nanoseconds = 0;
+    switch(subject)
     {
-        Benchmark* benchmark = &benchmarks[i];
+        case Subject::Cuckoo_Map:
+        {
+            nanoseconds = benchmark_cuckoo_map(benchmark, &cuckoo_map, table,
+                    miss_table, table_count, clock, counters, heap);
+            break;
+        }
+        case Subject::Map:
+        {
+            nanoseconds = benchmark_map(benchmark, &map, table, miss_table,
+                    table_count, clock, counters, heap);
+            break;
+        }
+        case Subject::Unordered_Map:
+        {
+            nanoseconds = benchmark_unordered_map(benchmark, &u_map, table,
+                    miss_table, table_count, clock, counters);
+            break;
+        }
+    }
+
+    tear_down_tables(benchmark, table, table_count);
+    SAFE_HEAP_DEALLOCATE(heap, table);
+    SAFE_HEAP_DEALLOCATE(heap, miss_table);
+    map_destroy(&map, heap);
+    cuckoo_map_destroy(&cuckoo_map, heap);
+
+    return nanoseconds;
+}
+
+static void sort_timings(s64* timings, int count)
+{
+    for(int i = 1; i < count; i += 1)
+    {
+        s64 timing = timings[i];
+        int j = i - 1;
+        for(; j >= 0 && timings[j] > timing; j -= 1)
+        {
+            timings[j + 1] = timings[j];
+        }
+        timings[j + 1] = timing;
+    }
+}
+
+static BenchmarkResult summarise_timings(s64* timings, int count)
+{
+    sort_timings(timings, count);
+
+    BenchmarkResult result;
+    result.min = timings[0];
+    result.max = timings[count - 1];
+
+    int middle = count / 2;
+    if(count % 2 == 0)
+    {
+        result.median = (timings[middle - 1] + timings[middle]) / 2.0;
+    }
+    else
+    {
+        result.median = timings[middle];
+    }
+
+    double sum = 0.0;
+    for(int i = 0; i < count; i += 1)
+    {
+        sum += timings[i];
+    }
+    result.mean = sum / count;
+
+    double squares = 0.0;
+    for(int i = 0; i < count; i += 1)
+    {
+        double difference = timings[i] - result.mean;
+        squares += difference * difference;
+    }
+    if(count > 1)
+    {
+        result.standard_deviation = sqrt(squares / (count - 1));
+    }
+    else
+    {
+        result.standard_deviation = 0.0;
+    }
+
+    return result;
+}
+
+// Names given on the command line and written in results are the same as the
+// descriptions, but in lowercase and with hyphens or underscores instead of
+// spaces.
+static void print_name(FILE* file, const char* description, char space)
+{
+    for(int i = 0; description[i]; i += 1)
+    {
+        char c = description[i];
+        fputc((c == ' ') ? space : tolower(c), file);
+    }
+}
+
+static void report_counts(FILE* file, BenchmarkOptions* options,
+    Benchmark* benchmark)
+{
+    fprintf(file, " hardware counters per operation\n");
+    fprintf(file, " %13s | %8s |", "subject", "in table");
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        if(options->counted[i])
+        {
+            PerfCounter counter = static_cast<PerfCounter>(i);
+            fprintf(file, " %13s |", describe_perf_counter(counter));
+        }
+    }
+    fprintf(file, "\n");
+
+    for(int i = 0; i < options->subjects_count; i += 1)
+    {
+        const char* subject = describe_subject(options->subjects[i]);
 
-        for(int j = 0; j < subjects_cap; j += 1)
+        for(int j = 0; j < options->table_counts_count; j += 1)
         {
-            Subject subject = subjects[j];
+            fprintf(file, " %13s | %8d |", subject, options->table_counts[j]);
+            for(int k = 0; k < perf_counters_cap; k += 1)
+            {
+                if(options->counted[k])
+                {
+                    double count = benchmark->counts_per_operation[i][j][k];
+                    fprintf(file, " %13.3f |", count);
+                }
+            }
+            fprintf(file, "\n");
+        }
+    }
+
+    fprintf(file, "\n");
+}
 
-            for(int k = 0; k < table_counts_cap; k += 1)
+static void write_results_csv(FILE* file, BenchmarkOptions* options,
+    Benchmark* benchmarks)
+{
+    fprintf(file, "benchmark,table_setup,subject,table_count,repetitions,"
+            "median_ns,mean_ns,stddev_ns,min_ns,max_ns");
+    if(options->count_events)
+    {
+        for(int i = 0; i < perf_counters_cap; i += 1)
+        {
+            if(!options->counted[i])
             {
-                int table_count = table_counts[k];
+                continue;
+            }
+            PerfCounter counter = static_cast<PerfCounter>(i);
+            fputc(',', file);
+            print_name(file, describe_perf_counter(counter), '_');
+            fprintf(file, "_per_op");
+        }
+    }
+    fputc('\n', file);
 
-                Map map = {};
-                map_create(&map, heap);
-                hash_t u_map;
-                void** table = HEAP_ALLOCATE(heap, void*, table_count);
-                void** miss_table = nullptr;
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        if(!options->selected[i])
+        {
+            continue;
+        }
+        Benchmark* benchmark = &benchmarks[i];
+        const char* type = describe_benchmark_type(benchmark->type);
+        const char* table_type = describe_table_type(benchmark->table_type);
 
-                setup_tables(benchmark, table, &miss_table, table_count,
-                        subject, &map, &u_map, heap);
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            const char* subject = describe_subject(options->subjects[j]);
 
-                s64 milliseconds = 0;
-                switch(subject)
+            for(int k = 0; k < options->table_counts_count; k += 1)
+            {
+                BenchmarkResult* result = &benchmark->results[j][k];
+                fprintf(file, "%s,%s,%s,%d,%d,%.0f,%.0f,%.0f,%" PRId64 ",%"
+                        PRId64, type, table_type, subject,
+                        options->table_counts[k], options->repetitions,
+                        result->median, result->mean,
+                        result->standard_deviation, result->min, result->max);
+                if(options->count_events)
                 {
-                    case Subject::Map:
-                    {
-                        milliseconds = benchmark_map(benchmark, &map, table,
-                                miss_table, table_count, &clock, heap);
-                        break;
-                    }
-                    case Subject::Unordered_Map:
+                    double* counts = benchmark->counts_per_operation[j][k];
+                    for(int l = 0; l < perf_counters_cap; l += 1)
                     {
-                        milliseconds = benchmark_unordered_map(benchmark,
-                                &u_map, table, miss_table, table_count, &clock);
-                        break;
+                        if(options->counted[l])
+                        {
+                            fprintf(file, ",%.4f", counts[l]);
+                        }
                     }
                 }
+                fputc('\n', file);
+            }
+        }
+    }
+}
+
+static void write_results_json(FILE* file, BenchmarkOptions* options,
+    Benchmark* benchmarks)
+{
+    fprintf(file, "{\n");
+    fprintf(file, "  \"warm_ups\": %d,\n", options->warm_ups);
+    fprintf(file, "  \"repetitions\": %d,\n", options->repetitions);
+    fprintf(file, "  \"cpu\": %d,\n", options->pin ? options->cpu : -1);
+    fprintf(file, "  \"results\": [");
+
+    const char* separator = "\n";
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        if(!options->selected[i])
+        {
+            continue;
+        }
+        Benchmark* benchmark = &benchmarks[i];
+        const char* type = describe_benchmark_type(benchmark->type);
+        const char* table_type = describe_table_type(benchmark->table_type);
 
-                benchmark->milliseconds[j][k] = milliseconds;
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            const char* subject = describe_subject(options->subjects[j]);
 
-                SAFE_HEAP_DEALLOCATE(heap, table);
-                SAFE_HEAP_DEALLOCATE(heap, miss_table);
-                map_destroy(&map, heap);
+            for(int k = 0; k < options->table_counts_count; k += 1)
+            {
+                BenchmarkResult* result = &benchmark->results[j][k];
+                fprintf(file, "%s    {\"benchmark\": \"%s\", "
+                        "\"table_setup\": \"%s\", \"subject\": \"%s\", "
+                        "\"table_count\": %d, \"median_ns\": %.0f, "
+                        "\"mean_ns\": %.0f, \"stddev_ns\": %.0f, "
+                        "\"min_ns\": %" PRId64 ", \"max_ns\": %" PRId64,
+                        separator, type, table_type, subject,
+                        options->table_counts[k], result->median,
+                        result->mean, result->standard_deviation, result->min,
+                        result->max);
+                if(options->count_events)
+                {
+                    double* counts = benchmark->counts_per_operation[j][k];
+                    for(int l = 0; l < perf_counters_cap; l += 1)
+                    {
+                        if(!options->counted[l])
+                        {
+                            continue;
+                        }
+                        PerfCounter counter = static_cast<PerfCounter>(l);
+                        fprintf(file, ", \"");
+                        print_name(file, describe_perf_counter(counter), '_');
+                        fprintf(file, "_per_op\": %.4f", counts[l]);
+                    }
+                }
+                fputc('}', file);
+                separator = ",\n";
             }
         }
     }
 
-    // Report the findings recorded for each benchmark.
+    fprintf(file, "\n  ]\n}\n");
+}
+
+// Baseline Comparison..........................................................
+
+// A baseline is just the CSV results of an earlier run. A benchmark counts as
+// a regression only when its median is slower by more than the threshold and
+// also by more than the noise of both runs could explain, so that normal
+// run-to-run spread doesn't trip it.
+
+namespace
+{
+    const double noise_deviations = 3.0;
+    const int baseline_name_cap = 64;
+}
+
+struct BaselineEntry
+{
+    char type[baseline_name_cap];
+    char table_type[baseline_name_cap];
+    char subject[baseline_name_cap];
+    double median;
+    double standard_deviation;
+    int table_count;
+};
 
-    for(int i = 0; i < benchmarks_count; i += 1)
+static bool save_baseline(BenchmarkOptions* options, Benchmark* benchmarks)
+{
+    FILE* file = fopen(options->save_baseline_path, "w");
+    if(!file)
     {
-        Benchmark* benchmark = &benchmarks[i];
+        fprintf(stderr, "Failed to open %s for writing.\n",
+                options->save_baseline_path);
+        return false;
+    }
+    write_results_csv(file, options, benchmarks);
+    fclose(file);
+    return true;
+}
 
-        const char* type = describe_benchmark_type(benchmark->type);
-        const char* table_type = describe_table_type(benchmark->table_type);
-        fprintf(file, "benchmark: %s — table setup: %s\n", type, table_type);
+static bool read_baseline_entry(FILE* file, BaselineEntry* entry)
+{
+    char line[512];
+    if(!fgets(line, sizeof(line), file))
+    {
+        return false;
+    }
+    int repetitions;
+    double mean;
+    int read = sscanf(line, "%63[^,],%63[^,],%63[^,],%d,%d,%lf,%lf,%lf",
+            entry->type, entry->table_type, entry->subject,
+            &entry->table_count, &repetitions, &entry->median, &mean,
+            &entry->standard_deviation);
+    if(read != 8)
+    {
+        entry->table_count = 0;
+    }
+    return true;
+}
 
-        for(int j = 0; j < subjects_cap; j += 1)
+// Compares every result of this run with the same one in the baseline, if it
+// has it, and reports any that got slower. This gives false if any did, and
+// also if the baseline had none of this run's results, since then nothing was
+// checked.
+static bool compare_with_baseline(BenchmarkOptions* options,
+    Benchmark* benchmarks, FILE* file)
+{
+    FILE* baseline = fopen(options->compare_baseline_path, "r");
+    if(!baseline)
+    {
+        fprintf(file, "baseline: failed to open %s\n\n",
+                options->compare_baseline_path);
+        return false;
+    }
+
+    fprintf(file, "baseline: comparing with %s, where a regression is a "
+            "median more than %.1f%% slower and beyond the noise\n",
+            options->compare_baseline_path, 100.0 * options->threshold);
+
+    int compared = 0;
+    int regressions = 0;
+
+    BaselineEntry entry;
+    while(read_baseline_entry(baseline, &entry))
+    {
+        if(entry.table_count == 0)
         {
-            const char* subject = describe_subject(subjects[j]);
-            fprintf(file, " %13s |", subject);
+            continue;
         }
-        fprintf(file, " in table\n");
 
-        for(int j = 0; j < table_counts_cap; j += 1)
+        for(int i = 0; i < benchmarks_cap; i += 1)
         {
-            for(int k = 0; k < subjects_cap; k += 1)
+            if(!options->selected[i])
             {
-                s64 milliseconds = benchmark->milliseconds[k][j];
-                fprintf(file, " %11" PRId64 "ms |", milliseconds);
+                continue;
+            }
+            Benchmark* benchmark = &benchmarks[i];
+            const char* type = describe_benchmark_type(benchmark->type);
+            const char* table_type = describe_table_type(benchmark->table_type);
+            if(strcmp(type, entry.type) != 0
+                || strcmp(table_type, entry.table_type) != 0)
+            {
+                continue;
             }
-            fprintf(file, " %7d\n", table_counts[j]);
-        }
 
-        fprintf(file, "\n");
+            for(int j = 0; j < options->subjects_count; j += 1)
+            {
+                const char* subject = describe_subject(options->subjects[j]);
+                if(strcmp(subject, entry.subject) != 0)
+                {
+                    continue;
+                }
+
+                for(int k = 0; k < options->table_counts_count; k += 1)
+                {
+                    if(options->table_counts[k] != entry.table_count)
+                    {
+                        continue;
+                    }
+
+                    BenchmarkResult* result = &benchmark->results[j][k];
+                    double difference = result->median - entry.median;
+                    double noise = noise_deviations
+                        * sqrt((result->standard_deviation
+                            * result->standard_deviation)
+                        + (entry.standard_deviation
+                            * entry.standard_deviation));
+                    double allowed = options->threshold * entry.median;
+                    if(noise > allowed)
+                    {
+                        allowed = noise;
+                    }
+
+                    compared += 1;
+                    if(difference > allowed)
+                    {
+                        regressions += 1;
+                        double change = 100.0 * difference / entry.median;
+                        fprintf(file, " regression: %s — %s — %s — %d in "
+                                "table: %.2fms to %.2fms (+%.1f%%)\n",
+                                type, table_type, subject, entry.table_count,
+                                entry.median / 1e6, result->median / 1e6,
+                                change);
+                    }
+                }
+            }
+        }
+    }
+
+    fclose(baseline);
+
+    if(compared == 0)
+    {
+        fprintf(file, "baseline: %s has none of the benchmarks, subjects, "
+                "and sizes run here\n\n", options->compare_baseline_path);
+        return false;
+    }
+
+    fprintf(file, "baseline: %d of %d compared results regressed\n\n",
+            regressions, compared);
+
+    return regressions == 0;
+}
+
+static bool run_benchmark(BenchmarkOptions* options, Heap* heap, FILE* file)
+{
+    // Set up for the benchmarks.
+
+    Clock clock;
+    set_up_clock(&clock);
+
+    Benchmark* benchmarks = HEAP_ALLOCATE(heap, Benchmark, benchmarks_cap);
+    set_up_benchmarks(benchmarks);
+
+    s64* timings = HEAP_ALLOCATE(heap, s64, options->repetitions);
+
+    PerfCounters perf_counters;
+    PerfCounters* counters = nullptr;
+    if(options->count_events)
+    {
+        if(perf_counters_open(&perf_counters))
+        {
+            counters = &perf_counters;
+            for(int i = 0; i < perf_counters_cap; i += 1)
+            {
+                options->counted[i] = counters->available[i];
+            }
+        }
+        else
+        {
+            fprintf(file, "hardware counters aren't available here, so only "
+                    "times will be reported\n\n");
+            options->count_events = false;
+        }
+    }
+
+    // Go through all the benchmark specifications and run each of their
+    // benchmarks accordingly. Warm-up runs are done first and thrown away, so
+    // that the timed runs don't pay for faulting in fresh memory or for the
+    // processor ramping up its clock speed.
+
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        if(!options->selected[i])
+        {
+            continue;
+        }
+        Benchmark* benchmark = &benchmarks[i];
+
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            Subject subject = options->subjects[j];
+
+            for(int k = 0; k < options->table_counts_count; k += 1)
+            {
+                int table_count = options->table_counts[k];
+
+                for(int l = 0; l < options->warm_ups; l += 1)
+                {
+                    run_benchmark_once(benchmark, subject, table_count, &clock,
+                            nullptr, heap);
+                }
+
+                double* counts = benchmark->counts_per_operation[j][k];
+                for(int l = 0; l < perf_counters_cap; l += 1)
+                {
+                    counts[l] = 0.0;
+                }
+
+                for(int l = 0; l < options->repetitions; l += 1)
+                {
+                    timings[l] = run_benchmark_once(benchmark, subject,
+                            table_count, &clock, counters, heap);
+                    if(counters)
+                    {
+                        for(int m = 0; m < perf_counters_cap; m += 1)
+                        {
+                            counts[m] += counters->values[m];
+                        }
+                    }
+                }
+
+                benchmark->results[j][k] =
+                    summarise_timings(timings, options->repetitions);
+
+                // Every benchmark does one operation per pair in the table.
+                double operations =
+                    static_cast<double>(table_count) * options->repetitions;
+                for(int l = 0; l < perf_counters_cap; l += 1)
+                {
+                    counts[l] /= operations;
+                }
+            }
+        }
+    }
+
+    // Report the findings recorded for each benchmark.
+
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        if(!options->selected[i])
+        {
+            continue;
+        }
+        Benchmark* benchmark = &benchmarks[i];
+
+        const char* type = describe_benchmark_type(benchmark->type);
+        const char* table_type = describe_table_type(benchmark->table_type);
+        fprintf(file, "benchmark: %s — table setup: %s — median of %d runs "
+                "(relative standard deviation)\n", type, table_type,
+                options->repetitions);
+
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            const char* subject = describe_subject(options->subjects[j]);
+            fprintf(file, " %19s |", subject);
+        }
+        fprintf(file, " in table\n");
+
+        for(int j = 0; j < options->table_counts_count; j += 1)
+        {
+            for(int k = 0; k < options->subjects_count; k += 1)
+            {
+                BenchmarkResult* result = &benchmark->results[k][j];
+                double milliseconds = result->median / 1e6;
+                double deviation = 0.0;
+                if(result->mean > 0.0)
+                {
+                    deviation = 100.0 * result->standard_deviation
+                        / result->mean;
+                }
+                fprintf(file, " %8.2fms (%5.1f%%) |", milliseconds, deviation);
+            }
+            fprintf(file, " %7d\n", options->table_counts[j]);
+        }
+
+        fprintf(file, "\n");
+
+        if(counters)
+        {
+            report_counts(file, options, benchmark);
+        }
+    }
+
+    // Write out the same findings in a form other programs can read.
+
+    if(options->output_format != OutputFormat::None)
+    {
+        FILE* output = file;
+        if(options->output_path)
+        {
+            output = fopen(options->output_path, "w");
+            if(!output)
+            {
+                fprintf(stderr, "Failed to open %s for writing.\n",
+                        options->output_path);
+            }
+        }
+        if(output)
+        {
+            switch(options->output_format)
+            {
+                case OutputFormat::None:
+                {
+                    break;
+                }
+                case OutputFormat::Csv:
+                {
+                    write_results_csv(output, options, benchmarks);
+                    break;
+                }
+                case OutputFormat::Json:
+                {
+                    write_results_json(output, options, benchmarks);
+                    break;
+                }
+            }
+            if(output != file)
+            {
+                fclose(output);
+            }
+        }
+    }
+
+    // Check against, or save, a baseline.
+
+    bool passed = true;
+    if(options->compare_baseline_path)
+    {
+        passed = compare_with_baseline(options, benchmarks, file);
+    }
+    if(options->save_baseline_path)
+    {
+        passed = save_baseline(options, benchmarks) && passed;
+    }
+
+    if(counters)
+    {
+        perf_counters_close(counters);
+    }
+
+    SAFE_HEAP_DEALLOCATE(heap, timings);
+    SAFE_HEAP_DEALLOCATE(heap, benchmarks);
+
+    return passed;
+}
+
+// Latency Histogram............................................................
+
+// This is a log-linear histogram in the style of HdrHistogram. Values below
+// the sub-bucket count get a bucket each, and every power of two above that
+// is split into half as many linear sub-buckets, which keeps each bucket
+// within about 6% of the values it holds.
+namespace
+{
+    const int latency_sub_bucket_bits = 5;
+    const int latency_sub_buckets = 1 << latency_sub_bucket_bits;
+    const int latency_half_sub_buckets = latency_sub_buckets / 2;
+    const int latency_buckets_cap = 640;
+}
+
+struct LatencyHistogram
+{
+    u64 counts[latency_buckets_cap];
+    u64 total;
+    s64 max;
+};
+
+static int find_latency_bucket(s64 value)
+{
+    if(value < latency_sub_buckets)
+    {
+        return value;
+    }
+
+    int magnitude = latency_sub_bucket_bits;
+    while(value >> (magnitude + 1))
+    {
+        magnitude += 1;
+    }
+    int shift = magnitude - (latency_sub_bucket_bits - 1);
+    int sub_bucket = (value >> shift) - latency_half_sub_buckets;
+    int bucket = latency_sub_buckets + (latency_half_sub_buckets * (shift - 1))
+        + sub_bucket;
+    if(bucket >= latency_buckets_cap)
+    {
+        bucket = latency_buckets_cap - 1;
+    }
+    return bucket;
+}
+
+// Gives the largest value that would land in the given bucket.
+static s64 get_latency_bucket_value(int bucket)
+{
+    if(bucket < latency_sub_buckets)
+    {
+        return bucket;
+    }
+    int offset = bucket - latency_sub_buckets;
+    int shift = (offset / latency_half_sub_buckets) + 1;
+    s64 sub_bucket = (offset % latency_half_sub_buckets)
+        + latency_half_sub_buckets;
+    return ((sub_bucket + 1) << shift) - 1;
+}
+
+static void record_latency(LatencyHistogram* histogram, s64 nanoseconds)
+{
+    if(nanoseconds < 0)
+    {
+        nanoseconds = 0;
+    }
+    histogram->counts[find_latency_bucket(nanoseconds)] += 1;
+    histogram->total += 1;
+    if(nanoseconds > histogram->max)
+    {
+        histogram->max = nanoseconds;
+    }
+}
+
+static s64 get_latency_percentile(LatencyHistogram* histogram,
+    double percentile)
+{
+    u64 wanted = static_cast<u64>((percentile / 100.0) * histogram->total);
+    if(wanted >= histogram->total)
+    {
+        return histogram->max;
+    }
+    u64 seen = 0;
+    for(int i = 0; i < latency_buckets_cap; i += 1)
+    {
+        seen += histogram->counts[i];
+        if(seen > wanted)
+        {
+            s64 value = get_latency_bucket_value(i);
+            return (value < histogram->max) ? value : histogram->max;
+        }
+    }
+    return histogram->max;
+}
+
+// Latency Benchmark............................................................
+
+// Each operation is timed on its own, rather than timing the whole loop, so
+// that rare slow operations like a map growing show up instead of being
+// averaged away.
+
+enum class LatencyOperation
+{
+    Insert,
+    Insert_Grow,
+    Search,
+    Search_Miss,
+    Delete,
+};
+
+namespace
+{
+    const int latency_operations_cap = 5;
+
+    LatencyOperation latency_operations[latency_operations_cap] =
+    {
+        LatencyOperation::Insert,
+        LatencyOperation::Insert_Grow,
+        LatencyOperation::Search,
+        LatencyOperation::Search_Miss,
+        LatencyOperation::Delete,
+    };
+}
+
+static const char* describe_latency_operation(LatencyOperation operation)
+{
+    switch(operation)
+    {
+        default:
+        case LatencyOperation::Insert: return "Insert";
+        case LatencyOperation::Insert_Grow: return "Insert (Grows Only)";
+        case LatencyOperation::Search: return "Search";
+        case LatencyOperation::Search_Miss: return "Search Miss";
+        case LatencyOperation::Delete: return "Delete";
+    }
+}
+
+// Finds the least time that can be measured, which is mostly the cost of
+// reading the clock, so it can be taken off of every sample.
+static s64 measure_timing_overhead(Clock* clock)
+{
+    s64 least = INT64_MAX;
+    for(int i = 0; i < 1000; i += 1)
+    {
+        s64 start = start_timing(clock);
+        s64 cycles = stop_timing_cycles(clock, start);
+        if(cycles < least)
+        {
+            least = cycles;
+        }
+    }
+    return least;
+}
+
+// The overhead is in cycles, and is taken off before a sample's converted to
+// nanoseconds, so that no rounding's added to a time that's only a few dozen
+// cycles to begin with.
+static s64 stop_timing_sample(Clock* clock, s64 start, s64 overhead)
+{
+    s64 cycles = stop_timing_cycles(clock, start) - overhead;
+    return get_nanoseconds_from_cycles(clock, cycles);
+}
+
+static void fill_misses(void** array, int count)
+{
+    Sequence sequence;
+    const u64 another_prime = 4256249;
+    seed(&sequence, another_prime);
+    for(int i = 0; i < count; i += 1)
+    {
+        // The keys made by fill_randomly are ints sign-extended to a pointer,
+        // so the top half of each is either all zeros or all ones. Setting
+        // bit 32 and clearing bit 63 rules out both, so that a miss key can
+        // never be one of them.
+        u64 j = generate(&sequence) | (UINT64_C(1) << 32);
+        j &= ~(UINT64_C(1) << 63);
+        array[i] = reinterpret_cast<void*>(j);
+    }
+}
+
+static void time_map_operations(LatencyHistogram* histograms, void** table,
+    void** miss_table, int table_count, s64 overhead, Clock* clock, Heap* heap)
+{
+    Map map = {};
+    map_create(&map, heap);
+
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < table_count; i += 1)
+    {
+        int prior_grows = map.grows;
+        s64 start = start_timing(clock);
+        map_add(&map, table[i], dummy, heap);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[0], nanoseconds);
+        if(map.grows != prior_grows)
+        {
+            record_latency(&histograms[1], nanoseconds);
+        }
+    }
+
+    shuffle(table, table_count);
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        void* value;
+        s64 start = start_timing(clock);
+        bool got = map_get(&map, table[i], &value);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[2], nanoseconds);
+        if(got)
+        {
+            escape(value);
+        }
+    }
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        void* value;
+        s64 start = start_timing(clock);
+        bool got = map_get(&map, miss_table[i], &value);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[3], nanoseconds);
+        if(got)
+        {
+            escape(value);
+        }
+    }
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        s64 start = start_timing(clock);
+        map_remove(&map, table[i]);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[4], nanoseconds);
+    }
+
+    map_destroy(&map, heap);
+}
+
+static void time_cuckoo_map_operations(LatencyHistogram* histograms,
+    void** table, void** miss_table, int table_count, s64 overhead,
+    Clock* clock, Heap* heap)
+{
+    CuckooMap map = {};
+    cuckoo_map_create(&map, heap);
+
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < table_count; i += 1)
+    {
+        int prior_grows = map.grows;
+        s64 start = start_timing(clock);
+        cuckoo_map_add(&map, table[i], dummy, heap);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[0], nanoseconds);
+        if(map.grows != prior_grows)
+        {
+            record_latency(&histograms[1], nanoseconds);
+        }
+    }
+
+    shuffle(table, table_count);
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        void* value;
+        s64 start = start_timing(clock);
+        bool got = cuckoo_map_get(&map, table[i], &value);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[2], nanoseconds);
+        if(got)
+        {
+            escape(value);
+        }
+    }
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        void* value;
+        s64 start = start_timing(clock);
+        bool got = cuckoo_map_get(&map, miss_table[i], &value);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[3], nanoseconds);
+        if(got)
+        {
+            escape(value);
+        }
+    }
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        s64 start = start_timing(clock);
+        cuckoo_map_remove(&map, table[i]);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[4], nanoseconds);
+    }
+
+    cuckoo_map_destroy(&map, heap);
+}
+
+static void time_unordered_map_operations(LatencyHistogram* histograms,
+    void** table, void** miss_table, int table_count, s64 overhead,
+    Clock* clock)
+{
+    hash_t map;
+
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < table_count; i += 1)
+    {
+        size_t prior_buckets = map.bucket_count();
+        s64 start = start_timing(clock);
+        map.insert(hash_t::value_type(table[i], dummy));
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[0], nanoseconds);
+        if(map.bucket_count() != prior_buckets)
+        {
+            record_latency(&histograms[1], nanoseconds);
+        }
+    }
+
+    shuffle(table, table_count);
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        s64 start = start_timing(clock);
+        auto found = map.find(table[i]);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[2], nanoseconds);
+        if(found != map.end())
+        {
+            escape(found->second);
+        }
+    }
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        s64 start = start_timing(clock);
+        auto found = map.find(miss_table[i]);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[3], nanoseconds);
+        if(found != map.end())
+        {
+            escape(found->second);
+        }
+    }
+
+    for(int i = 0; i < table_count; i += 1)
+    {
+        s64 start = start_timing(clock);
+        map.erase(table[i]);
+        s64 nanoseconds = stop_timing_sample(clock, start, overhead);
+        record_latency(&histograms[4], nanoseconds);
+    }
+}
+
+static void run_latency_benchmark(BenchmarkOptions* options, Heap* heap,
+    FILE* file)
+{
+    Clock clock;
+    set_up_clock(&clock);
+
+    if(clock.counts_cycles)
+    {
+        double gigahertz = clock.frequency / 1e9;
+        fprintf(file, "latency: timed by the timestamp counter at %.2fGHz\n",
+                gigahertz);
+    }
+    else
+    {
+        fprintf(file, "latency: timed by the system clock\n");
+    }
+    s64 overhead = measure_timing_overhead(&clock);
+    fprintf(file, "latency: timing overhead of %" PRId64 "ns taken off of "
+            "each operation\n\n",
+            get_nanoseconds_from_cycles(&clock, overhead));
+
+    LatencyHistogram* histograms = HEAP_ALLOCATE(heap, LatencyHistogram,
+            options->subjects_count * latency_operations_cap);
+
+    // Every operation at every size is recorded, so only a few sizes are run.
+    int* table_counts;
+    int table_counts_count = choose_sampled_table_counts(options,
+            &table_counts);
+
+    for(int i = 0; i < table_counts_count; i += 1)
+    {
+        int table_count = table_counts[i];
+
+        int histograms_count = options->subjects_count * latency_operations_cap;
+        for(int j = 0; j < histograms_count; j += 1)
+        {
+            histograms[j] = {};
+        }
+
+        void** table = HEAP_ALLOCATE(heap, void*, table_count);
+        void** miss_table = HEAP_ALLOCATE(heap, void*, table_count);
+
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            fill_randomly(table, table_count);
+            fill_misses(miss_table, table_count);
+
+            LatencyHistogram* subject_histograms =
+                &histograms[latency_operations_cap * j];
+            switch(options->subjects[j])
+            {
+                case Subject::Cuckoo_Map:
+                {
+                    time_cuckoo_map_operations(subject_histograms, table,
+                            miss_table, table_count, overhead, &clock, heap);
+                    break;
+                }
+                case Subject::Map:
+                {
+                    time_map_operations(subject_histograms, table, miss_table,
+                            table_count, overhead, &clock, heap);
+                    break;
+                }
+                case Subject::Unordered_Map:
+                {
+                    time_unordered_map_operations(subject_histograms, table,
+                            miss_table, table_count, overhead, &clock);
+                    break;
+                }
+            }
+        }
+
+        SAFE_HEAP_DEALLOCATE(heap, table);
+        SAFE_HEAP_DEALLOCATE(heap, miss_table);
+
+        // Report the percentiles for each operation at this table size.
+
+        fprintf(file, "latency: %d in table\n", table_count);
+        fprintf(file, " %-19s | %13s | %12s | %12s | %12s | %12s\n",
+                "operation", "subject", "p50", "p99", "p99.9", "max");
+        for(int j = 0; j < latency_operations_cap; j += 1)
+        {
+            const char* operation =
+                describe_latency_operation(latency_operations[j]);
+            for(int k = 0; k < options->subjects_count; k += 1)
+            {
+                LatencyHistogram* histogram =
+                    &histograms[(latency_operations_cap * k) + j];
+                const char* subject = describe_subject(options->subjects[k]);
+                fprintf(file, " %-19s | %13s |", operation, subject);
+                if(histogram->total == 0)
+                {
+                    fprintf(file, " %12s | %12s | %12s | %12s\n", "-", "-",
+                            "-", "-");
+                    continue;
+                }
+                s64 p50 = get_latency_percentile(histogram, 50.0);
+                s64 p99 = get_latency_percentile(histogram, 99.0);
+                s64 p999 = get_latency_percentile(histogram, 99.9);
+                fprintf(file, " %10" PRId64 "ns | %10" PRId64 "ns | %10" PRId64
+                        "ns | %10" PRId64 "ns\n", p50, p99, p999,
+                        histogram->max);
+            }
+        }
+        fprintf(file, "\n");
+    }
+
+    SAFE_HEAP_DEALLOCATE(heap, histograms);
+}
+
+// Mixed Workload...............................................................
+
+// The keys are drawn from a set twice the size of the table, which starts out
+// with every other key in it. When adds and removes are equally likely, every
+// key spends about half its time in the table, so the table stays around the
+// same size for the whole run.
+
+namespace
+{
+    const double zipf_theta = 0.99;
+    const double hot_set = 0.2;
+    const double hot_operations = 0.8;
+}
+
+enum class MixedOperation
+{
+    Get,
+    Add,
+    Remove,
+};
+
+struct MixedStep
+{
+    void* key;
+    MixedOperation operation;
+};
+
+// The steps are all picked before the run, so that drawing random numbers
+// isn't part of what's timed, and so every subject runs the same steps.
+static void generate_steps(MixedStep* steps, int steps_count, void** keys,
+    int keys_count, Workload* workload, KeyDistribution distribution,
+    Zipf* zipf, int stream)
+{
+    Sequence sequence;
+    const u64 a_prime = 7352461;
+    seed(&sequence, a_prime + stream);
+
+    for(int i = 0; i < steps_count; i += 1)
+    {
+        u64 rank = 0;
+        switch(distribution)
+        {
+            case KeyDistribution::Uniform:
+            {
+                rank = generate(&sequence) % keys_count;
+                break;
+            }
+            case KeyDistribution::Zipfian:
+            {
+                rank = zipf_generate(zipf, &sequence);
+                break;
+            }
+            case KeyDistribution::Hotspot:
+            {
+                rank = hotspot_generate(&sequence, keys_count, hot_set,
+                        hot_operations);
+                break;
+            }
+        }
+        steps[i].key = keys[rank];
+
+        int roll = random_int_range(&sequence, 0, 99);
+        if(roll < workload->get_percent)
+        {
+            steps[i].operation = MixedOperation::Get;
+        }
+        else if(roll < workload->get_percent + workload->add_percent)
+        {
+            steps[i].operation = MixedOperation::Add;
+        }
+        else
+        {
+            steps[i].operation = MixedOperation::Remove;
+        }
+    }
+}
+
+static void run_steps(Map* map, MixedStep* steps, int steps_count, Heap* heap)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < steps_count; i += 1)
+    {
+        MixedStep* step = &steps[i];
+        switch(step->operation)
+        {
+            case MixedOperation::Get:
+            {
+                void* value;
+                bool got = map_get(map, step->key, &value);
+                if(got)
+                {
+                    escape(value);
+                }
+                break;
+            }
+            case MixedOperation::Add:
+            {
+                map_add(map, step->key, dummy, heap);
+                break;
+            }
+            case MixedOperation::Remove:
+            {
+                map_remove(map, step->key);
+                break;
+            }
+        }
+    }
+}
+
+static void run_steps(CuckooMap* map, MixedStep* steps, int steps_count,
+    Heap* heap)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < steps_count; i += 1)
+    {
+        MixedStep* step = &steps[i];
+        switch(step->operation)
+        {
+            case MixedOperation::Get:
+            {
+                void* value;
+                bool got = cuckoo_map_get(map, step->key, &value);
+                if(got)
+                {
+                    escape(value);
+                }
+                break;
+            }
+            case MixedOperation::Add:
+            {
+                cuckoo_map_add(map, step->key, dummy, heap);
+                break;
+            }
+            case MixedOperation::Remove:
+            {
+                cuckoo_map_remove(map, step->key);
+                break;
+            }
+        }
+    }
+}
+
+static void run_steps(hash_t* map, MixedStep* steps, int steps_count)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < steps_count; i += 1)
+    {
+        MixedStep* step = &steps[i];
+        switch(step->operation)
+        {
+            case MixedOperation::Get:
+            {
+                auto found = map->find(step->key);
+                if(found != map->end())
+                {
+                    escape(found->second);
+                }
+                break;
+            }
+            case MixedOperation::Add:
+            {
+                (*map)[step->key] = dummy;
+                break;
+            }
+            case MixedOperation::Remove:
+            {
+                map->erase(step->key);
+                break;
+            }
+        }
+    }
+}
+
+static s64 run_mixed_once(Subject subject, void** keys, int keys_count,
+    MixedStep* steps, int steps_count, Clock* clock, Heap* heap)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+    s64 nanoseconds = 0;
+
+    switch(subject)
+    {
+        case Subject::Cuckoo_Map:
+        {
+            CuckooMap map = {};
+            cuckoo_map_create(&map, heap);
+            for(int i = 0; i < keys_count; i += 2)
+            {
+                cuckoo_map_add(&map, keys[i], dummy, heap);
+            }
+
+            s64 start = start_timing(clock);
+            run_steps(&map, steps, steps_count, heap);
+            nanoseconds = stop_timing_nanoseconds(clock, start);
+
+            cuckoo_map_destroy(&map, heap);
+            break;
+        }
+        case Subject::Map:
+        {
+            Map map = {};
+            map_create(&map, heap);
+            for(int i = 0; i < keys_count; i += 2)
+            {
+                map_add(&map, keys[i], dummy, heap);
+            }
+
+            s64 start = start_timing(clock);
+            run_steps(&map, steps, steps_count, heap);
+            nanoseconds = stop_timing_nanoseconds(clock, start);
+
+            map_destroy(&map, heap);
+            break;
+        }
+        case Subject::Unordered_Map:
+        {
+            hash_t map;
+            for(int i = 0; i < keys_count; i += 2)
+            {
+                map[keys[i]] = dummy;
+            }
+
+            s64 start = start_timing(clock);
+            run_steps(&map, steps, steps_count);
+            nanoseconds = stop_timing_nanoseconds(clock, start);
+            break;
+        }
+    }
+
+    return nanoseconds;
+}
+
+static void run_mixed_workload(BenchmarkOptions* options, Workload* workload,
+    KeyDistribution distribution, int* table_counts, int table_counts_count,
+    Clock* clock, Heap* heap, FILE* file)
+{
+    const char* name = describe_key_distribution(distribution);
+    fprintf(file, "mixed workload: %s — %d%% gets, %d%% adds, %d%% removes — "
+            "keys: %s — median of %d runs in millions of operations per "
+            "second\n", workload->name, workload->get_percent,
+            workload->add_percent, workload->remove_percent, name,
+            options->repetitions);
+
+    for(int i = 0; i < options->subjects_count; i += 1)
+    {
+        const char* subject = describe_subject(options->subjects[i]);
+        fprintf(file, " %13s |", subject);
+    }
+    fprintf(file, " in table\n");
+
+    s64* timings = HEAP_ALLOCATE(heap, s64, options->repetitions);
+
+    for(int i = 0; i < table_counts_count; i += 1)
+    {
+        int table_count = table_counts[i];
+        int keys_count = 2 * table_count;
+        int steps_count = table_count;
+
+        void** keys = HEAP_ALLOCATE(heap, void*, keys_count);
+        MixedStep* steps = HEAP_ALLOCATE(heap, MixedStep, steps_count);
+        fill_randomly(keys, keys_count);
+
+        Zipf zipf;
+        if(distribution == KeyDistribution::Zipfian)
+        {
+            zipf_create(&zipf, keys_count, zipf_theta);
+        }
+        generate_steps(steps, steps_count, keys, keys_count, workload,
+                distribution, &zipf, 0);
+
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            Subject subject = options->subjects[j];
+            for(int k = 0; k < options->warm_ups; k += 1)
+            {
+                run_mixed_once(subject, keys, keys_count, steps, steps_count,
+                        clock, heap);
+            }
+            for(int k = 0; k < options->repetitions; k += 1)
+            {
+                timings[k] = run_mixed_once(subject, keys, keys_count, steps,
+                        steps_count, clock, heap);
+            }
+            BenchmarkResult result =
+                summarise_timings(timings, options->repetitions);
+
+            double throughput = 0.0;
+            if(result.median > 0.0)
+            {
+                throughput = (1e3 * steps_count) / result.median;
+            }
+            fprintf(file, " %8.2fMop/s |", throughput);
+        }
+        fprintf(file, " %7d\n", table_count);
+
+        SAFE_HEAP_DEALLOCATE(heap, keys);
+        SAFE_HEAP_DEALLOCATE(heap, steps);
+    }
+
+    fprintf(file, "\n");
+
+    SAFE_HEAP_DEALLOCATE(heap, timings);
+}
+
+static void run_mixed_benchmark(BenchmarkOptions* options, Heap* heap,
+    FILE* file)
+{
+    Clock clock;
+    set_up_clock(&clock);
+
+    int* table_counts;
+    int table_counts_count = choose_sampled_table_counts(options,
+            &table_counts);
+
+    Workload* chosen = workloads;
+    int chosen_count = workloads_cap;
+    if(options->workload_chosen)
+    {
+        chosen = &options->workload;
+        chosen_count = 1;
+    }
+
+    for(int i = 0; i < chosen_count; i += 1)
+    {
+        for(int j = 0; j < distributions_cap; j += 1)
+        {
+            if(!options->distributions_selected[j])
+            {
+                continue;
+            }
+            run_mixed_workload(options, &chosen[i], distributions[j],
+                    table_counts, table_counts_count, &clock, heap, file);
+        }
+    }
+}
+
+// Multithreaded Scaling........................................................
+
+// This runs the mixed workloads on several threads at once, to see how the
+// map holds up when it's shared. The upper bound is every thread having a map
+// of its own, since then nothing is shared at all.
+
+enum class SharingSubject
+{
+    Locked_Map,
+    Per_Thread_Map,
+};
+
+namespace
+{
+    const int sharing_subjects_cap = 2;
+    const int thread_counts_cap = 16;
+
+    SharingSubject sharing_subjects[sharing_subjects_cap] =
+    {
+        SharingSubject::Locked_Map,
+        SharingSubject::Per_Thread_Map,
+    };
+}
+
+static const char* describe_sharing_subject(SharingSubject subject)
+{
+    switch(subject)
+    {
+        default:
+        case SharingSubject::Locked_Map: return "Locked Map";
+        case SharingSubject::Per_Thread_Map: return "Per-Thread Map";
+    }
+}
+
+struct ThreadWork
+{
+    MixedStep* steps;
+    Map* map;
+    std::mutex* lock;
+    Heap* heap;
+    std::atomic<int>* ready;
+    std::atomic<bool>* go;
+    s64 contended;
+    int steps_count;
+    int cpu;
+    bool pinned;
+};
+
+// Each operation first tries the lock, so that it can count how often
+// another thread already had it.
+static void run_locked_steps(ThreadWork* work)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+    for(int i = 0; i < work->steps_count; i += 1)
+    {
+        MixedStep* step = &work->steps[i];
+        if(!work->lock->try_lock())
+        {
+            work->contended += 1;
+            work->lock->lock();
+        }
+        switch(step->operation)
+        {
+            case MixedOperation::Get:
+            {
+                void* value;
+                bool got = map_get(work->map, step->key, &value);
+                if(got)
+                {
+                    escape(value);
+                }
+                break;
+            }
+            case MixedOperation::Add:
+            {
+                map_add(work->map, step->key, dummy, work->heap);
+                break;
+            }
+            case MixedOperation::Remove:
+            {
+                map_remove(work->map, step->key);
+                break;
+            }
+        }
+        work->lock->unlock();
+    }
+}
+
+static void do_thread_work(ThreadWork* work)
+{
+    work->pinned = true;
+    if(work->cpu >= 0)
+    {
+        work->pinned = pin_thread_to_cpu(work->cpu);
+    }
+
+    work->ready->fetch_add(1);
+    while(!work->go->load())
+    {
+        std::this_thread::yield();
+    }
+
+    if(work->lock)
+    {
+        run_locked_steps(work);
+    }
+    else
+    {
+        run_steps(work->map, work->steps, work->steps_count, work->heap);
+    }
+}
+
+// This says in pinned whether every thread got the processor it was given.
+static s64 run_threads_once(SharingSubject subject, void** keys,
+    int keys_count, MixedStep** steps, int steps_count, int threads_count,
+    BenchmarkOptions* options, Clock* clock, Heap* heap, s64* contended,
+    bool* pinned)
+{
+    void* dummy = reinterpret_cast<void*>(1);
+
+    int maps_count = 1;
+    if(subject == SharingSubject::Per_Thread_Map)
+    {
+        maps_count = threads_count;
+    }
+    Map* maps = HEAP_ALLOCATE(heap, Map, maps_count);
+    for(int i = 0; i < maps_count; i += 1)
+    {
+        map_create(&maps[i], heap);
+        for(int j = 0; j < keys_count; j += 2)
+        {
+            map_add(&maps[i], keys[j], dummy, heap);
+        }
+    }
+
+    std::mutex lock;
+    std::atomic<int> ready(0);
+    std::atomic<bool> go(false);
+
+    // Threads take on the affinity of the thread that made them, so when
+    // the benchmark is pinned they each have to be given a processor of their
+    // own or else they'd all share one. They go round the processors the
+    // process is allowed, from the benchmark's own.
+    int cpus[allowed_cpus_cap];
+    int cpus_count = get_allowed_cpus(cpus, allowed_cpus_cap);
+    int first_cpu = 0;
+    for(int i = 0; i < cpus_count; i += 1)
+    {
+        if(cpus[i] == options->cpu)
+        {
+            first_cpu = i;
+        }
+    }
+
+    ThreadWork* works = HEAP_ALLOCATE(heap, ThreadWork, threads_count);
+    std::thread* threads = new std::thread[threads_count];
+    for(int i = 0; i < threads_count; i += 1)
+    {
+        ThreadWork* work = &works[i];
+        work->steps = steps[i];
+        work->steps_count = steps_count;
+        work->heap = heap;
+        work->ready = &ready;
+        work->go = &go;
+        work->contended = 0;
+        work->cpu = -1;
+        if(options->pin)
+        {
+            work->cpu = cpus[(first_cpu + i) % cpus_count];
+        }
+        if(subject == SharingSubject::Per_Thread_Map)
+        {
+            work->map = &maps[i];
+            work->lock = nullptr;
+        }
+        else
+        {
+            work->map = &maps[0];
+            work->lock = &lock;
+        }
+        threads[i] = std::thread(do_thread_work, work);
+    }
+
+    while(ready.load() < threads_count)
+    {
+        std::this_thread::yield();
+    }
+
+    s64 start = start_timing(clock);
+    go.store(true);
+    for(int i = 0; i < threads_count; i += 1)
+    {
+        threads[i].join();
+    }
+    s64 nanoseconds = stop_timing_nanoseconds(clock, start);
+
+    *contended = 0;
+    *pinned = true;
+    for(int i = 0; i < threads_count; i += 1)
+    {
+        *contended += works[i].contended;
+        *pinned = *pinned && works[i].pinned;
+    }
+
+    delete[] threads;
+    SAFE_HEAP_DEALLOCATE(heap, works);
+    for(int i = 0; i < maps_count; i += 1)
+    {
+        map_destroy(&maps[i], heap);
+    }
+    SAFE_HEAP_DEALLOCATE(heap, maps);
+
+    return nanoseconds;
+}
+
+// The thread counts go up by powers of two, and always end on the most that
+// were asked for.
+static int choose_thread_counts(int* thread_counts, int most)
+{
+    int count = 0;
+    for(int i = 1; i < most && count < thread_counts_cap - 1; i *= 2)
+    {
+        thread_counts[count] = i;
+        count += 1;
+    }
+    thread_counts[count] = most;
+    return count + 1;
+}
+
+static void run_threads_workload(BenchmarkOptions* options,
+    Workload* workload, int table_count, Clock* clock, Heap* heap, FILE* file)
+{
+    int thread_counts[thread_counts_cap];
+    int thread_counts_count = choose_thread_counts(thread_counts,
+            options->threads);
+    int most_threads = thread_counts[thread_counts_count - 1];
+
+    fprintf(file, "threads: %s — %d%% gets, %d%% adds, %d%% removes — %d in "
+            "table — median of %d runs in millions of operations per second, "
+            "and the speedup over one thread\n", workload->name,
+            workload->get_percent, workload->add_percent,
+            workload->remove_percent, table_count, options->repetitions);
+    fprintf(file, " threads |");
+    for(int i = 0; i < sharing_subjects_cap; i += 1)
+    {
+        const char* subject = describe_sharing_subject(sharing_subjects[i]);
+        fprintf(file, " %22s |", subject);
+    }
+    fprintf(file, " contended\n");
+
+    // Every thread gets its own steps, drawn uniformly over the same keys.
+    int keys_count = 2 * table_count;
+    int steps_count = table_count;
+    void** keys = HEAP_ALLOCATE(heap, void*, keys_count);
+    fill_randomly(keys, keys_count);
+    MixedStep** steps = HEAP_ALLOCATE(heap, MixedStep*, most_threads);
+    for(int i = 0; i < most_threads; i += 1)
+    {
+        steps[i] = HEAP_ALLOCATE(heap, MixedStep, steps_count);
+        generate_steps(steps[i], steps_count, keys, keys_count, workload,
+                KeyDistribution::Uniform, nullptr, i);
+    }
+
+    s64* timings = HEAP_ALLOCATE(heap, s64, options->repetitions);
+    double single_throughputs[sharing_subjects_cap] = {};
+
+    int cpus[allowed_cpus_cap];
+    int cpus_count = get_allowed_cpus(cpus, allowed_cpus_cap);
+
+    for(int i = 0; i < thread_counts_count; i += 1)
+    {
+        int threads_count = thread_counts[i];
+        fprintf(file, " %7d |", threads_count);
+
+        // Pinned threads that can't each have a processor would share them,
+        // and then the speedup and contention would mean nothing.
+        if(options->pin && threads_count > cpus_count)
+        {
+            fprintf(file, " skipped, since the process is allowed fewer "
+                    "processors than that\n");
+            continue;
+        }
+
+        double throughputs[sharing_subjects_cap] = {};
+        bool pinned = true;
+        double contention = 0.0;
+        for(int j = 0; j < sharing_subjects_cap; j += 1)
+        {
+            SharingSubject subject = sharing_subjects[j];
+            s64 contended = 0;
+            bool run_pinned;
+            for(int k = 0; k < options->warm_ups; k += 1)
+            {
+                run_threads_once(subject, keys, keys_count, steps, steps_count,
+                        threads_count, options, clock, heap, &contended,
+                        &run_pinned);
+                pinned = pinned && run_pinned;
+            }
+            s64 total_contended = 0;
+            for(int k = 0; k < options->repetitions; k += 1)
+            {
+                timings[k] = run_threads_once(subject, keys, keys_count, steps,
+                        steps_count, threads_count, options, clock, heap,
+                        &contended, &run_pinned);
+                pinned = pinned && run_pinned;
+                total_contended += contended;
+            }
+            BenchmarkResult result =
+                summarise_timings(timings, options->repetitions);
+
+            double operations = static_cast<double>(steps_count)
+                * threads_count;
+            if(result.median > 0.0)
+            {
+                throughputs[j] = (1e3 * operations) / result.median;
+            }
+            if(subject == SharingSubject::Locked_Map)
+            {
+                contention = (100.0 * total_contended)
+                    / (operations * options->repetitions);
+            }
+        }
+
+        if(!pinned)
+        {
+            fprintf(file, " skipped, since a thread couldn't be pinned to "
+                    "its own processor\n");
+            continue;
+        }
+        for(int j = 0; j < sharing_subjects_cap; j += 1)
+        {
+            if(threads_count == 1)
+            {
+                single_throughputs[j] = throughputs[j];
+            }
+            double speedup = 0.0;
+            if(single_throughputs[j] > 0.0)
+            {
+                speedup = throughputs[j] / single_throughputs[j];
+            }
+            fprintf(file, " %8.2fMop/s (%5.2fx) |", throughputs[j], speedup);
+        }
+        fprintf(file, " %8.2f%%\n", contention);
+    }
+    fprintf(file, "\n");
+
+    SAFE_HEAP_DEALLOCATE(heap, timings);
+    for(int i = 0; i < most_threads; i += 1)
+    {
+        SAFE_HEAP_DEALLOCATE(heap, steps[i]);
+    }
+    SAFE_HEAP_DEALLOCATE(heap, steps);
+    SAFE_HEAP_DEALLOCATE(heap, keys);
+}
+
+static void run_threads_benchmark(BenchmarkOptions* options, Heap* heap,
+    FILE* file)
+{
+    Clock clock;
+    set_up_clock(&clock);
+
+    int* table_counts;
+    int table_counts_count = choose_sampled_table_counts(options,
+            &table_counts);
+
+    Workload* chosen = workloads;
+    int chosen_count = workloads_cap;
+    if(options->workload_chosen)
+    {
+        chosen = &options->workload;
+        chosen_count = 1;
+    }
+
+    for(int i = 0; i < chosen_count; i += 1)
+    {
+        for(int j = 0; j < table_counts_count; j += 1)
+        {
+            run_threads_workload(options, &chosen[i], table_counts[j], &clock,
+                    heap, file);
+        }
+    }
+}
+
+// Memory Footprint.............................................................
+
+// This measures how much memory each subject holds once a table's been added,
+// and the most it held at any point while adding it. The peak is what runs into
+// memory limits, since growing has to hold both the old and new storage at
+// once while the pairs are moved over.
+
+struct MemoryFootprint
+{
+    u64 bytes;
+    u64 peak_bytes;
+    u64 peak_resident_bytes;
+};
+
+static MemoryFootprint measure_map(void** table, int table_count, Heap* heap)
+{
+    MemoryFootprint footprint;
+
+    u64 base = heap_get_bytes_in_use(heap);
+    heap_reset_peak(heap);
+    reset_peak_resident_bytes();
+
+    Map map = {};
+    map_create(&map, heap);
+    insert_table(&map, table, table_count, heap);
+
+    footprint.bytes = heap_get_bytes_in_use(heap) - base;
+    footprint.peak_bytes = heap_get_peak_bytes(heap) - base;
+    footprint.peak_resident_bytes = get_peak_resident_bytes();
+
+    map_destroy(&map, heap);
+
+    return footprint;
+}
+
+static MemoryFootprint measure_cuckoo_map(void** table, int table_count,
+    Heap* heap)
+{
+    MemoryFootprint footprint;
+
+    u64 base = heap_get_bytes_in_use(heap);
+    heap_reset_peak(heap);
+    reset_peak_resident_bytes();
+
+    CuckooMap map = {};
+    cuckoo_map_create(&map, heap);
+    insert_table(&map, table, table_count, heap);
+
+    footprint.bytes = heap_get_bytes_in_use(heap) - base;
+    footprint.peak_bytes = heap_get_peak_bytes(heap) - base;
+    footprint.peak_resident_bytes = get_peak_resident_bytes();
+
+    cuckoo_map_destroy(&map, heap);
+
+    return footprint;
+}
+
+static MemoryFootprint measure_unordered_map(void** table, int table_count)
+{
+    MemoryFootprint footprint;
+
+    AllocationCount* allocations = &unordered_map_allocations;
+    u64 base = allocations->bytes_in_use;
+    allocations->peak_bytes = base;
+    reset_peak_resident_bytes();
+
+    {
+        hash_t map;
+        insert_table(&map, table, table_count);
+
+        footprint.bytes = allocations->bytes_in_use - base;
+        footprint.peak_bytes = allocations->peak_bytes - base;
+        footprint.peak_resident_bytes = get_peak_resident_bytes();
+    }
+
+    return footprint;
+}
+
+static void run_memory_benchmark(BenchmarkOptions* options, Heap* heap,
+    FILE* file)
+{
+    const double bytes_per_mebibyte = 1024.0 * 1024.0;
+
+    bool resettable = reset_peak_resident_bytes();
+    fprintf(file, "memory: random keys — bytes held once the table is added, "
+            "and the peak while adding it\n");
+    if(!resettable)
+    {
+        fprintf(file, "the peak resident set size can't be reset here, so it's "
+                "the peak over the whole run so far\n");
+    }
+    fprintf(file, " %13s | %8s | %12s | %10s | %12s | %10s | %12s\n",
+            "subject", "in table", "bytes", "bytes/pair", "peak bytes",
+            "peak/bytes", "peak RSS");
+
+    for(int i = 0; i < options->table_counts_count; i += 1)
+    {
+        int table_count = options->table_counts[i];
+        void** table = HEAP_ALLOCATE(heap, void*, table_count);
+        fill_randomly(table, table_count);
+
+        for(int j = 0; j < options->subjects_count; j += 1)
+        {
+            Subject subject = options->subjects[j];
+
+            MemoryFootprint footprint = {};
+            switch(subject)
+            {
+                case Subject::Cuckoo_Map:
+                {
+                    footprint = measure_cuckoo_map(table, table_count, heap);
+                    break;
+                }
+                case Subject::Map:
+                {
+                    footprint = measure_map(table, table_count, heap);
+                    break;
+                }
+                case Subject::Unordered_Map:
+                {
+                    footprint = measure_unordered_map(table, table_count);
+                    break;
+                }
+            }
+
+            double per_pair = static_cast<double>(footprint.bytes)
+                / table_count;
+            double peak_ratio = 0.0;
+            if(footprint.bytes > 0)
+            {
+                peak_ratio = static_cast<double>(footprint.peak_bytes)
+                    / footprint.bytes;
+            }
+            fprintf(file, " %13s | %8d | %9.2fMiB | %10.2f | %9.2fMiB | "
+                    "%9.2fx | %9.2fMiB\n", describe_subject(subject),
+                    table_count, footprint.bytes / bytes_per_mebibyte,
+                    per_pair, footprint.peak_bytes / bytes_per_mebibyte,
+                    peak_ratio,
+                    footprint.peak_resident_bytes / bytes_per_mebibyte);
+        }
+
+        SAFE_HEAP_DEALLOCATE(heap, table);
+    }
+
+    fprintf(file, "\n");
+}
+
+// Benchmark Options............................................................
+
+static const char* describe_instruction_set(MapInstructionSet set)
+{
+    switch(set)
+    {
+        default:
+        case MapInstructionSet::Scalar: return "scalar";
+        case MapInstructionSet::SSE4_2: return "sse4.2";
+        case MapInstructionSet::AVX2: return "avx2";
+    }
+}
+
+static bool parse_instruction_set(const char* name, MapInstructionSet* set)
+{
+    const MapInstructionSet sets[3] =
+    {
+        MapInstructionSet::Scalar,
+        MapInstructionSet::SSE4_2,
+        MapInstructionSet::AVX2,
+    };
+    for(int i = 0; i < 3; i += 1)
+    {
+        if(strcmp(name, describe_instruction_set(sets[i])) == 0)
+        {
+            *set = sets[i];
+            return true;
+        }
+    }
+    return false;
+}
+
+static void print_usage(FILE* file)
+{
+    fprintf(file,
+        "usage: PointerMap [options]\n"
+        "\n"
+        "  --benchmarks=LIST   benchmarks to run, given by type or by\n"
+        "                      type/table-setup, like search/shuffle\n"
+        "  --subjects=LIST     which of map, cuckoo-map, and\n"
+        "                      unordered-map to run\n"
+        "  --sizes=LIST        table sizes, like 200000,1000000\n"
+        "  --suites=LIST       which of throughput, latency, memory,\n"
+        "                      mixed, and threads to run\n"
+        "                      [throughput,latency,memory]\n"
+        "  --mix=GET,ADD,REMOVE\n"
+        "                      percentages for a mixed workload, instead\n"
+        "                      of running each of the usual ones\n"
+        "  --distributions=LIST\n"
+        "                      which of uniform, zipfian, and hotspot key\n"
+        "                      popularity to give mixed workloads\n"
+        "  --threads=N         most threads for the threads suite\n"
+        "                      [the number of processors allowed]\n"
+        "  --warm-ups=N        untimed runs before each measurement [1]\n"
+        "  --repetitions=N     timed runs to take the median of [5]\n"
+        "  --cpu=N             processor to pin to [the current one]\n"
+        "  --no-pin            let the thread move between processors\n"
+        "  --instruction-set=SET\n"
+        "                      which of scalar, sse4.2, and avx2 the map's\n"
+        "                      kernels use [the best the processor has]\n"
+        "  --counters          also read hardware performance counters\n"
+        "  --format=FORMAT     also write results as csv or json\n"
+        "  --output=PATH       file for csv or json results [stdout]\n"
+        "  --save-baseline=PATH\n"
+        "                      save throughput results to compare to later\n"
+        "  --compare-baseline=PATH\n"
+        "                      report throughput results that got slower\n"
+        "                      than the baseline, and exit with failure\n"
+        "                      if any did or none could be compared\n"
+        "  --threshold=PERCENT least slowdown counted as a regression [5]\n"
+        "  --list              list the benchmarks and stop\n"
+        "  --help              show this and stop\n");
+}
+
+static bool name_matches(const char* name, int length, const char* description)
+{
+    int i = 0;
+    for(; i < length && description[i]; i += 1)
+    {
+        char c = description[i];
+        char d = (c == ' ') ? '-' : tolower(c);
+        if(tolower(name[i]) != d)
+        {
+            return false;
+        }
+    }
+    return i == length && !description[i];
+}
+
+static int count_list_item(const char* list)
+{
+    int length = 0;
+    while(list[length] && list[length] != ',')
+    {
+        length += 1;
+    }
+    return length;
+}
+
+static bool parse_count(const char* text, int length, int* result)
+{
+    char* end;
+    long value = strtol(text, &end, 10);
+    if(end != text + length || value < 0 || value > INT32_MAX)
+    {
+        return false;
+    }
+    *result = value;
+    return true;
+}
+
+static bool select_benchmarks(BenchmarkOptions* options, const char* list)
+{
+    Benchmark benchmarks[benchmarks_cap];
+    set_up_benchmarks(benchmarks);
+
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        options->selected[i] = false;
+    }
+
+    while(*list)
+    {
+        int length = count_list_item(list);
+        int type_length = length;
+        for(int i = 0; i < length; i += 1)
+        {
+            if(list[i] == '/')
+            {
+                type_length = i;
+                break;
+            }
+        }
+
+        bool found = false;
+        for(int i = 0; i < benchmarks_cap; i += 1)
+        {
+            const char* type = describe_benchmark_type(benchmarks[i].type);
+            if(!name_matches(list, type_length, type))
+            {
+                continue;
+            }
+            if(type_length < length)
+            {
+                const char* table_type =
+                    describe_table_type(benchmarks[i].table_type);
+                const char* name = list + type_length + 1;
+                if(!name_matches(name, length - type_length - 1, table_type))
+                {
+                    continue;
+                }
+            }
+            options->selected[i] = true;
+            found = true;
+        }
+        if(!found)
+        {
+            fprintf(stderr, "There's no benchmark called %.*s.\n", length,
+                    list);
+            return false;
+        }
+
+        list += length + (list[length] == ',');
+    }
+
+    return true;
+}
+
+static bool select_subjects(BenchmarkOptions* options, const char* list)
+{
+    options->subjects_count = 0;
+
+    while(*list)
+    {
+        int length = count_list_item(list);
+
+        bool found = false;
+        for(int i = 0; i < subjects_cap; i += 1)
+        {
+            if(name_matches(list, length, describe_subject(subjects[i])))
+            {
+                if(options->subjects_count < subjects_cap)
+                {
+                    options->subjects[options->subjects_count] = subjects[i];
+                    options->subjects_count += 1;
+                }
+                found = true;
+                break;
+            }
+        }
+        if(!found)
+        {
+            fprintf(stderr, "There's no subject called %.*s.\n", length, list);
+            return false;
+        }
+
+        list += length + (list[length] == ',');
+    }
+
+    return options->subjects_count > 0;
+}
+
+static bool select_sizes(BenchmarkOptions* options, const char* list)
+{
+    options->table_counts_count = 0;
+    options->table_counts_chosen = true;
+
+    while(*list)
+    {
+        int length = count_list_item(list);
+
+        int size;
+        if(!parse_count(list, length, &size) || size == 0)
+        {
+            fprintf(stderr, "%.*s isn't a table size.\n", length, list);
+            return false;
+        }
+        if(options->table_counts_count >= sizes_cap)
+        {
+            fprintf(stderr, "Only %d sizes can be run at once.\n", sizes_cap);
+            return false;
+        }
+        options->table_counts[options->table_counts_count] = size;
+        options->table_counts_count += 1;
+
+        list += length + (list[length] == ',');
+    }
+
+    return options->table_counts_count > 0;
+}
+
+static bool select_distributions(BenchmarkOptions* options, const char* list)
+{
+    for(int i = 0; i < distributions_cap; i += 1)
+    {
+        options->distributions_selected[i] = false;
+    }
+
+    while(*list)
+    {
+        int length = count_list_item(list);
+
+        bool found = false;
+        for(int i = 0; i < distributions_cap; i += 1)
+        {
+            const char* name = describe_key_distribution(distributions[i]);
+            if(name_matches(list, length, name))
+            {
+                options->distributions_selected[i] = true;
+                found = true;
+                break;
+            }
+        }
+        if(!found)
+        {
+            fprintf(stderr, "There's no key distribution called %.*s.\n",
+                    length, list);
+            return false;
+        }
+
+        list += length + (list[length] == ',');
+    }
+
+    return true;
+}
+
+static bool choose_workload(BenchmarkOptions* options, const char* list)
+{
+    int percents[3];
+    for(int i = 0; i < 3; i += 1)
+    {
+        int length = count_list_item(list);
+        if(!parse_count(list, length, &percents[i]))
+        {
+            return false;
+        }
+        list += length;
+        if(i < 2)
+        {
+            if(*list != ',')
+            {
+                return false;
+            }
+            list += 1;
+        }
+    }
+    if(*list || percents[0] + percents[1] + percents[2] != 100)
+    {
+        fprintf(stderr, "A mix has to add up to 100%%.\n");
+        return false;
+    }
+
+    options->workload.name = "Custom";
+    options->workload.get_percent = percents[0];
+    options->workload.add_percent = percents[1];
+    options->workload.remove_percent = percents[2];
+    options->workload_chosen = true;
+    return true;
+}
+
+static bool select_suites(BenchmarkOptions* options, const char* list)
+{
+    options->run_throughput = false;
+    options->run_latency = false;
+    options->run_mixed = false;
+    options->run_threads = false;
+    options->run_memory = false;
+
+    while(*list)
+    {
+        int length = count_list_item(list);
+
+        if(name_matches(list, length, "Throughput"))
+        {
+            options->run_throughput = true;
+        }
+        else if(name_matches(list, length, "Latency"))
+        {
+            options->run_latency = true;
+        }
+        else if(name_matches(list, length, "Mixed"))
+        {
+            options->run_mixed = true;
+        }
+        else if(name_matches(list, length, "Threads"))
+        {
+            options->run_threads = true;
+        }
+        else if(name_matches(list, length, "Memory"))
+        {
+            options->run_memory = true;
+        }
+        else
+        {
+            fprintf(stderr, "There's no suite called %.*s.\n", length, list);
+            return false;
+        }
+
+        list += length + (list[length] == ',');
+    }
+
+    return true;
+}
+
+static void list_benchmarks(FILE* file)
+{
+    Benchmark benchmarks[benchmarks_cap];
+    set_up_benchmarks(benchmarks);
+
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        print_name(file, describe_benchmark_type(benchmarks[i].type), '-');
+        fputc('/', file);
+        print_name(file, describe_table_type(benchmarks[i].table_type), '-');
+        fputc('\n', file);
+    }
+}
+
+static bool has_prefix(const char* text, const char* prefix, const char** rest)
+{
+    size_t length = strlen(prefix);
+    if(strncmp(text, prefix, length) == 0)
+    {
+        *rest = text + length;
+        return true;
+    }
+    return false;
+}
+
+// Reads the command line into the options. This returns false if the program
+// should stop here, either because something given was wrong or because all
+// that was asked for was help.
+static bool parse_benchmark_options(BenchmarkOptions* options, int argc,
+    char** argv, bool* failed)
+{
+    *options = {};
+    for(int i = 0; i < table_counts_cap; i += 1)
+    {
+        options->table_counts[i] = table_counts[i];
+    }
+    options->table_counts_count = table_counts_cap;
+    for(int i = 0; i < subjects_cap; i += 1)
+    {
+        options->subjects[i] = subjects[i];
+    }
+    options->subjects_count = subjects_cap;
+    for(int i = 0; i < benchmarks_cap; i += 1)
+    {
+        options->selected[i] = true;
+    }
+    for(int i = 0; i < distributions_cap; i += 1)
+    {
+        options->distributions_selected[i] = true;
+    }
+    options->warm_ups = 1;
+    options->repetitions = 5;
+    int cpus[allowed_cpus_cap];
+    options->threads = get_allowed_cpus(cpus, allowed_cpus_cap);
+    if(options->threads < 1)
+    {
+        options->threads = 1;
+    }
+    options->cpu = get_current_cpu();
+    options->pin = true;
+    options->output_format = OutputFormat::None;
+    options->threshold = 0.05;
+    options->run_throughput = true;
+    options->run_latency = true;
+    options->run_memory = true;
+
+    *failed = false;
+
+    for(int i = 1; i < argc; i += 1)
+    {
+        const char* arg = argv[i];
+        const char* value;
+        bool okay = true;
+
+        if(has_prefix(arg, "--benchmarks=", &value))
+        {
+            okay = select_benchmarks(options, value);
+        }
+        else if(has_prefix(arg, "--subjects=", &value))
+        {
+            okay = select_subjects(options, value);
+        }
+        else if(has_prefix(arg, "--sizes=", &value))
+        {
+            okay = select_sizes(options, value);
+        }
+        else if(has_prefix(arg, "--suites=", &value))
+        {
+            okay = select_suites(options, value);
+        }
+        else if(has_prefix(arg, "--mix=", &value))
+        {
+            okay = choose_workload(options, value);
+        }
+        else if(has_prefix(arg, "--distributions=", &value))
+        {
+            okay = select_distributions(options, value);
+        }
+        else if(has_prefix(arg, "--threads=", &value))
+        {
+            okay = parse_count(value, strlen(value), &options->threads)
+                && options->threads > 0;
+        }
+        else if(has_prefix(arg, "--warm-ups=", &value))
+        {
+            okay = parse_count(value, strlen(value), &options->warm_ups);
+        }
+        else if(has_prefix(arg, "--repetitions=", &value))
+        {
+            okay = parse_count(value, strlen(value), &options->repetitions)
+                && options->repetitions > 0;
+        }
+        else if(has_prefix(arg, "--cpu=", &value))
+        {
+            okay = parse_count(value, strlen(value), &options->cpu);
+            options->pin = true;
+        }
+        else if(strcmp(arg, "--no-pin") == 0)
+        {
+            options->pin = false;
+        }
+        else if(has_prefix(arg, "--instruction-set=", &value))
+        {
+            MapInstructionSet instruction_set;
+            okay = parse_instruction_set(value, &instruction_set)
+                && map_use_instruction_set(instruction_set);
+        }
+        else if(strcmp(arg, "--counters") == 0)
+        {
+            options->count_events = true;
+        }
+        else if(has_prefix(arg, "--format=", &value))
+        {
+            if(strcmp(value, "csv") == 0)
+            {
+                options->output_format = OutputFormat::Csv;
+            }
+            else if(strcmp(value, "json") == 0)
+            {
+                options->output_format = OutputFormat::Json;
+            }
+            else
+            {
+                okay = false;
+            }
+        }
+        else if(has_prefix(arg, "--output=", &value))
+        {
+            options->output_path = value;
+        }
+        else if(has_prefix(arg, "--save-baseline=", &value))
+        {
+            options->save_baseline_path = value;
+        }
+        else if(has_prefix(arg, "--compare-baseline=", &value))
+        {
+            options->compare_baseline_path = value;
+        }
+        else if(has_prefix(arg, "--threshold=", &value))
+        {
+            char* end;
+            double percent = strtod(value, &end);
+            okay = *value && !*end && percent >= 0.0;
+            options->threshold = percent / 100.0;
+        }
+        else if(strcmp(arg, "--list") == 0)
+        {
+            list_benchmarks(stdout);
+            return false;
+        }
+        else if(strcmp(arg, "--help") == 0)
+        {
+            print_usage(stdout);
+            return false;
+        }
+        else
+        {
+            okay = false;
+        }
+
+        if(!okay)
+        {
+            fprintf(stderr, "Couldn't understand the option %s.\n\n", arg);
+            print_usage(stderr);
+            *failed = true;
+            return false;
+        }
+    }
+
+    // Baselines only hold throughput results, so a run without that suite
+    // would have nothing to save or compare.
+    if((options->save_baseline_path || options->compare_baseline_path)
+        && !options->run_throughput)
+    {
+        fprintf(stderr, "Saving or comparing a baseline needs the throughput "
+                "suite to be run.\n\n");
+        *failed = true;
+        return false;
+    }
+
+    return true;
+}
+
+static void print_instruction_set(FILE* file)
+{
+    fprintf(file, "map kernels use %s\n",
+        describe_instruction_set(map_get_instruction_set()));
+}
+
+// Pins the benchmark to one processor, so that its caches stay warm and its
+// timings aren't thrown off by being moved partway through.
+static void pin_benchmark(BenchmarkOptions* options, FILE* file)
+{
+    if(!options->pin)
+    {
+        return;
+    }
+    if(pin_thread_to_cpu(options->cpu))
+    {
+        fprintf(file, "pinned to processor %d\n\n", options->cpu);
+    }
+    else
+    {
+        fprintf(file, "failed to pin to processor %d\n\n", options->cpu);
+        options->pin = false;
     }
 }
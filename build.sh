@@ -1,2 +1,2 @@
 #!/bin/sh
-g++ -o PointerMap -std=c++0x -O3 -DNDEBUG main.cpp
+g++ -o PointerMap -std=c++0x -O3 -DNDEBUG -pthread main.cpp
@@ -1,5 +1,6 @@
 #include "clock.h"
 
+#include "cpu.h"
 #include "platform_definitions.h"
 
 #if defined(OS_WINDOWS)
@@ -12,43 +13,44 @@
 #include <ctime>
 #endif
 
+#if defined(INSTRUCTION_SET_X86) || defined(INSTRUCTION_SET_X64)
+#define CYCLE_COUNTER_AVAILABLE
+#if defined(COMPILER_MSVC)
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
 namespace
 {
     const s64 milliseconds_per_second = 1000;
     const s64 nanoseconds_per_second = 1000000000;
-    const s64 nanoseconds_per_millisecond = 1000000;
+
+    // how long the timestamp counter is measured against the system clock
+    const s64 calibration_milliseconds = 20;
 }
 
 #if defined(OS_WINDOWS)
 
-bool set_up_clock(Clock* clock)
+static bool get_system_frequency(s64* frequency)
 {
-    LARGE_INTEGER frequency;
-    bool got = QueryPerformanceFrequency(&frequency) != 0;
+    LARGE_INTEGER counts;
+    bool got = QueryPerformanceFrequency(&counts) != 0;
     if(got)
     {
-        clock->frequency = frequency.QuadPart;
+        *frequency = counts.QuadPart;
     }
     return got;
 }
 
-s64 get_timestamp(Clock* clock)
+static s64 read_system_clock()
 {
     LARGE_INTEGER counter;
     QueryPerformanceCounter(&counter);
     return counter.QuadPart;
 }
 
-s64 get_millisecond_duration(Clock* clock, s64 start, s64 end)
-{
-    return ((end - start) * milliseconds_per_second) / clock->frequency;
-}
-
-s64 get_nanosecond_duration(Clock* clock, s64 start, s64 end)
-{
-    return ((end - start) * nanoseconds_per_second) / clock->frequency;
-}
-
 static void clobber()
 {
     _ReadWriteBarrier();
@@ -63,39 +65,141 @@ void escape(void* p)
 
 #else
 
-bool set_up_clock(Clock* clock)
+static bool get_system_frequency(s64* frequency)
 {
+    *frequency = nanoseconds_per_second;
     return true;
 }
 
-s64 get_timestamp(Clock* clock)
+static s64 read_system_clock()
 {
     struct timespec now;
     clock_gettime(CLOCK_MONOTONIC, &now);
     return (nanoseconds_per_second * now.tv_sec) + now.tv_nsec;
 }
 
-s64 get_millisecond_duration(Clock* clock, s64 start, s64 end)
+void escape(void* p)
 {
-    return (end - start) / nanoseconds_per_millisecond;
+    asm volatile("" : : "g"(p) : "memory");
 }
 
-s64 get_nanosecond_duration(Clock* clock, s64 start, s64 end)
+static void clobber()
 {
-    return end - start;
+    asm volatile("" : : : "memory");
 }
 
-void escape(void* p)
+#endif // defined(OS_WINDOWS)
+
+// This works out x * numerator / denominator without the product overflowing,
+// as long as the denominator times the numerator fits.
+static s64 scale(s64 x, s64 numerator, s64 denominator)
 {
-    asm volatile("" : : "g"(p) : "memory");
+    s64 whole = x / denominator;
+    s64 part = x % denominator;
+    return (whole * numerator) + ((part * numerator) / denominator);
 }
 
-static void clobber()
+#if defined(CYCLE_COUNTER_AVAILABLE)
+
+// The fence before rdtsc waits for everything before it to finish, and the
+// one after keeps what's being timed from starting before it.
+static s64 read_cycles_at_start()
 {
-    asm volatile("" : : : "memory");
+    _mm_lfence();
+    s64 cycles = __rdtsc();
+    _mm_lfence();
+    return cycles;
 }
 
-#endif // defined(OS_WINDOWS)
+// rdtscp already waits for everything before it, so only the fence after is
+// needed, to keep whatever comes next from starting early.
+static s64 read_cycles_at_stop()
+{
+    unsigned int processor;
+    s64 cycles = __rdtscp(&processor);
+    _mm_lfence();
+    return cycles;
+}
+
+// The counter's rate isn't reported anywhere dependable, so it's measured by
+// spinning on the system clock for a short while.
+static s64 calibrate_cycles(s64 system_frequency)
+{
+    s64 system_ticks =
+        (calibration_milliseconds * system_frequency) / milliseconds_per_second;
+    s64 system_start = read_system_clock();
+    s64 cycles_start = read_cycles_at_start();
+    s64 system_end;
+    do
+    {
+        system_end = read_system_clock();
+    } while(system_end - system_start < system_ticks);
+    s64 cycles_end = read_cycles_at_stop();
+
+    return scale(cycles_end - cycles_start, system_frequency,
+        system_end - system_start);
+}
+
+#else
+
+static s64 read_cycles_at_start()
+{
+    return 0;
+}
+
+static s64 read_cycles_at_stop()
+{
+    return 0;
+}
+
+#endif // defined(CYCLE_COUNTER_AVAILABLE)
+
+bool set_up_clock(Clock* clock)
+{
+    clock->counts_cycles = false;
+    if(!get_system_frequency(&clock->frequency))
+    {
+        return false;
+    }
+
+#if defined(CYCLE_COUNTER_AVAILABLE)
+    if(has_invariant_timestamp_counter())
+    {
+        s64 frequency = calibrate_cycles(clock->frequency);
+        if(frequency > 0)
+        {
+            clock->frequency = frequency;
+            clock->counts_cycles = true;
+        }
+    }
+#endif
+
+    return true;
+}
+
+s64 get_timestamp(Clock* clock)
+{
+    if(clock->counts_cycles)
+    {
+        return read_cycles_at_start();
+    }
+    return read_system_clock();
+}
+
+s64 get_millisecond_duration(Clock* clock, s64 start, s64 end)
+{
+    return scale(end - start, milliseconds_per_second, clock->frequency);
+}
+
+s64 get_nanosecond_duration(Clock* clock, s64 start, s64 end)
+{
+    return scale(end - start, nanoseconds_per_second, clock->frequency);
+}
+
+s64 get_nanoseconds_from_cycles(Clock* clock, s64 cycles)
+{
+    return scale(cycles, nanoseconds_per_second, clock->frequency);
+}
 
 s64 start_timing(Clock* clock)
 {
@@ -104,10 +208,29 @@ s64 start_timing(Clock* clock)
     return start;
 }
 
-s64 stop_timing(Clock* clock, s64 start)
+s64 stop_timing_cycles(Clock* clock, s64 start)
 {
     clobber();
-    s64 end = get_timestamp(clock);
-    s64 milliseconds = get_millisecond_duration(clock, start, end);
-    return milliseconds;
+    s64 end;
+    if(clock->counts_cycles)
+    {
+        end = read_cycles_at_stop();
+    }
+    else
+    {
+        end = read_system_clock();
+    }
+    return end - start;
+}
+
+s64 stop_timing(Clock* clock, s64 start)
+{
+    s64 cycles = stop_timing_cycles(clock, start);
+    return scale(cycles, milliseconds_per_second, clock->frequency);
+}
+
+s64 stop_timing_nanoseconds(Clock* clock, s64 start)
+{
+    s64 cycles = stop_timing_cycles(clock, start);
+    return get_nanoseconds_from_cycles(clock, cycles);
 }
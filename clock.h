@@ -3,17 +3,32 @@
 
 #include "sized_types.h"
 
+// Timestamps are in ticks of whichever clock is cheapest to read. Where the
+// processor has an invariant timestamp counter, that's the counter, and its
+// ticks are cycles at a fixed rate, measured against the system clock when
+// the clock's set up. Otherwise, it's the system's monotonic clock.
 struct Clock
 {
+    // ticks per second
     s64 frequency;
+    bool counts_cycles;
 };
 
 bool set_up_clock(Clock* clock);
 s64 get_timestamp(Clock* clock);
 s64 get_millisecond_duration(Clock* clock, s64 start, s64 end);
 s64 get_nanosecond_duration(Clock* clock, s64 start, s64 end);
+s64 get_nanoseconds_from_cycles(Clock* clock, s64 cycles);
+
+// Timing is fenced, so that no work from before start_timing or after the
+// stop is still running, or has already started, when the clock's read.
+// Measuring in cycles avoids converting every sample, which can be done just
+// once for a total instead. Without a timestamp counter, the cycles are
+// ticks of the system clock.
 s64 start_timing(Clock* clock);
 s64 stop_timing(Clock* clock, s64 start);
+s64 stop_timing_cycles(Clock* clock, s64 start);
+s64 stop_timing_nanoseconds(Clock* clock, s64 start);
 
 void escape(void* p);
 
@@ -0,0 +1,160 @@
+#include "cpu.h"
+
+#include "platform_definitions.h"
+#include "sized_types.h"
+
+#if defined(OS_WINDOWS)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#else
+#include <sched.h>
+#endif
+
+#if defined(INSTRUCTION_SET_X86) || defined(INSTRUCTION_SET_X64)
+#if defined(COMPILER_MSVC)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+#if defined(OS_WINDOWS)
+
+int get_current_cpu()
+{
+    return GetCurrentProcessorNumber();
+}
+
+bool pin_thread_to_cpu(int cpu)
+{
+    if(cpu < 0 || cpu >= 8 * sizeof(DWORD_PTR))
+    {
+        return false;
+    }
+    DWORD_PTR mask = static_cast<DWORD_PTR>(1) << cpu;
+    return SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+}
+
+int get_allowed_cpus(int* cpus, int cap)
+{
+    DWORD_PTR process_mask;
+    DWORD_PTR system_mask;
+    if(!GetProcessAffinityMask(GetCurrentProcess(), &process_mask,
+        &system_mask))
+    {
+        return 0;
+    }
+    int count = 0;
+    for(int i = 0; i < 8 * sizeof(DWORD_PTR) && count < cap; i += 1)
+    {
+        if(process_mask & (static_cast<DWORD_PTR>(1) << i))
+        {
+            cpus[count] = i;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+#else
+
+int get_current_cpu()
+{
+    return sched_getcpu();
+}
+
+bool pin_thread_to_cpu(int cpu)
+{
+    if(cpu < 0 || cpu >= CPU_SETSIZE)
+    {
+        return false;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+// Linux only keeps an affinity for each thread, and pinning the thread that
+// asks would narrow it. So the set is read once when the program starts,
+// before anything could have been pinned.
+static cpu_set_t get_startup_cpus()
+{
+    cpu_set_t set;
+    if(sched_getaffinity(0, sizeof(set), &set) != 0)
+    {
+        CPU_ZERO(&set);
+    }
+    return set;
+}
+
+static cpu_set_t startup_cpus = get_startup_cpus();
+
+int get_allowed_cpus(int* cpus, int cap)
+{
+    int count = 0;
+    for(int i = 0; i < CPU_SETSIZE && count < cap; i += 1)
+    {
+        if(CPU_ISSET(i, &startup_cpus))
+        {
+            cpus[count] = i;
+            count += 1;
+        }
+    }
+    return count;
+}
+
+#endif // defined(OS_WINDOWS)
+
+#if defined(INSTRUCTION_SET_X86) || defined(INSTRUCTION_SET_X64)
+
+// This reads the eax, ebx, ecx, and edx that cpuid gives for a leaf and
+// subleaf, or gives false if the processor doesn't have that leaf.
+static bool get_cpuid(u32 leaf, u32 subleaf, u32* registers)
+{
+#if defined(COMPILER_MSVC)
+    int info[4];
+    __cpuid(info, leaf & 0x80000000);
+    if(static_cast<u32>(info[0]) < leaf)
+    {
+        return false;
+    }
+    __cpuidex(info, leaf, subleaf);
+    for(int i = 0; i < 4; i += 1)
+    {
+        registers[i] = info[i];
+    }
+    return true;
+#else
+    return __get_cpuid_count(leaf, subleaf, &registers[0], &registers[1],
+        &registers[2], &registers[3]) != 0;
+#endif
+}
+
+bool has_invariant_timestamp_counter()
+{
+    const u32 rdtscp_bit = 1 << 27;
+    const u32 invariant_bit = 1 << 8;
+
+    u32 registers[4];
+    if(!get_cpuid(0x80000001, 0, registers) || !(registers[3] & rdtscp_bit))
+    {
+        return false;
+    }
+    if(!get_cpuid(0x80000007, 0, registers))
+    {
+        return false;
+    }
+    return (registers[3] & invariant_bit) != 0;
+}
+
+#else
+
+bool has_invariant_timestamp_counter()
+{
+    return false;
+}
+
+#endif // defined(INSTRUCTION_SET_X86) || defined(INSTRUCTION_SET_X64)
@@ -0,0 +1,23 @@
+#ifndef CPU_H_
+#define CPU_H_
+
+namespace
+{
+    const int allowed_cpus_cap = 1024;
+}
+
+int get_current_cpu();
+bool pin_thread_to_cpu(int cpu);
+
+// This gives the processors the process is allowed to run on, in order, and
+// how many there are. Pinning a thread elsewhere fails, and that can leave it
+// on whichever processor it was already limited to. The set is the one the
+// process started with, so it isn't narrowed by pinning a thread later.
+int get_allowed_cpus(int* cpus, int cap);
+
+// This says whether the processor has a timestamp counter that ticks at a
+// constant rate whatever its clock speed or power state, and can also be
+// read along with the processor number with rdtscp. Only x86 processors do.
+bool has_invariant_timestamp_counter();
+
+#endif // CPU_H_
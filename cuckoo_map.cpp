@@ -0,0 +1,381 @@
+#include "cuckoo_map.h"
+
+#include "assert.h"
+#include "memory.h"
+
+namespace
+{
+    // signifies an empty key slot
+    void* const cuckoo_empty = nullptr;
+
+    // This value is used to indicate an iterator that's reached the end of
+    // iteration.
+    const int cuckoo_end_index = -1;
+
+    // the fewest buckets a table has, so that a key's two buckets can always
+    // be different ones
+    const int cuckoo_first_buckets_count = 2;
+
+    // how many pairs an add moves along before giving up and growing
+    const int cuckoo_kicks_cap = 500;
+
+    const int cache_line_bytes = 64;
+}
+
+// This is the finalizer from MurmurHash3. Its low half picks a key's first
+// bucket and its high half picks the second.
+static u64 cuckoo_hash(u64 key)
+{
+    key ^= key >> 33;
+    key *= UINT64_C(0xff51afd7ed558ccd);
+    key ^= key >> 33;
+    key *= UINT64_C(0xc4ceb9fe1a85ec53);
+    key ^= key >> 33;
+    return key;
+}
+
+// Setting the lowest bit of what's xored in means the second bucket is never
+// the same as the first.
+static void get_buckets(CuckooMap* map, void* key, int* first, int* second)
+{
+    u64 hash = cuckoo_hash(reinterpret_cast<u64>(key));
+    int mask = map->buckets_count - 1;
+    *first = hash & mask;
+    *second = (*first ^ ((hash >> 32) | 1)) & mask;
+}
+
+static int get_other_bucket(CuckooMap* map, void* key, int bucket)
+{
+    int first;
+    int second;
+    get_buckets(map, key, &first, &second);
+    return (bucket == first) ? second : first;
+}
+
+static int find_in_bucket(CuckooBucket* bucket, void* key)
+{
+    for(int i = 0; i < cuckoo_bucket_slots; i += 1)
+    {
+        if(bucket->keys[i] == key)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// This is xorshift64, which is plenty to pick which pair to move along.
+static int pick_victim(CuckooMap* map)
+{
+    u64 x = map->random_state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    map->random_state = x;
+    return x % cuckoo_bucket_slots;
+}
+
+// The table's allocated with room to spare, so that the buckets can start on
+// a cache line boundary.
+static void allocate_buckets(CuckooMap* map, int buckets_count, Heap* heap)
+{
+    ASSERT(buckets_count >= cuckoo_first_buckets_count);
+    ASSERT((buckets_count & (buckets_count - 1)) == 0);
+
+    u64 bytes = sizeof(CuckooBucket) * buckets_count + cache_line_bytes - 1;
+    map->block = HEAP_ALLOCATE(heap, u8, bytes);
+    upointer address = reinterpret_cast<upointer>(map->block);
+    address = (address + cache_line_bytes - 1) & ~(cache_line_bytes - 1);
+    map->buckets = reinterpret_cast<CuckooBucket*>(address);
+    map->buckets_count = buckets_count;
+}
+
+void cuckoo_map_create(CuckooMap* map, Heap* heap)
+{
+    map->buckets = nullptr;
+    map->block = nullptr;
+    map->zero_key_value = nullptr;
+    map->random_state = UINT64_C(0x9e3779b97f4a7c15);
+    map->buckets_count = 0;
+    map->count = 0;
+    map->grows = 0;
+    map->has_zero_key = false;
+}
+
+void cuckoo_map_destroy(CuckooMap* map, Heap* heap)
+{
+    if(map)
+    {
+        SAFE_HEAP_DEALLOCATE(heap, map->block);
+        map->buckets = nullptr;
+        map->buckets_count = 0;
+        map->count = 0;
+        map->has_zero_key = false;
+    }
+}
+
+// The first bucket is looked through before the second, and each is a single
+// cache line, so no lookup touches more than two.
+bool cuckoo_map_get(CuckooMap* map, void* key, void** value)
+{
+    if(key == cuckoo_empty)
+    {
+        *value = map->zero_key_value;
+        return map->has_zero_key;
+    }
+    else if(map->buckets_count == 0)
+    {
+        return false;
+    }
+
+    int first;
+    int second;
+    get_buckets(map, key, &first, &second);
+
+    CuckooBucket* bucket = &map->buckets[first];
+    int slot = find_in_bucket(bucket, key);
+    if(slot == -1)
+    {
+        bucket = &map->buckets[second];
+        slot = find_in_bucket(bucket, key);
+        if(slot == -1)
+        {
+            return false;
+        }
+    }
+    *value = bucket->values[slot];
+    return true;
+}
+
+// This puts a pair that isn't in the table yet into one of its buckets,
+// moving others along to their other buckets to make room if it has to. If it
+// runs out of moves, it gives back the pair that was left without a slot,
+// which may not be the one it started with.
+static bool place_pair(CuckooMap* map, void** key, void** value)
+{
+    int first;
+    int second;
+    get_buckets(map, *key, &first, &second);
+
+    int bucket = first;
+    for(int kicks = 0; kicks <= cuckoo_kicks_cap; kicks += 1)
+    {
+        CuckooBucket* into = &map->buckets[bucket];
+        int slot = find_in_bucket(into, cuckoo_empty);
+        if(slot == -1 && kicks == 0)
+        {
+            bucket = second;
+            into = &map->buckets[bucket];
+            slot = find_in_bucket(into, cuckoo_empty);
+        }
+        if(slot != -1)
+        {
+            into->keys[slot] = *key;
+            into->values[slot] = *value;
+            return true;
+        }
+
+        // Swap the pair in for one that's already there, and take that one
+        // to its other bucket.
+        slot = pick_victim(map);
+        void* moved_key = into->keys[slot];
+        void* moved_value = into->values[slot];
+        into->keys[slot] = *key;
+        into->values[slot] = *value;
+        *key = moved_key;
+        *value = moved_value;
+        bucket = get_other_bucket(map, moved_key, bucket);
+    }
+    return false;
+}
+
+// A bigger table can still fail to fit every pair, however unlikely. Then it
+// just tries again with one bigger still.
+static void grow_buckets(CuckooMap* map, int buckets_count, Heap* heap)
+{
+    CuckooBucket* prior_buckets = map->buckets;
+    void* prior_block = map->block;
+    int prior_buckets_count = map->buckets_count;
+
+    for(;; buckets_count *= 2)
+    {
+        allocate_buckets(map, buckets_count, heap);
+
+        bool placed_all = true;
+        for(int i = 0; i < prior_buckets_count && placed_all; i += 1)
+        {
+            CuckooBucket* bucket = &prior_buckets[i];
+            for(int j = 0; j < cuckoo_bucket_slots; j += 1)
+            {
+                void* key = bucket->keys[j];
+                void* value = bucket->values[j];
+                if(key != cuckoo_empty && !place_pair(map, &key, &value))
+                {
+                    placed_all = false;
+                    break;
+                }
+            }
+        }
+        if(placed_all)
+        {
+            break;
+        }
+        HEAP_DEALLOCATE(heap, map->block);
+    }
+
+    HEAP_DEALLOCATE(heap, prior_block);
+    map->grows += 1;
+}
+
+void cuckoo_map_add(CuckooMap* map, void* key, void* value, Heap* heap)
+{
+    if(key == cuckoo_empty)
+    {
+        map->count += !map->has_zero_key;
+        map->has_zero_key = true;
+        map->zero_key_value = value;
+        return;
+    }
+    else if(map->buckets_count == 0)
+    {
+        allocate_buckets(map, cuckoo_first_buckets_count, heap);
+    }
+
+    int first;
+    int second;
+    get_buckets(map, key, &first, &second);
+    CuckooBucket* buckets[2] = {&map->buckets[first], &map->buckets[second]};
+    for(int i = 0; i < 2; i += 1)
+    {
+        int slot = find_in_bucket(buckets[i], key);
+        if(slot != -1)
+        {
+            buckets[i]->values[slot] = value;
+            return;
+        }
+    }
+
+    int slots_count = cuckoo_bucket_slots * map->buckets_count;
+    int load_limit = (7 * slots_count) / 8;
+    if(map->count - map->has_zero_key >= load_limit)
+    {
+        grow_buckets(map, 2 * map->buckets_count, heap);
+    }
+    while(!place_pair(map, &key, &value))
+    {
+        grow_buckets(map, 2 * map->buckets_count, heap);
+    }
+    map->count += 1;
+}
+
+void cuckoo_map_remove(CuckooMap* map, void* key)
+{
+    if(key == cuckoo_empty)
+    {
+        map->count -= map->has_zero_key;
+        map->has_zero_key = false;
+        map->zero_key_value = nullptr;
+        return;
+    }
+    else if(map->buckets_count == 0)
+    {
+        return;
+    }
+
+    int first;
+    int second;
+    get_buckets(map, key, &first, &second);
+    CuckooBucket* buckets[2] = {&map->buckets[first], &map->buckets[second]};
+    for(int i = 0; i < 2; i += 1)
+    {
+        int slot = find_in_bucket(buckets[i], key);
+        if(slot != -1)
+        {
+            buckets[i]->keys[slot] = cuckoo_empty;
+            buckets[i]->values[slot] = nullptr;
+            map->count -= 1;
+            return;
+        }
+    }
+}
+
+void cuckoo_map_reserve(CuckooMap* map, int cap, Heap* heap)
+{
+    int slots_count = (8 * cap) / 7 + 1;
+    int buckets_count = cuckoo_first_buckets_count;
+    while(cuckoo_bucket_slots * buckets_count < slots_count)
+    {
+        buckets_count *= 2;
+    }
+
+    if(map->buckets_count == 0)
+    {
+        allocate_buckets(map, buckets_count, heap);
+    }
+    else if(buckets_count > map->buckets_count)
+    {
+        grow_buckets(map, buckets_count, heap);
+    }
+}
+
+// Iteration goes through every slot of every bucket, and then on to the null
+// key, which is given the index just past the last slot.
+
+static bool is_slot_used(CuckooMap* map, int index)
+{
+    int slots_count = cuckoo_bucket_slots * map->buckets_count;
+    if(index == slots_count)
+    {
+        return map->has_zero_key;
+    }
+    CuckooBucket* bucket = &map->buckets[index / cuckoo_bucket_slots];
+    return bucket->keys[index % cuckoo_bucket_slots] != cuckoo_empty;
+}
+
+CuckooMapIterator cuckoo_map_iterator_next(CuckooMapIterator it)
+{
+    CuckooMap* map = it.map;
+    int slots_count = cuckoo_bucket_slots * map->buckets_count;
+    for(int i = it.index + 1; i <= slots_count; i += 1)
+    {
+        if(is_slot_used(map, i))
+        {
+            return {map, i};
+        }
+    }
+    return {map, cuckoo_end_index};
+}
+
+CuckooMapIterator cuckoo_map_iterator_start(CuckooMap* map)
+{
+    return cuckoo_map_iterator_next({map, -1});
+}
+
+bool cuckoo_map_iterator_is_not_end(CuckooMapIterator it)
+{
+    return it.index != cuckoo_end_index;
+}
+
+void* cuckoo_map_iterator_get_key(CuckooMapIterator it)
+{
+    CuckooMap* map = it.map;
+    ASSERT(cuckoo_map_iterator_is_not_end(it));
+    if(it.index == cuckoo_bucket_slots * map->buckets_count)
+    {
+        return cuckoo_empty;
+    }
+    CuckooBucket* bucket = &map->buckets[it.index / cuckoo_bucket_slots];
+    return bucket->keys[it.index % cuckoo_bucket_slots];
+}
+
+void* cuckoo_map_iterator_get_value(CuckooMapIterator it)
+{
+    CuckooMap* map = it.map;
+    ASSERT(cuckoo_map_iterator_is_not_end(it));
+    if(it.index == cuckoo_bucket_slots * map->buckets_count)
+    {
+        return map->zero_key_value;
+    }
+    CuckooBucket* bucket = &map->buckets[it.index / cuckoo_bucket_slots];
+    return bucket->values[it.index % cuckoo_bucket_slots];
+}
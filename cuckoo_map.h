@@ -0,0 +1,70 @@
+#ifndef CUCKOO_MAP_H_
+#define CUCKOO_MAP_H_
+
+#include "sized_types.h"
+
+struct Heap;
+
+namespace
+{
+    const int cuckoo_bucket_slots = 4;
+}
+
+// A bucket's keys and values fill exactly one 64-byte cache line, and the
+// buckets are allocated on cache line boundaries.
+struct alignas(64) CuckooBucket
+{
+    void* keys[cuckoo_bucket_slots];
+    void* values[cuckoo_bucket_slots];
+};
+
+// This is a hash table for the same pointer-sized pairs as Map, but it's a
+// bucketized cuckoo table instead. Each key can only ever be in one of two
+// buckets, picked by two hash functions, so a lookup touches at most two
+// cache lines however full the table is. Map is faster on average, but this
+// has the better worst case.
+//
+// Adding a key to two full buckets moves a pair out of one of them to its
+// other bucket, which may move another pair along in turn, and so on. If that
+// goes on too long, the table grows. The table can be filled to 7/8 of its
+// slots before it grows anyway.
+//
+// As in Map, a null key can't be told apart from an empty slot, so it's kept
+// on the side.
+struct CuckooMap
+{
+    CuckooBucket* buckets;
+    void* block;
+    void* zero_key_value;
+    u64 random_state;
+    int buckets_count;
+    int count;
+    int grows;
+    bool has_zero_key;
+};
+
+void cuckoo_map_create(CuckooMap* map, Heap* heap);
+void cuckoo_map_destroy(CuckooMap* map, Heap* heap);
+bool cuckoo_map_get(CuckooMap* map, void* key, void** value);
+void cuckoo_map_add(CuckooMap* map, void* key, void* value, Heap* heap);
+void cuckoo_map_remove(CuckooMap* map, void* key);
+void cuckoo_map_reserve(CuckooMap* map, int cap, Heap* heap);
+
+struct CuckooMapIterator
+{
+    CuckooMap* map;
+    int index;
+};
+
+CuckooMapIterator cuckoo_map_iterator_next(CuckooMapIterator it);
+CuckooMapIterator cuckoo_map_iterator_start(CuckooMap* map);
+bool cuckoo_map_iterator_is_not_end(CuckooMapIterator it);
+void* cuckoo_map_iterator_get_key(CuckooMapIterator it);
+void* cuckoo_map_iterator_get_value(CuckooMapIterator it);
+
+#define ITERATE_CUCKOO_MAP(it, map) \
+    for(CuckooMapIterator it = cuckoo_map_iterator_start(map); \
+        cuckoo_map_iterator_is_not_end(it); \
+        it = cuckoo_map_iterator_next(it))
+
+#endif // CUCKOO_MAP_H_
@@ -1,11 +1,22 @@
 #include "benchmark.cpp"
 #include "clock.cpp"
+#include "cpu.cpp"
+#include "cuckoo_map.cpp"
 #include "map.cpp"
+#include "memory.cpp"
+#include "perf_counters.cpp"
 #include "random.cpp"
 #include "tests.cpp"
 
 int main(int argc, char** argv)
 {
+    BenchmarkOptions options;
+    bool failed;
+    if(!parse_benchmark_options(&options, argc, argv, &failed))
+    {
+        return failed;
+    }
+
     Heap heap = {};
     heap_create(&heap, 0x8000000);
 
@@ -16,7 +27,29 @@ int main(int argc, char** argv)
 #endif
 
     test_map(&heap, file);
-    run_benchmark(&heap, file);
+    print_instruction_set(file);
+    pin_benchmark(&options, file);
+    bool passed = true;
+    if(options.run_throughput)
+    {
+        passed = run_benchmark(&options, &heap, file);
+    }
+    if(options.run_latency)
+    {
+        run_latency_benchmark(&options, &heap, file);
+    }
+    if(options.run_memory)
+    {
+        run_memory_benchmark(&options, &heap, file);
+    }
+    if(options.run_mixed)
+    {
+        run_mixed_benchmark(&options, &heap, file);
+    }
+    if(options.run_threads)
+    {
+        run_threads_benchmark(&options, &heap, file);
+    }
 
     if(file != stdout)
     {
@@ -25,5 +58,5 @@ int main(int argc, char** argv)
 
     heap_destroy(&heap);
 
-    return 0;
+    return !passed;
 }
@@ -2,6 +2,42 @@
 
 #include "assert.h"
 #include "memory.h"
+#include "platform_definitions.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <thread>
+
+#if defined(COMPILER_MSVC) && \
+    (defined(INSTRUCTION_SET_X86) || defined(INSTRUCTION_SET_X64))
+#include <xmmintrin.h>
+#define PREFETCH(address) \
+    _mm_prefetch(reinterpret_cast<const char*>(address), _MM_HINT_T0)
+#elif defined(COMPILER_GCC)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
+
+// The vector kernels compare keys as 64-bit lanes, so they're only built for
+// x64. GCC has to be told which functions may use which instructions, whereas
+// Visual C++ allows any intrinsic in any function.
+#if defined(INSTRUCTION_SET_X64)
+#define VECTOR_KERNELS_AVAILABLE
+#if defined(COMPILER_MSVC)
+#include <intrin.h>
+#define TARGET_SSE4_2
+#define TARGET_AVX2
+#else
+#include <immintrin.h>
+#define TARGET_SSE4_2 __attribute__((target("sse4.2")))
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
 
 namespace
 {
@@ -14,282 +50,2686 @@ namespace
     // This value is used to indicate an invalid iterator, or one that's reached
     // the end of iteration.
     const int end_index = -1;
+
+    // signifies that a key isn't among a small map's pairs
+    const int not_found = -1;
+
+    // the cap of the table a small map moves to when it overflows
+    const int first_table_cap = 16;
+
+    // the number of slots in each chunk a snapshot can copy on its own
+    const int snapshot_chunk_slots = 1024;
+
+    // Tables smaller than this grow inline even when grows are meant to
+    // happen in the background, since starting a thread would cost more.
+    const int background_growth_min_cap = 4096;
+
+    // the most writes logged during a background grow before waiting on it
+    const int growth_log_cap = 4096;
+
+    // the number of keys a batch operation finds the slots of at once
+    const int batch_block = 1024;
+
+    // how many keys ahead a batch operation prefetches the home slots of
+    const int batch_prefetch = 16;
+
+    // the number of bits of a slot sorted on in each pass of a radix sort
+    const int slot_radix_bits = 8;
+
+    // Adds are watched in windows of this many. If the mean distance of their
+    // slots from home over a window is past the limit, the keys are taken to
+    // be clustering on the hash. A good hash averages under eight at the
+    // highest load a table's allowed.
+    const int probe_window_adds = 256;
+    const int probe_distance_limit = 32;
+
+    // A batch add keeps each key's place in its block in this many low bits,
+    // under its home slot, so that sorting by home carries the place along.
+    const int batch_index_bits = 10;
+    static_assert(batch_block <= (1 << batch_index_bits),
+        "A key's place in its block has to fit in the index bits.");
+
+    // the number of cells in the first block of a value pool, and the most
+    // blocks a pool can have, since each is as big as all the ones before
+    const int pool_first_block_cells = 64;
+    const int pool_blocks_cap = 48;
+}
+
+// A chunk of a table copied out to a snapshot, because the map was about to
+// write to it.
+struct SnapshotChunk
+{
+    void* keys[snapshot_chunk_slots];
+    void* values[snapshot_chunk_slots];
+    u32 hashes[snapshot_chunk_slots];
+};
+
+// The keys, values, and hashes are the map's own table. They're only read
+// for chunks that haven't been copied yet, which is while chunks has a null
+// for them. The mutex guards the chunks against readers on other threads.
+struct MapSnapshot
+{
+    std::mutex mutex;
+    Map* map;
+    Heap* heap;
+    void** keys;
+    void** values;
+    u32* hashes;
+    SnapshotChunk** chunks;
+    MapSnapshot* next;
+    u64 hash_seed;
+    s64 cap;
+    s64 count;
+    s64 chunks_count;
+    void* small_keys[map_small_cap];
+    void* small_values[map_small_cap];
+};
+
+// While building is set, the helper thread is filling in the new table from
+// the old one, and neither can be written. Writes are logged in added and
+// removed instead, which never both hold the same key.
+struct MapGrowth
+{
+    std::thread thread;
+    std::atomic<bool> built;
+    Heap* heap;
+    Map added;
+    Map removed;
+    void** keys;
+    void** values;
+    u32* hashes;
+    s64 cap;
+    s64 log_cap;
+    float start_load;
+    bool building;
+};
+
+// A flag for each slot, including the overflow slot, says whether its pair
+// has been used since the hand last swept past it.
+struct MapCache
+{
+    bool* referenced;
+    MapEvict evict;
+    void* user_data;
+    s64 limit;
+    s64 hand;
+};
+
+// Values kept in place live in cells carved out of blocks that aren't moved
+// or freed until the map is. After the first, each block has as many cells as
+// all the ones before it together, so a pool never has more than a few dozen.
+// The cells of removed pairs go on a free list, each holding the address of
+// the next.
+struct MapPool
+{
+    void** blocks[pool_blocks_cap];
+    void** free_cells;
+    // the next cell of the newest block that hasn't been used yet
+    void** next_cell;
+    void** block_end;
+    s64 cells_count;
+    int blocks_count;
+};
+
+// This is the finalizer from MurmurHash3, where every bit of the input
+// affects every bit of the output.
+static u64 mix_bits(u64 x)
+{
+    x ^= x >> 33;
+    x *= UINT64_C(0xff51afd7ed558ccd);
+    x ^= x >> 33;
+    x *= UINT64_C(0xc4ceb9fe1a85ec53);
+    x ^= x >> 33;
+    return x;
+}
+
+// The seeded hash is stronger than map_hash_key, and mixes in the seed, so
+// that which keys collide can't be known without it.
+static u64 hash_with_seed(u64 key, u64 seed)
+{
+    if(!seed)
+    {
+        return map_hash_key(key);
+    }
+    return mix_bits(key ^ seed);
 }
 
-static bool is_power_of_two(unsigned int x)
+static u64 hash_key(Map* map, void* key)
+{
+    return hash_with_seed(reinterpret_cast<u64>(key), map->hash_seed);
+}
+
+// Only the low half of each hash is stored, which is all of the home slot
+// in a table of up to map_stored_hash_cap slots. A bigger table has no hashes
+// array at all, and works the whole hash out again from the key.
+static bool stores_hashes(s64 cap)
+{
+    return cap <= map_stored_hash_cap;
+}
+
+static u32* allocate_hashes(s64 cap, Heap* heap)
+{
+    if(!stores_hashes(cap))
+    {
+        return nullptr;
+    }
+    return HEAP_ALLOCATE(heap, u32, cap);
+}
+
+static u64 get_stored_hash(Map* map, s64 slot)
+{
+    if(!stores_hashes(map->cap))
+    {
+        return hash_key(map, map->keys[slot]);
+    }
+    return map->hashes[slot];
+}
+
+static void store_hash(Map* map, s64 slot, u64 hash)
+{
+    if(stores_hashes(map->cap))
+    {
+        map->hashes[slot] = static_cast<u32>(hash);
+    }
+}
+
+static void move_stored_hash(Map* map, s64 to, s64 from)
+{
+    if(stores_hashes(map->cap))
+    {
+        map->hashes[to] = map->hashes[from];
+    }
+}
+
+// A hash stored by one map can be reused by another only if both hash the
+// same way, and the other is small enough to place keys by a stored hash.
+static u64 hash_for(Map* map, Map* hashed_by, void* key, u64 hash)
+{
+    if(map->hash_seed == hashed_by->hash_seed && stores_hashes(map->cap))
+    {
+        return hash;
+    }
+    return hash_key(map, key);
+}
+
+static bool is_power_of_two(u64 x)
 {
     return (x != 0) && !(x & (x - 1));
 }
 
-static u32 next_power_of_two(u32 x)
+static u64 next_power_of_two(u64 x)
 {
     x |= x >> 1;
     x |= x >> 2;
     x |= x >> 4;
     x |= x >> 8;
     x |= x >> 16;
+    x |= x >> 32;
     return x + 1;
 }
 
 // In an expression x % n, if n is a power of two the expression can be
 // simplified to x & (n - 1). So, this check is for making sure that
 // reduction is legal for a given n.
-static bool can_use_bitwise_and_to_cycle(int count)
+static bool can_use_bitwise_and_to_cycle(s64 count)
 {
     return is_power_of_two(count);
 }
 
-static u32 hash_key(u64 key)
+static bool is_small(Map* map)
 {
-    key = (~key) + (key << 18); // key = (key << 18) - key - 1;
-    key = key ^ (key >> 31);
-    key = key * 21; // key = (key + (key << 2)) + (key << 4);
-    key = key ^ (key >> 11);
-    key = key + (key << 6);
-    key = key ^ (key >> 22);
-    return key;
+    return map->cap == 0;
 }
 
+static void detach_snapshots(Map* map, Heap* heap);
+static bool is_growing(Map* map);
+static bool should_start_growing(Map* map);
+static void start_growing(Map* map);
+static void finish_growing(Map* map);
+static void wait_for_growing(Map* map);
+static void** add_key_while_growing(Map* map, void* key, Heap* heap);
+static void remove_while_growing(Map* map, void* key);
+static void reset_references(Map* map, Heap* heap);
+
 void map_create(Map* map, Heap* heap)
 {
-    const int cap = 16;
-    map->cap = cap;
+    map->keys = nullptr;
+    map->values = nullptr;
+    map->hashes = nullptr;
+    map->cap = 0;
     map->count = 0;
-
-    map->keys = HEAP_ALLOCATE(heap, void*, cap + 1);
-    map->values = HEAP_ALLOCATE(heap, void*, cap + 1);
-    map->hashes = HEAP_ALLOCATE(heap, u32, cap);
-
-    int overflow_index = cap;
-    map->keys[overflow_index] = const_cast<void*>(overflow_empty);
-    map->values[overflow_index] = nullptr;
+    map->grows = 0;
+    map->snapshots = nullptr;
+    map->shared_chunks = nullptr;
+    map->growth = nullptr;
+    map->cache = nullptr;
+    map->pool = nullptr;
+    map->hash_seed = 0;
+    map->window_distance = 0;
+    map->window_adds = 0;
+#if defined(MAP_COUNT_PROBES)
+    map->probes = 0;
+    map->probed_operations = 0;
+#endif
 }
 
 void map_destroy(Map* map, Heap* heap)
 {
     if(map)
     {
+        MapGrowth* growth = map->growth;
+        if(growth)
+        {
+            wait_for_growing(map);
+            map_destroy(&growth->added, heap);
+            map_destroy(&growth->removed, heap);
+            growth->~MapGrowth();
+            SAFE_HEAP_DEALLOCATE(heap, map->growth);
+        }
+
+        if(map->cache)
+        {
+            SAFE_HEAP_DEALLOCATE(heap, map->cache->referenced);
+            SAFE_HEAP_DEALLOCATE(heap, map->cache);
+        }
+
+        MapPool* pool = map->pool;
+        if(pool)
+        {
+            for(int i = 0; i < pool->blocks_count; i += 1)
+            {
+                HEAP_DEALLOCATE(heap, pool->blocks[i]);
+            }
+            SAFE_HEAP_DEALLOCATE(heap, map->pool);
+        }
+
+        detach_snapshots(map, heap);
         SAFE_HEAP_DEALLOCATE(heap, map->keys);
         SAFE_HEAP_DEALLOCATE(heap, map->values);
         SAFE_HEAP_DEALLOCATE(heap, map->hashes);
 
         map->cap = 0;
         map->count = 0;
+        map->hash_seed = 0;
     }
 }
 
-static int find_slot(void** keys, int cap, void* key, u32 hash)
+// Small maps have no overflow slot, so a null key is scanned for just like any
+// other.
+static int find_small_slot(Map* map, void* key)
 {
-    ASSERT(can_use_bitwise_and_to_cycle(cap));
+    for(int i = 0; i < map->count; i += 1)
+    {
+        if(map->small_keys[i] == key)
+        {
+            return i;
+        }
+    }
+    return not_found;
+}
 
-    int probe = hash & (cap - 1);
+// These are the loops worth having a version of for each instruction set.
+// find_slot_from probes from the given slot on, and find_used_slot gives the
+// first slot from first up to end that holds a pair, or end if none does.
+// hash_keys hashes with map_hash_key, since the seeded hash multiplies 64-bit
+// lanes, which neither set can do.
+struct MapKernels
+{
+    s64 (*find_slot_from)(void** keys, s64 cap, void* key, s64 probe);
+    s64 (*find_used_slot)(void** keys, s64 first, s64 end);
+    void (*hash_keys)(void** keys, u64* hashes, int count);
+};
+
+static s64 find_slot_from_scalar(void** keys, s64 cap, void* key, s64 probe)
+{
     while(keys[probe] != key && keys[probe] != empty)
     {
         probe = (probe + 1) & (cap - 1);
     }
-
     return probe;
 }
 
-bool map_get(Map* map, void* key, void** value)
+static s64 find_used_slot_scalar(void** keys, s64 first, s64 end)
 {
-    if(key == empty)
+    s64 slot = first;
+    while(slot < end && keys[slot] == empty)
     {
-        int overflow_index = map->cap;
-        if(map->keys[overflow_index] == overflow_empty)
+        slot += 1;
+    }
+    return slot;
+}
+
+static void hash_keys_scalar(void** keys, u64* hashes, int count)
+{
+    for(int i = 0; i < count; i += 1)
+    {
+        hashes[i] = map_hash_key(reinterpret_cast<u64>(keys[i]));
+    }
+}
+
+#if defined(VECTOR_KERNELS_AVAILABLE)
+
+static int find_first_set(u32 mask)
+{
+    ASSERT(mask);
+#if defined(COMPILER_MSVC)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// A probe compares a group of keys at a time, starting wherever it likes,
+// until the group would run past the end of the table. The last few slots
+// are looked at one by one, since the overflow slot just past them has to be
+// left out, and then the probe wraps around to the start.
+
+TARGET_SSE4_2
+static s64 find_slot_from_sse4_2(void** keys, s64 cap, void* key, s64 probe)
+{
+    const int lanes = 2;
+    __m128i wanted = _mm_set1_epi64x(reinterpret_cast<s64>(key));
+    __m128i zero = _mm_setzero_si128();
+    for(;;)
+    {
+        for(; probe + lanes <= cap; probe += lanes)
         {
-            return false;
+            __m128i group = _mm_loadu_si128(
+                reinterpret_cast<const __m128i*>(&keys[probe]));
+            __m128i found = _mm_or_si128(_mm_cmpeq_epi64(group, wanted),
+                _mm_cmpeq_epi64(group, zero));
+            u32 mask = _mm_movemask_pd(_mm_castsi128_pd(found));
+            if(mask)
+            {
+                return probe + find_first_set(mask);
+            }
         }
-        else
+        for(; probe < cap; probe += 1)
         {
-            *value = map->values[overflow_index];
-            return true;
+            if(keys[probe] == key || keys[probe] == empty)
+            {
+                return probe;
+            }
         }
+        probe = 0;
     }
+}
 
-    u32 hash = hash_key(reinterpret_cast<u64>(key));
-    int slot = find_slot(map->keys, map->cap, key, hash);
-
-    bool got = map->keys[slot] == key;
-    if(got)
+TARGET_AVX2
+static s64 find_slot_from_avx2(void** keys, s64 cap, void* key, s64 probe)
+{
+    const int lanes = 4;
+    __m256i wanted = _mm256_set1_epi64x(reinterpret_cast<s64>(key));
+    __m256i zero = _mm256_setzero_si256();
+    for(;;)
     {
-        *value = map->values[slot];
+        for(; probe + lanes <= cap; probe += lanes)
+        {
+            __m256i group = _mm256_loadu_si256(
+                reinterpret_cast<const __m256i*>(&keys[probe]));
+            __m256i found = _mm256_or_si256(
+                _mm256_cmpeq_epi64(group, wanted),
+                _mm256_cmpeq_epi64(group, zero));
+            u32 mask = _mm256_movemask_pd(_mm256_castsi256_pd(found));
+            if(mask)
+            {
+                return probe + find_first_set(mask);
+            }
+        }
+        for(; probe < cap; probe += 1)
+        {
+            if(keys[probe] == key || keys[probe] == empty)
+            {
+                return probe;
+            }
+        }
+        probe = 0;
     }
-    return got;
 }
 
-static void map_grow(Map* map, int cap, Heap* heap)
+TARGET_SSE4_2
+static s64 find_used_slot_sse4_2(void** keys, s64 first, s64 end)
 {
-    int prior_cap = map->cap;
-
-    void** keys = HEAP_ALLOCATE(heap, void*, cap + 1);
-    void** values = HEAP_ALLOCATE(heap, void*, cap + 1);
-    u32* hashes = HEAP_ALLOCATE(heap, u32, cap);
-
-    for(int i = 0; i < prior_cap; i += 1)
+    const int lanes = 2;
+    const u32 all_lanes = (1 << lanes) - 1;
+    __m128i zero = _mm_setzero_si128();
+    s64 slot = first;
+    for(; slot + lanes <= end; slot += lanes)
     {
-        void* key = map->keys[i];
-        if(key == empty)
+        __m128i group = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(&keys[slot]));
+        __m128i unused = _mm_cmpeq_epi64(group, zero);
+        u32 mask = ~_mm_movemask_pd(_mm_castsi128_pd(unused)) & all_lanes;
+        if(mask)
         {
-            continue;
+            return slot + find_first_set(mask);
         }
-        u32 hash = map->hashes[i];
-        int slot = find_slot(keys, cap, key, hash);
-        keys[slot] = key;
-        hashes[slot] = hash;
-        values[slot] = map->values[i];
     }
-    // Copy over the overflow pair.
-    keys[cap] = map->keys[prior_cap];
-    values[cap] = map->values[prior_cap];
-
-    HEAP_DEALLOCATE(heap, map->keys);
-    HEAP_DEALLOCATE(heap, map->values);
-    HEAP_DEALLOCATE(heap, map->hashes);
-    map->keys = keys;
-    map->values = values;
-    map->hashes = hashes;
-    map->cap = cap;
+    return find_used_slot_scalar(keys, slot, end);
 }
 
-void map_add(Map* map, void* key, void* value, Heap* heap)
+TARGET_AVX2
+static s64 find_used_slot_avx2(void** keys, s64 first, s64 end)
 {
-    if(key == empty)
+    const int lanes = 4;
+    const u32 all_lanes = (1 << lanes) - 1;
+    __m256i zero = _mm256_setzero_si256();
+    s64 slot = first;
+    for(; slot + lanes <= end; slot += lanes)
     {
-        int overflow_index = map->cap;
-        map->keys[overflow_index] = key;
-        map->values[overflow_index] = value;
-        map->count += 1;
-        return;
+        __m256i group = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(&keys[slot]));
+        __m256i unused = _mm256_cmpeq_epi64(group, zero);
+        u32 mask = ~_mm256_movemask_pd(_mm256_castsi256_pd(unused)) & all_lanes;
+        if(mask)
+        {
+            return slot + find_first_set(mask);
+        }
     }
+    return find_used_slot_scalar(keys, slot, end);
+}
 
-    int load_limit = (3 * map->cap) / 4;
-    if(map->count >= load_limit)
+// These are map_hash_key step for step, on a lane per key. Multiplying by 21
+// is done as shifts and adds, like the comment there suggests.
+
+TARGET_SSE4_2
+static void hash_keys_sse4_2(void** keys, u64* hashes, int count)
+{
+    const int lanes = 2;
+    __m128i ones = _mm_set1_epi64x(-1);
+    int i = 0;
+    for(; i + lanes <= count; i += lanes)
     {
-        map_grow(map, 2 * map->cap, heap);
+        __m128i key = _mm_loadu_si128(
+            reinterpret_cast<const __m128i*>(&keys[i]));
+        key = _mm_add_epi64(_mm_xor_si128(key, ones), _mm_slli_epi64(key, 18));
+        key = _mm_xor_si128(key, _mm_srli_epi64(key, 31));
+        key = _mm_add_epi64(_mm_add_epi64(key, _mm_slli_epi64(key, 2)),
+            _mm_slli_epi64(key, 4));
+        key = _mm_xor_si128(key, _mm_srli_epi64(key, 11));
+        key = _mm_add_epi64(key, _mm_slli_epi64(key, 6));
+        key = _mm_xor_si128(key, _mm_srli_epi64(key, 22));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(&hashes[i]), key);
     }
+    hash_keys_scalar(&keys[i], &hashes[i], count - i);
+}
 
-    u32 hash = hash_key(reinterpret_cast<u64>(key));
-    int slot = find_slot(map->keys, map->cap, key, hash);
-    map->keys[slot] = key;
-    map->values[slot] = value;
-    map->hashes[slot] = hash;
-    map->count += 1;
+TARGET_AVX2
+static void hash_keys_avx2(void** keys, u64* hashes, int count)
+{
+    const int lanes = 4;
+    __m256i ones = _mm256_set1_epi64x(-1);
+    int i = 0;
+    for(; i + lanes <= count; i += lanes)
+    {
+        __m256i key = _mm256_loadu_si256(
+            reinterpret_cast<const __m256i*>(&keys[i]));
+        key = _mm256_add_epi64(_mm256_xor_si256(key, ones),
+            _mm256_slli_epi64(key, 18));
+        key = _mm256_xor_si256(key, _mm256_srli_epi64(key, 31));
+        key = _mm256_add_epi64(_mm256_add_epi64(key, _mm256_slli_epi64(key, 2)),
+            _mm256_slli_epi64(key, 4));
+        key = _mm256_xor_si256(key, _mm256_srli_epi64(key, 11));
+        key = _mm256_add_epi64(key, _mm256_slli_epi64(key, 6));
+        key = _mm256_xor_si256(key, _mm256_srli_epi64(key, 22));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(&hashes[i]), key);
+    }
+    hash_keys_scalar(&keys[i], &hashes[i], count - i);
 }
 
-static bool in_cyclic_interval(int x, int first, int second)
+// AVX2 also needs the operating system to save the upper halves of the
+// vector registers on a context switch, which GCC's check already covers.
+static MapInstructionSet find_best_instruction_set()
 {
-    if(second > first)
+#if defined(COMPILER_MSVC)
+    const int sse4_2_bit = 1 << 20;
+    const int osxsave_bit = 1 << 27;
+    const int avx_bit = 1 << 28;
+    const int avx2_bit = 1 << 5;
+    const u64 vector_state = 0x6;
+
+    int info[4];
+    __cpuid(info, 0);
+    int leaves = info[0];
+    __cpuid(info, 1);
+    bool sse4_2 = (info[2] & sse4_2_bit) != 0;
+    bool avx = (info[2] & osxsave_bit) && (info[2] & avx_bit)
+        && (_xgetbv(0) & vector_state) == vector_state;
+    bool avx2 = false;
+    if(avx && leaves >= 7)
     {
-        return x > first && x <= second;
+        __cpuidex(info, 7, 0);
+        avx2 = (info[1] & avx2_bit) != 0;
     }
-    else
+#else
+    __builtin_cpu_init();
+    bool sse4_2 = __builtin_cpu_supports("sse4.2");
+    bool avx2 = __builtin_cpu_supports("avx2");
+#endif
+
+    if(avx2)
     {
-        return x > first || x <= second;
+        return MapInstructionSet::AVX2;
+    }
+    else if(sse4_2)
+    {
+        return MapInstructionSet::SSE4_2;
     }
+    return MapInstructionSet::Scalar;
 }
 
-void map_remove(Map* map, void* key)
+#else
+
+static MapInstructionSet find_best_instruction_set()
 {
-    ASSERT(can_use_bitwise_and_to_cycle(map->cap));
+    return MapInstructionSet::Scalar;
+}
 
-    if(key == empty)
+#endif // defined(VECTOR_KERNELS_AVAILABLE)
+
+static MapKernels get_kernels(MapInstructionSet instruction_set)
+{
+    switch(instruction_set)
     {
-        int overflow_index = map->cap;
-        if(map->keys[overflow_index] == key)
+        default:
+        case MapInstructionSet::Scalar:
         {
-            map->keys[overflow_index] = const_cast<void*>(overflow_empty);
-            map->values[overflow_index] = nullptr;
-            map->count -= 1;
+            return {find_slot_from_scalar, find_used_slot_scalar,
+                hash_keys_scalar};
         }
-        return;
+#if defined(VECTOR_KERNELS_AVAILABLE)
+        case MapInstructionSet::SSE4_2:
+        {
+            return {find_slot_from_sse4_2, find_used_slot_sse4_2,
+                hash_keys_sse4_2};
+        }
+        case MapInstructionSet::AVX2:
+        {
+            return {find_slot_from_avx2, find_used_slot_avx2, hash_keys_avx2};
+        }
+#endif
     }
+}
 
-    u32 hash = hash_key(reinterpret_cast<u64>(key));
-    int slot = find_slot(map->keys, map->cap, key, hash);
-    if(map->keys[slot] == empty)
+// These are picked once, when the program starts.
+static MapInstructionSet best_instruction_set = find_best_instruction_set();
+static MapInstructionSet chosen_instruction_set = best_instruction_set;
+static MapKernels kernels = get_kernels(best_instruction_set);
+
+MapInstructionSet map_get_instruction_set()
+{
+    return chosen_instruction_set;
+}
+
+bool map_use_instruction_set(MapInstructionSet instruction_set)
+{
+    if(instruction_set > best_instruction_set)
     {
-        return;
+        return false;
+    }
+    chosen_instruction_set = instruction_set;
+    kernels = get_kernels(instruction_set);
+    return true;
+}
+
+// Most probes end on the home slot, so it's checked here, where it can be
+// inlined, and only going on past it costs a call to a kernel.
+static s64 find_slot(void** keys, s64 cap, void* key, u64 hash)
+{
+    ASSERT(can_use_bitwise_and_to_cycle(cap));
+
+    s64 probe = hash & (cap - 1);
+    if(keys[probe] == key || keys[probe] == empty)
+    {
+        return probe;
     }
+    return kernels.find_slot_from(keys, cap, key, (probe + 1) & (cap - 1));
+}
 
-    // Empty the slot, but also shuffle down any stranded pairs. There may
-    // have been pairs that slid past their natural hash position and over this
-    // slot. And any lookup for that key would hit this now-empty slot and fail
-    // to find it. So, look for any such keys and shuffle those pairs down.
-    for(int i = slot, j = slot;; i = j)
+// A block of keys is hashed all at once, by a kernel where it can be.
+static void hash_keys(Map* map, void** keys, u64* hashes, int count)
+{
+    if(map->hash_seed)
     {
-        map->keys[i] = const_cast<void*>(empty);
-        int k;
-        do
+        for(int i = 0; i < count; i += 1)
         {
-            j = (j + 1) & (map->cap - 1);
-            if(map->keys[j] == empty)
-            {
-                return;
-            }
-            k = map->hashes[j];
-        } while(in_cyclic_interval(k, i, j));
+            hashes[i] = hash_key(map, keys[i]);
+        }
+        return;
+    }
+    kernels.hash_keys(keys, hashes, count);
+}
 
-        map->keys[i] = map->keys[j];
-        map->values[i] = map->values[j];
-        map->hashes[i] = map->hashes[j];
+#if defined(MAP_COUNT_PROBES)
+// Since probing is linear, the number of slots looked at to land on a slot is
+// just its distance from the home slot plus the slot itself.
+static void count_probes(Map* map, u64 hash, s64 slot)
+{
+    s64 home = hash & (map->cap - 1);
+    map->probes += ((slot - home) & (map->cap - 1)) + 1;
+    map->probed_operations += 1;
+}
+#else
+#define count_probes(map, hash, slot)
+#endif
+
+static void mark_referenced(Map* map, s64 slot)
+{
+    if(map->cache)
+    {
+        map->cache->referenced[slot] = true;
     }
 }
 
-void map_reserve(Map* map, int cap, Heap* heap)
+// A pair's flag goes along with it whenever it's moved to another slot.
+static void move_reference(Map* map, s64 to, s64 from)
 {
-    cap = next_power_of_two(cap);
-    if(cap > map->cap)
+    if(map->cache)
     {
-        map_grow(map, cap, heap);
+        map->cache->referenced[to] = map->cache->referenced[from];
     }
 }
 
-MapIterator map_iterator_next(MapIterator it)
+static void** allocate_cell(MapPool* pool, Heap* heap)
 {
-    int index = it.index;
-    do
+    void** cell = pool->free_cells;
+    if(cell)
     {
-        index += 1;
-        if(index >= it.map->cap)
+        pool->free_cells = static_cast<void**>(*cell);
+        return cell;
+    }
+
+    if(pool->next_cell == pool->block_end)
+    {
+        ASSERT(pool->blocks_count < pool_blocks_cap);
+        s64 cells = pool->cells_count;
+        if(cells == 0)
         {
-            if(index == it.map->cap &&
-                it.map->keys[it.map->cap] != overflow_empty)
-            {
-                return {it.map, it.map->cap};
-            }
-            return {it.map, end_index};
+            cells = pool_first_block_cells;
         }
-    } while(it.map->keys[index] == empty);
+        void** block = HEAP_ALLOCATE(heap, void*, cells);
+        pool->blocks[pool->blocks_count] = block;
+        pool->blocks_count += 1;
+        pool->cells_count += cells;
+        pool->next_cell = block;
+        pool->block_end = block + cells;
+    }
+    cell = pool->next_cell;
+    pool->next_cell += 1;
+    return cell;
+}
 
-    return {it.map, index};
+static void free_cell(MapPool* pool, void** cell)
+{
+    *cell = pool->free_cells;
+    pool->free_cells = cell;
 }
 
-MapIterator map_iterator_start(Map* map)
+// This is where the value of the pair in a slot is kept, which is the slot
+// itself unless the map keeps its values in place.
+static void** get_value_address(Map* map, s64 slot)
 {
-    if(map->count > 0)
+    if(map->pool)
     {
-        return {map, 0};
-    }
-    else
-    {
-        return {map, end_index};
+        return static_cast<void**>(map->values[slot]);
     }
+    return &map->values[slot];
 }
 
-bool map_iterator_is_not_end(MapIterator it)
+// A pair that's just been put in a slot starts out with a null value.
+static void set_up_value(Map* map, s64 slot, Heap* heap)
 {
-    return it.index != end_index;
+    void* value = nullptr;
+    if(map->pool)
+    {
+        void** cell = allocate_cell(map->pool, heap);
+        *cell = nullptr;
+        value = cell;
+    }
+    map->values[slot] = value;
 }
 
-void* map_iterator_get_key(MapIterator it)
+// This has to be called before a pair's removed from its slot, to give back
+// the cell its value was kept in.
+static void release_value(Map* map, s64 slot)
 {
-    ASSERT(it.index >= 0 && it.index <= it.map->cap);
-    return it.map->keys[it.index];
+    if(map->pool)
+    {
+        free_cell(map->pool, static_cast<void**>(map->values[slot]));
+    }
 }
 
-void* map_iterator_get_value(MapIterator it)
+static bool get_from_table(Map* map, void* key, void** value)
 {
-    ASSERT(it.index >= 0 && it.index <= it.map->cap);
-    return it.map->values[it.index];
+    if(key == empty)
+    {
+        s64 overflow_index = map->cap;
+        if(map->keys[overflow_index] == overflow_empty)
+        {
+            return false;
+        }
+        else
+        {
+            *value = *get_value_address(map, overflow_index);
+            mark_referenced(map, overflow_index);
+            return true;
+        }
+    }
+
+    u64 hash = hash_key(map, key);
+    s64 slot = find_slot(map->keys, map->cap, key, hash);
+    count_probes(map, hash, slot);
+
+    bool got = map->keys[slot] == key;
+    if(got)
+    {
+        *value = *get_value_address(map, slot);
+        mark_referenced(map, slot);
+    }
+    return got;
+}
+
+// This looks through the writes logged since a background grow started
+// before the table itself, which still has the pairs from before then.
+static bool get_while_growing(Map* map, void* key, void** value)
+{
+    MapGrowth* growth = map->growth;
+    if(map_get(&growth->added, key, value))
+    {
+        return true;
+    }
+    void* discard;
+    if(map_get(&growth->removed, key, &discard))
+    {
+        return false;
+    }
+    return get_from_table(map, key, value);
+}
+
+bool map_get(Map* map, void* key, void** value)
+{
+    if(is_small(map))
+    {
+        int slot = find_small_slot(map, key);
+        if(slot == not_found)
+        {
+            return false;
+        }
+        *value = map->small_values[slot];
+        return true;
+    }
+    else if(is_growing(map))
+    {
+        return get_while_growing(map, key, value);
+    }
+    return get_from_table(map, key, value);
+}
+
+// This puts every pair of the prior table into a new, bigger one. It goes by
+// the hashes stored with them, so no key has to be hashed again, unless the
+// new table is too big for the stored hashes to place keys in. Then neither
+// table has any hashes stored, and both arrays are null.
+static void rehash(void** keys, void** values, u32* hashes, s64 cap,
+    void** prior_keys, void** prior_values, u32* prior_hashes, s64 prior_cap,
+    u64 hash_seed)
+{
+    for(s64 i = 0; i < prior_cap; i += 1)
+    {
+        void* key = prior_keys[i];
+        if(key == empty)
+        {
+            continue;
+        }
+        u64 hash;
+        if(stores_hashes(cap))
+        {
+            hash = prior_hashes[i];
+        }
+        else
+        {
+            hash = hash_with_seed(reinterpret_cast<u64>(key), hash_seed);
+        }
+        s64 slot = find_slot(keys, cap, key, hash);
+        keys[slot] = key;
+        if(stores_hashes(cap))
+        {
+            hashes[slot] = static_cast<u32>(hash);
+        }
+        values[slot] = prior_values[i];
+    }
+    // Copy over the overflow pair.
+    keys[cap] = prior_keys[prior_cap];
+    values[cap] = prior_values[prior_cap];
+}
+
+// This moves the pairs to a new table of the given cap by their stored
+// hashes.
+static void rebuild_table(Map* map, s64 cap, Heap* heap)
+{
+    // The old table is about to be freed, so any snapshots sharing it need
+    // their own copies first. Rebuilding touches every pair anyway, so this
+    // costs no more than the rebuild itself.
+    detach_snapshots(map, heap);
+
+    void** keys = HEAP_ALLOCATE(heap, void*, cap + 1);
+    void** values = HEAP_ALLOCATE(heap, void*, cap + 1);
+    u32* hashes = allocate_hashes(cap, heap);
+    rehash(keys, values, hashes, cap, map->keys, map->values, map->hashes,
+        map->cap, map->hash_seed);
+
+    HEAP_DEALLOCATE(heap, map->keys);
+    HEAP_DEALLOCATE(heap, map->values);
+    HEAP_DEALLOCATE(heap, map->hashes);
+    map->keys = keys;
+    map->values = values;
+    map->hashes = hashes;
+    map->cap = cap;
+    map->window_distance = 0;
+    map->window_adds = 0;
+
+    if(map->cache)
+    {
+        reset_references(map, heap);
+    }
+}
+
+static void map_grow(Map* map, s64 cap, Heap* heap)
+{
+    rebuild_table(map, cap, heap);
+    map->grows += 1;
+}
+
+// No two maps, nor two reseeds of the same map, should end up with the same
+// seed, so it's mixed from the time, the map's address, and a count of all
+// the seeds picked so far.
+static u64 pick_seed(Map* map)
+{
+    static std::atomic<u64> seeds_picked(0);
+    u64 time = std::chrono::steady_clock::now().time_since_epoch().count();
+    u64 address = reinterpret_cast<upointer>(map);
+    u64 picked = seeds_picked.fetch_add(1, std::memory_order_relaxed);
+    u64 seed = mix_bits(time ^ mix_bits(address ^ mix_bits(picked)));
+    return seed | 1;
+}
+
+// This switches the map to a new seeded hash, and rebuilds its table at the
+// same cap under it.
+static void reseed(Map* map, Heap* heap)
+{
+    // Snapshots sharing the table also share its hashes, so they need their
+    // own copies before the hashes change.
+    detach_snapshots(map, heap);
+
+    map->hash_seed = pick_seed(map);
+    if(stores_hashes(map->cap))
+    {
+        for(s64 i = 0; i < map->cap; i += 1)
+        {
+            void* key = map->keys[i];
+            if(key != empty)
+            {
+                map->hashes[i] = static_cast<u32>(hash_key(map, key));
+            }
+        }
+    }
+    rebuild_table(map, map->cap, heap);
+}
+
+// Adds keep a tally of how far their slots are from home. When a window's
+// worth of adds are much further on average than a good hash would put them,
+// the keys are clustering, whether by some pattern in them or by someone
+// picking keys to collide on purpose. Either way, a seeded hash breaks the
+// clusters up. This says whether it reseeded, which moves every pair.
+static bool watch_probes(Map* map, u64 hash, s64 slot, Heap* heap)
+{
+    s64 mask = map->cap - 1;
+    map->window_distance += (slot - (hash & mask)) & mask;
+    map->window_adds += 1;
+    if(map->window_adds < probe_window_adds)
+    {
+        return false;
+    }
+
+    u64 limit = static_cast<u64>(probe_window_adds) * probe_distance_limit;
+    bool clustering = map->window_distance > limit;
+    map->window_distance = 0;
+    map->window_adds = 0;
+    if(clustering)
+    {
+        reseed(map, heap);
+    }
+    return clustering;
+}
+
+static void add_to_table(Map* map, void* key, void* value)
+{
+    if(key == empty)
+    {
+        s64 overflow_index = map->cap;
+        map->keys[overflow_index] = key;
+        map->values[overflow_index] = value;
+        return;
+    }
+    u64 hash = hash_key(map, key);
+    s64 slot = find_slot(map->keys, map->cap, key, hash);
+    map->keys[slot] = key;
+    map->values[slot] = value;
+    store_hash(map, slot, hash);
+}
+
+// Moves a small map's pairs out to a table on the heap. Its count stays the
+// same, since the pairs are only moved.
+static void move_to_table(Map* map, s64 cap, Heap* heap)
+{
+    ASSERT(is_small(map));
+    ASSERT(can_use_bitwise_and_to_cycle(cap));
+
+    map->keys = HEAP_ALLOCATE(heap, void*, cap + 1);
+    map->values = HEAP_ALLOCATE(heap, void*, cap + 1);
+    map->hashes = allocate_hashes(cap, heap);
+    map->cap = cap;
+
+    s64 overflow_index = cap;
+    map->keys[overflow_index] = const_cast<void*>(overflow_empty);
+    map->values[overflow_index] = nullptr;
+
+    for(int i = 0; i < map->count; i += 1)
+    {
+        add_to_table(map, map->small_keys[i], map->small_values[i]);
+    }
+    map->grows += 1;
+}
+
+static bool make_room(Map* map);
+
+// This finds where a key's value is kept, adding the key first if it isn't
+// there yet. A key that's added starts out with a null value.
+static void** add_key(Map* map, void* key, Heap* heap)
+{
+    if(is_small(map))
+    {
+        int slot = find_small_slot(map, key);
+        if(slot != not_found)
+        {
+            return &map->small_values[slot];
+        }
+        if(map->count < map_small_cap)
+        {
+            slot = map->count;
+            map->small_keys[slot] = key;
+            map->small_values[slot] = nullptr;
+            map->count += 1;
+            return &map->small_values[slot];
+        }
+        move_to_table(map, first_table_cap, heap);
+    }
+    else if(is_growing(map))
+    {
+        return add_key_while_growing(map, key, heap);
+    }
+
+    if(key == empty)
+    {
+        s64 overflow_index = map->cap;
+        map_prepare_to_write(map, overflow_index);
+        if(map->keys[overflow_index] == overflow_empty)
+        {
+            make_room(map);
+            map->keys[overflow_index] = key;
+            set_up_value(map, overflow_index, heap);
+            map->count += 1;
+        }
+        mark_referenced(map, overflow_index);
+        return get_value_address(map, overflow_index);
+    }
+
+    if(should_start_growing(map))
+    {
+        start_growing(map);
+        return add_key_while_growing(map, key, heap);
+    }
+
+    s64 load_limit = (3 * map->cap) / 4;
+    if(map->count >= load_limit)
+    {
+        map_grow(map, 2 * map->cap, heap);
+    }
+
+    u64 hash = hash_key(map, key);
+    s64 slot = find_slot(map->keys, map->cap, key, hash);
+    count_probes(map, hash, slot);
+    if(watch_probes(map, hash, slot, heap))
+    {
+        hash = hash_key(map, key);
+        slot = find_slot(map->keys, map->cap, key, hash);
+    }
+    if(map->keys[slot] == empty && make_room(map))
+    {
+        slot = find_slot(map->keys, map->cap, key, hash);
+    }
+    map_prepare_to_write(map, slot);
+    if(map->keys[slot] == empty)
+    {
+        map->keys[slot] = key;
+        set_up_value(map, slot, heap);
+        store_hash(map, slot, hash);
+        map->count += 1;
+    }
+    mark_referenced(map, slot);
+    return get_value_address(map, slot);
+}
+
+void map_add(Map* map, void* key, void* value, Heap* heap)
+{
+    *add_key(map, key, heap) = value;
+}
+
+spointer map_add_to(Map* map, void* key, spointer delta, Heap* heap)
+{
+    void** value = add_key(map, key, heap);
+    spointer sum = reinterpret_cast<spointer>(*value) + delta;
+    *value = reinterpret_cast<void*>(sum);
+    return sum;
+}
+
+static bool in_cyclic_interval(s64 x, s64 first, s64 second)
+{
+    if(second > first)
+    {
+        return x > first && x <= second;
+    }
+    else
+    {
+        return x > first || x <= second;
+    }
+}
+
+// Empty the slot, but also shuffle down any stranded pairs. There may have
+// been pairs that slid past their natural hash position and over this slot.
+// And any lookup for that key would hit this now-empty slot and fail to find
+// it. So, look for any such keys and shuffle those pairs down.
+static void remove_slot(Map* map, s64 slot)
+{
+    release_value(map, slot);
+    for(s64 i = slot, j = slot;; i = j)
+    {
+        map_prepare_to_write(map, i);
+        map->keys[i] = const_cast<void*>(empty);
+        s64 k;
+        do
+        {
+            j = (j + 1) & (map->cap - 1);
+            if(map->keys[j] == empty)
+            {
+                return;
+            }
+            k = get_stored_hash(map, j) & (map->cap - 1);
+        } while(in_cyclic_interval(k, i, j));
+
+        map->keys[i] = map->keys[j];
+        map->values[i] = map->values[j];
+        move_stored_hash(map, i, j);
+        move_reference(map, i, j);
+    }
+}
+
+// This leaves the count for the caller to change, and says whether the key
+// was there to remove.
+static bool remove_from_table(Map* map, void* key)
+{
+    ASSERT(can_use_bitwise_and_to_cycle(map->cap));
+
+    if(key == empty)
+    {
+        s64 overflow_index = map->cap;
+        if(map->keys[overflow_index] != key)
+        {
+            return false;
+        }
+        map_prepare_to_write(map, overflow_index);
+        release_value(map, overflow_index);
+        map->keys[overflow_index] = const_cast<void*>(overflow_empty);
+        map->values[overflow_index] = nullptr;
+        return true;
+    }
+
+    u64 hash = hash_key(map, key);
+    s64 slot = find_slot(map->keys, map->cap, key, hash);
+    count_probes(map, hash, slot);
+    if(map->keys[slot] == empty)
+    {
+        return false;
+    }
+    remove_slot(map, slot);
+    return true;
+}
+
+void map_remove(Map* map, void* key)
+{
+    if(is_small(map))
+    {
+        // Fill the gap with the last pair, so the pairs stay packed together.
+        int slot = find_small_slot(map, key);
+        if(slot != not_found)
+        {
+            s64 last = map->count - 1;
+            map->small_keys[slot] = map->small_keys[last];
+            map->small_values[slot] = map->small_values[last];
+            map->count -= 1;
+        }
+        return;
+    }
+    else if(is_growing(map))
+    {
+        remove_while_growing(map, key);
+        return;
+    }
+
+    if(remove_from_table(map, key))
+    {
+        map->count -= 1;
+    }
+}
+
+static int count_bits(u64 x)
+{
+    int bits = 0;
+    for(; x; x >>= 1)
+    {
+        bits += 1;
+    }
+    return bits;
+}
+
+// This sorts on the bits from first_bit up to last_bit. It's a radix sort,
+// since sorting slots with comparisons mispredicts a branch at almost every
+// step.
+template<typename T>
+static void radix_sort(T* values, int count, int first_bit, int last_bit)
+{
+    const int mask = (1 << slot_radix_bits) - 1;
+    T sorted[batch_block];
+    int counts[1 << slot_radix_bits];
+    T* from = values;
+    T* to = sorted;
+    for(int shift = first_bit; shift < last_bit; shift += slot_radix_bits)
+    {
+        memset(counts, 0, sizeof counts);
+        for(int i = 0; i < count; i += 1)
+        {
+            counts[(from[i] >> shift) & mask] += 1;
+        }
+        int total = 0;
+        for(int i = 0; i <= mask; i += 1)
+        {
+            int digit_count = counts[i];
+            counts[i] = total;
+            total += digit_count;
+        }
+        for(int i = 0; i < count; i += 1)
+        {
+            int digit = (from[i] >> shift) & mask;
+            to[counts[digit]] = from[i];
+            counts[digit] += 1;
+        }
+        T* swap = from;
+        from = to;
+        to = swap;
+    }
+    if(from != values)
+    {
+        memcpy(values, from, sizeof(T) * count);
+    }
+}
+
+// There are never more holes than slots being removed, so when the end of the
+// array's reached, there's always room to be made at the front.
+static void push_hole(s64* holes, int* first_hole, int* holes_count, s64 hole)
+{
+    if(*holes_count == batch_block)
+    {
+        *holes_count -= *first_hole;
+        memmove(holes, &holes[*first_hole], sizeof(s64) * *holes_count);
+        *first_hole = 0;
+    }
+    holes[*holes_count] = hole;
+    *holes_count += 1;
+}
+
+// Empties the given slots, which have to be sorted, and moves back any pairs
+// that probed past them. Each cluster holding any of the slots is walked only
+// once, however many of them it holds. Along the way, each pair moves to the
+// first hole it could have probed to from its home, and leaves a hole of its
+// own behind.
+static void remove_slots(Map* map, s64* slots, int count)
+{
+    s64 holes[batch_block];
+    s64 mask = map->cap - 1;
+    for(int i = 0; i < count;)
+    {
+        int first_hole = 0;
+        int holes_count = 0;
+        for(s64 j = slots[i];; j = (j + 1) & mask)
+        {
+            if(i < count && slots[i] == j)
+            {
+                if(i + batch_prefetch < count)
+                {
+                    s64 ahead = slots[i + batch_prefetch];
+                    PREFETCH(&map->keys[ahead]);
+                    if(stores_hashes(map->cap))
+                    {
+                        PREFETCH(&map->hashes[ahead]);
+                    }
+                    PREFETCH(&map->values[ahead]);
+                }
+                map_prepare_to_write(map, j);
+                release_value(map, j);
+                map->keys[j] = const_cast<void*>(empty);
+                push_hole(holes, &first_hole, &holes_count, j);
+                i += 1;
+                continue;
+            }
+            if(map->keys[j] == empty)
+            {
+                break;
+            }
+
+            s64 home = get_stored_hash(map, j) & mask;
+            for(int h = first_hole; h < holes_count; h += 1)
+            {
+                s64 hole = holes[h];
+                if(in_cyclic_interval(home, hole, j))
+                {
+                    continue;
+                }
+
+                map_prepare_to_write(map, hole);
+                map_prepare_to_write(map, j);
+                map->keys[hole] = map->keys[j];
+                map->values[hole] = map->values[j];
+                move_stored_hash(map, hole, j);
+                move_reference(map, hole, j);
+                map->keys[j] = const_cast<void*>(empty);
+
+                if(h == first_hole)
+                {
+                    first_hole += 1;
+                }
+                else
+                {
+                    int after = holes_count - h - 1;
+                    memmove(&holes[h], &holes[h + 1], sizeof(s64) * after);
+                    holes_count -= 1;
+                }
+                push_hole(holes, &first_hole, &holes_count, j);
+                break;
+            }
+        }
+    }
+}
+
+void map_remove_batch(Map* map, void** keys, int count)
+{
+    if(is_small(map) || is_growing(map))
+    {
+        for(int i = 0; i < count; i += 1)
+        {
+            map_remove(map, keys[i]);
+        }
+        return;
+    }
+
+    u64 hashes[batch_block];
+    s64 slots[batch_block];
+
+    for(int first = 0; first < count; first += batch_block)
+    {
+        int block = std::min(count - first, batch_block);
+        void** block_keys = &keys[first];
+
+        hash_keys(map, block_keys, hashes, block);
+
+        // Prefetching the home slots of keys a little further along keeps
+        // several of the loads in flight at once, rather than waiting on each
+        // in turn.
+        s64 mask = map->cap - 1;
+        for(int i = 0; i < block && i < batch_prefetch; i += 1)
+        {
+            PREFETCH(&map->keys[hashes[i] & mask]);
+        }
+
+        int found = 0;
+        for(int i = 0; i < block; i += 1)
+        {
+            if(i + batch_prefetch < block)
+            {
+                s64 ahead = hashes[i + batch_prefetch] & mask;
+                PREFETCH(&map->keys[ahead]);
+                if(stores_hashes(map->cap))
+                {
+                    PREFETCH(&map->hashes[ahead]);
+                }
+            }
+
+            void* key = block_keys[i];
+            if(key == empty)
+            {
+                if(remove_from_table(map, key))
+                {
+                    map->count -= 1;
+                }
+                continue;
+            }
+            s64 slot = find_slot(map->keys, map->cap, key, hashes[i]);
+            count_probes(map, hashes[i], slot);
+            if(map->keys[slot] != empty)
+            {
+                slots[found] = slot;
+                found += 1;
+            }
+        }
+
+        // The same key can be in the batch more than once.
+        radix_sort(slots, found, 0, count_bits(map->cap - 1));
+        found = static_cast<int>(std::unique(slots, slots + found) - slots);
+
+        remove_slots(map, slots, found);
+        map->count -= found;
+    }
+}
+
+// A fresh table starts every pair off unreferenced, as if the hand had just
+// swept past all of them.
+static void reset_references(Map* map, Heap* heap)
+{
+    MapCache* cache = map->cache;
+    SAFE_HEAP_DEALLOCATE(heap, cache->referenced);
+    cache->referenced = HEAP_ALLOCATE(heap, bool, map->cap + 1);
+    memset(cache->referenced, 0, sizeof(bool) * (map->cap + 1));
+    cache->hand = 0;
+}
+
+// The hand goes around the slots, the overflow slot last, and gives each pair
+// that's been used since it last came by a second chance. The first one it
+// finds that hasn't is evicted.
+static void evict(Map* map)
+{
+    MapCache* cache = map->cache;
+    s64 overflow_index = map->cap;
+    for(;;)
+    {
+        s64 slot = cache->hand;
+        cache->hand = (slot == overflow_index) ? 0 : slot + 1;
+
+        void* key = map->keys[slot];
+        if(slot == overflow_index ? key == overflow_empty : key == empty)
+        {
+            continue;
+        }
+        if(cache->referenced[slot])
+        {
+            cache->referenced[slot] = false;
+            continue;
+        }
+
+        void* value = *get_value_address(map, slot);
+        if(slot == overflow_index)
+        {
+            remove_from_table(map, key);
+        }
+        else
+        {
+            // The removal may shift a pair the hand hasn't reached yet back
+            // into this slot, so the hand has to look at it again.
+            remove_slot(map, slot);
+            cache->hand = slot;
+        }
+        map->count -= 1;
+
+        if(cache->evict)
+        {
+            cache->evict(key, value, cache->user_data);
+        }
+        return;
+    }
+}
+
+// This says whether a pair had to be evicted to make room for a new one, in
+// which case the other pairs may have moved.
+static bool make_room(Map* map)
+{
+    if(!map->cache || map->count < map->cache->limit)
+    {
+        return false;
+    }
+    evict(map);
+    return true;
+}
+
+void map_set_bound(Map* map, s64 limit, MapEvict evict_pair, void* user_data,
+    Heap* heap)
+{
+    ASSERT(limit > 0);
+    ASSERT(!map->growth);
+
+    // The table's made big enough up front that the map never has to grow.
+    s64 cap = next_power_of_two((4 * limit) / 3);
+    if(cap < first_table_cap)
+    {
+        cap = first_table_cap;
+    }
+    if(is_small(map))
+    {
+        move_to_table(map, cap, heap);
+    }
+    else if(cap > map->cap)
+    {
+        map_grow(map, cap, heap);
+    }
+
+    if(!map->cache)
+    {
+        map->cache = HEAP_ALLOCATE(heap, MapCache, 1);
+        map->cache->referenced = nullptr;
+        reset_references(map, heap);
+    }
+    MapCache* cache = map->cache;
+    cache->evict = evict_pair;
+    cache->user_data = user_data;
+    cache->limit = limit;
+
+    while(map->count > limit)
+    {
+        evict(map);
+    }
+}
+
+// The pairs already in the table have their values moved out to cells of the
+// new pool.
+void map_keep_values_in_place(Map* map, Heap* heap)
+{
+    ASSERT(!map->growth);
+    ASSERT(!map->snapshots);
+
+    if(map->pool)
+    {
+        return;
+    }
+    if(is_small(map))
+    {
+        move_to_table(map, first_table_cap, heap);
+    }
+
+    MapPool* pool = HEAP_ALLOCATE(heap, MapPool, 1);
+    *pool = {};
+    s64 overflow_index = map->cap;
+    for(s64 i = 0; i <= overflow_index; i += 1)
+    {
+        void* key = map->keys[i];
+        if(i == overflow_index ? key == overflow_empty : key == empty)
+        {
+            continue;
+        }
+        void** cell = allocate_cell(pool, heap);
+        *cell = map->values[i];
+        map->values[i] = cell;
+    }
+    map->pool = pool;
+}
+
+// This is the same as getting from the table, but gives where the value is
+// kept rather than the value.
+static void** find_in_table(Map* map, void* key)
+{
+    if(key == empty)
+    {
+        s64 overflow_index = map->cap;
+        if(map->keys[overflow_index] == overflow_empty)
+        {
+            return nullptr;
+        }
+        mark_referenced(map, overflow_index);
+        return get_value_address(map, overflow_index);
+    }
+
+    u64 hash = hash_key(map, key);
+    s64 slot = find_slot(map->keys, map->cap, key, hash);
+    count_probes(map, hash, slot);
+
+    if(map->keys[slot] != key)
+    {
+        return nullptr;
+    }
+    mark_referenced(map, slot);
+    return get_value_address(map, slot);
+}
+
+// Since the caller may write through the address, the slot's chunk is copied
+// out to any snapshots still sharing it first.
+void** map_get_reference(Map* map, void* key)
+{
+    if(is_small(map))
+    {
+        int slot = find_small_slot(map, key);
+        if(slot == not_found)
+        {
+            return nullptr;
+        }
+        return &map->small_values[slot];
+    }
+
+    wait_for_growing(map);
+    void** address = find_in_table(map, key);
+    if(address && !map->pool)
+    {
+        map_prepare_to_write(map, address - map->values);
+    }
+    return address;
+}
+
+void** map_add_reference(Map* map, void* key, Heap* heap)
+{
+    return add_key(map, key, heap);
+}
+
+// Within each block, the keys are sorted by their home slots, which makes the
+// probes go through the table in order. Repeats of a key that end up next to
+// each other are added up and probed for once. Other keys sharing the home
+// slot can come between them, though, and then each repeat is probed for on
+// its own, though its slot is likely still in the cache.
+void map_add_to_batch(Map* map, void** keys, spointer* deltas, int count,
+    Heap* heap)
+{
+    u64 hashes[batch_block];
+    u64 order[batch_block];
+    const u64 index_mask = (1 << batch_index_bits) - 1;
+
+    for(int first = 0; first < count; first += batch_block)
+    {
+        int block = std::min(count - first, batch_block);
+        void** block_keys = &keys[first];
+        spointer* block_deltas = deltas ? &deltas[first] : nullptr;
+
+        if(is_small(map) || map->growth || map->cache)
+        {
+            for(int i = 0; i < block; i += 1)
+            {
+                spointer delta = block_deltas ? block_deltas[i] : 1;
+                map_add_to(map, block_keys[i], delta, heap);
+            }
+            continue;
+        }
+
+        // Make room for every key in the block, so that the table can't grow
+        // partway through it.
+        map_reserve(map, (4 * (map->count + block)) / 3 + 1, heap);
+
+        s64 mask = map->cap - 1;
+        int ordered = 0;
+        hash_keys(map, block_keys, hashes, block);
+        for(int i = 0; i < block; i += 1)
+        {
+            void* key = block_keys[i];
+            if(key == empty)
+            {
+                spointer delta = block_deltas ? block_deltas[i] : 1;
+                map_add_to(map, key, delta, heap);
+                continue;
+            }
+            order[ordered] = ((hashes[i] & mask) << batch_index_bits) | i;
+            ordered += 1;
+        }
+        radix_sort(order, ordered, batch_index_bits,
+            batch_index_bits + count_bits(mask));
+
+        for(int j = 0; j < ordered; j += 1)
+        {
+            if(j + batch_prefetch < ordered)
+            {
+                u64 ahead = order[j + batch_prefetch] >> batch_index_bits;
+                PREFETCH(&map->keys[ahead]);
+            }
+
+            int i = static_cast<int>(order[j] & index_mask);
+            void* key = block_keys[i];
+            spointer delta = block_deltas ? block_deltas[i] : 1;
+            while(j + 1 < ordered)
+            {
+                int next = static_cast<int>(order[j + 1] & index_mask);
+                if(block_keys[next] != key)
+                {
+                    break;
+                }
+                delta += block_deltas ? block_deltas[next] : 1;
+                j += 1;
+            }
+
+            u64 hash = hashes[i];
+            s64 slot = find_slot(map->keys, map->cap, key, hash);
+            count_probes(map, hash, slot);
+            map_prepare_to_write(map, slot);
+            if(map->keys[slot] == empty)
+            {
+                map->keys[slot] = key;
+                set_up_value(map, slot, heap);
+                store_hash(map, slot, hash);
+                map->count += 1;
+            }
+            void** value = get_value_address(map, slot);
+            spointer sum = reinterpret_cast<spointer>(*value);
+            *value = reinterpret_cast<void*>(sum + delta);
+        }
+    }
+}
+
+void map_grow_in_background(Map* map, float start_load, Heap* heap)
+{
+    ASSERT(start_load > 0.0f && start_load < 0.75f);
+    ASSERT(!map->cache);
+    ASSERT(!map->pool);
+
+    if(!map->growth)
+    {
+        MapGrowth* growth = HEAP_ALLOCATE(heap, MapGrowth, 1);
+        new(growth) MapGrowth();
+        growth->heap = heap;
+        map_create(&growth->added, heap);
+        map_create(&growth->removed, heap);
+        map->growth = growth;
+    }
+    map->growth->start_load = start_load;
+}
+
+static bool is_growing(Map* map)
+{
+    MapGrowth* growth = map->growth;
+    if(!growth || !growth->building)
+    {
+        return false;
+    }
+    if(growth->built.load(std::memory_order_acquire))
+    {
+        finish_growing(map);
+        return false;
+    }
+    return true;
+}
+
+static bool should_start_growing(Map* map)
+{
+    MapGrowth* growth = map->growth;
+    if(!growth || map->cap < background_growth_min_cap)
+    {
+        return false;
+    }
+    s64 start_limit = static_cast<s64>(growth->start_load * map->cap);
+    return map->count >= start_limit;
+}
+
+static void start_growing(Map* map)
+{
+    MapGrowth* growth = map->growth;
+    Heap* heap = growth->heap;
+
+    s64 cap = 2 * map->cap;
+    growth->keys = HEAP_ALLOCATE(heap, void*, cap + 1);
+    growth->values = HEAP_ALLOCATE(heap, void*, cap + 1);
+    growth->hashes = allocate_hashes(cap, heap);
+    growth->cap = cap;
+
+    // Whatever's logged lands in the new table on top of what's there now.
+    // Keeping the log under half the old cap means that can't go past the
+    // new table's load limit.
+    growth->log_cap = map->cap / 2;
+    if(growth->log_cap > growth_log_cap)
+    {
+        growth->log_cap = growth_log_cap;
+    }
+
+    growth->built.store(false, std::memory_order_relaxed);
+    growth->building = true;
+
+    void** keys = map->keys;
+    void** values = map->values;
+    u32* hashes = map->hashes;
+    s64 prior_cap = map->cap;
+    u64 hash_seed = map->hash_seed;
+    growth->thread = std::thread([=]()
+    {
+        rehash(growth->keys, growth->values, growth->hashes, growth->cap,
+            keys, values, hashes, prior_cap, hash_seed);
+        growth->built.store(true, std::memory_order_release);
+    });
+}
+
+// This swaps in the new table once the helper thread's done with it, and
+// then brings it up to date with the writes logged in the meantime.
+static void finish_growing(Map* map)
+{
+    MapGrowth* growth = map->growth;
+    Heap* heap = growth->heap;
+
+    growth->thread.join();
+    growth->building = false;
+
+    detach_snapshots(map, heap);
+    HEAP_DEALLOCATE(heap, map->keys);
+    HEAP_DEALLOCATE(heap, map->values);
+    HEAP_DEALLOCATE(heap, map->hashes);
+    map->keys = growth->keys;
+    map->values = growth->values;
+    map->hashes = growth->hashes;
+    map->cap = growth->cap;
+    map->grows += 1;
+    growth->keys = nullptr;
+    growth->values = nullptr;
+    growth->hashes = nullptr;
+
+    // The count already took the logged writes into account.
+    ITERATE_MAP(it, &growth->removed)
+    {
+        remove_from_table(map, map_iterator_get_key(it));
+    }
+    ITERATE_MAP(it, &growth->added)
+    {
+        add_to_table(map, map_iterator_get_key(it),
+            map_iterator_get_value(it));
+    }
+    map_destroy(&growth->added, heap);
+    map_destroy(&growth->removed, heap);
+}
+
+static void wait_for_growing(Map* map)
+{
+    if(map->growth && map->growth->building)
+    {
+        finish_growing(map);
+    }
+}
+
+// The log is checked before adding to it rather than after, since finishing
+// the grow would leave the value pointer given back dangling.
+static void** add_key_while_growing(Map* map, void* key, Heap* heap)
+{
+    MapGrowth* growth = map->growth;
+    if(growth->added.count + growth->removed.count >= growth->log_cap)
+    {
+        finish_growing(map);
+        return add_key(map, key, heap);
+    }
+
+    void* value;
+    if(!get_while_growing(map, key, &value))
+    {
+        value = nullptr;
+        map->count += 1;
+    }
+    map_remove(&growth->removed, key);
+    void** logged = add_key(&growth->added, key, growth->heap);
+    *logged = value;
+    return logged;
+}
+
+static void remove_while_growing(Map* map, void* key)
+{
+    MapGrowth* growth = map->growth;
+    void* discard;
+    if(!get_while_growing(map, key, &discard))
+    {
+        return;
+    }
+    map->count -= 1;
+    map_remove(&growth->added, key);
+    if(get_from_table(map, key, &discard))
+    {
+        map_add(&growth->removed, key, nullptr, growth->heap);
+    }
+    if(growth->added.count + growth->removed.count >= growth->log_cap)
+    {
+        finish_growing(map);
+    }
+}
+
+void map_reserve(Map* map, s64 cap, Heap* heap)
+{
+    if(is_small(map))
+    {
+        if(cap <= map_small_cap)
+        {
+            return;
+        }
+        cap = next_power_of_two(cap);
+        if(cap < first_table_cap)
+        {
+            cap = first_table_cap;
+        }
+        move_to_table(map, cap, heap);
+        return;
+    }
+
+    wait_for_growing(map);
+    cap = next_power_of_two(cap);
+    if(cap > map->cap)
+    {
+        map_grow(map, cap, heap);
+    }
+}
+
+// A small map is scanned from the front, so a key's probe length is just its
+// place in line, and a miss has to look at every pair.
+static void get_small_stats(Map* map, MapStats* stats)
+{
+    stats->load_factor = static_cast<float>(map->count) / map_small_cap;
+    stats->longest_cluster = map->count;
+    stats->longest_probe_length = map->count;
+    stats->expected_miss_probe_length = map->count;
+    for(int i = 0; i < map->count; i += 1)
+    {
+        int bucket = i;
+        if(bucket >= map_probe_lengths_cap)
+        {
+            bucket = map_probe_lengths_cap - 1;
+        }
+        stats->probe_lengths[bucket] += 1;
+    }
+    if(map->count > 0)
+    {
+        stats->mean_hit_probe_length = (map->count + 1) / 2.0f;
+    }
+}
+
+void map_get_stats(Map* map, MapStats* stats)
+{
+    *stats = {};
+
+    wait_for_growing(map);
+    stats->grows = map->grows;
+    if(is_small(map))
+    {
+        get_small_stats(map, stats);
+        return;
+    }
+
+    s64 cap = map->cap;
+    stats->load_factor = static_cast<float>(map->count) / cap;
+    stats->bytes_allocated = 2 * sizeof(void*) * (cap + 1);
+    if(stores_hashes(cap))
+    {
+        stats->bytes_allocated += sizeof(u32) * cap;
+    }
+    if(map->cache)
+    {
+        stats->bytes_allocated += sizeof(bool) * (cap + 1);
+    }
+    if(map->pool)
+    {
+        stats->bytes_allocated += sizeof(void*) * map->pool->cells_count;
+    }
+
+    // Start the walk just past an empty slot, so that no cluster is split in
+    // two where it wraps around the end of the slots.
+    s64 start = 0;
+    for(s64 i = 0; i < cap; i += 1)
+    {
+        if(map->keys[i] == empty)
+        {
+            start = (i + 1) & (cap - 1);
+            break;
+        }
+    }
+
+    u64 hit_probes = 0;
+    u64 miss_probes = 0;
+    s64 hits = 0;
+    s64 cluster = 0;
+
+    for(s64 i = 0; i < cap; i += 1)
+    {
+        s64 slot = (start + i) & (cap - 1);
+        if(map->keys[slot] == empty)
+        {
+            // A miss whose home is the nth slot from the end of a cluster
+            // looks at n slots plus this empty one that stops it.
+            u64 length = cluster;
+            miss_probes += ((length + 1) * (length + 2)) / 2;
+            cluster = 0;
+            continue;
+        }
+
+        s64 home = get_stored_hash(map, slot) & (cap - 1);
+        s64 probe_length = ((slot - home) & (cap - 1)) + 1;
+        s64 bucket = probe_length - 1;
+        if(bucket >= map_probe_lengths_cap)
+        {
+            bucket = map_probe_lengths_cap - 1;
+        }
+        stats->probe_lengths[bucket] += 1;
+        if(probe_length > stats->longest_probe_length)
+        {
+            stats->longest_probe_length = probe_length;
+        }
+        hit_probes += probe_length;
+        hits += 1;
+
+        cluster += 1;
+        if(cluster > stats->longest_cluster)
+        {
+            stats->longest_cluster = cluster;
+        }
+    }
+
+    if(hits > 0)
+    {
+        stats->mean_hit_probe_length = static_cast<float>(hit_probes) / hits;
+    }
+    stats->expected_miss_probe_length = static_cast<float>(miss_probes) / cap;
+
+#if defined(MAP_COUNT_PROBES)
+    if(map->probed_operations > 0)
+    {
+        stats->mean_live_probe_length =
+            static_cast<float>(map->probes) / map->probed_operations;
+    }
+#endif
+}
+
+MapIterator map_iterator_next(MapIterator it)
+{
+    Map* map = it.map;
+    if(is_small(map))
+    {
+        if(it.index + 1 < map->count)
+        {
+            return {map, it.index + 1, it.stop};
+        }
+        return {map, end_index, it.stop};
+    }
+    else if(it.index == map->cap)
+    {
+        return {map, end_index, it.stop};
+    }
+
+    // The scan goes up to the end of the table and then from the start up to
+    // the stop, or straight to the stop if it's already wrapped around.
+    s64 end = (it.stop > it.index) ? it.stop : map->cap;
+    s64 index = kernels.find_used_slot(map->keys, it.index + 1, end);
+    if(index == map->cap)
+    {
+        index = kernels.find_used_slot(map->keys, 0, it.stop);
+    }
+    if(index == it.stop)
+    {
+        if(map->keys[map->cap] != overflow_empty)
+        {
+            return {map, map->cap, it.stop};
+        }
+        return {map, end_index, it.stop};
+    }
+
+    return {map, index, it.stop};
+}
+
+// Iteration goes around the table from just past an empty slot, back to that
+// slot, and then ends on the overflow slot. No cluster crosses where it starts,
+// so removing a pair never shifts one that's already been visited into a slot
+// that's still to come.
+MapIterator map_iterator_start(Map* map)
+{
+    wait_for_growing(map);
+    if(map->count == 0)
+    {
+        return {map, end_index, 0};
+    }
+    else if(is_small(map))
+    {
+        return {map, 0, 0};
+    }
+
+    s64 stop = 0;
+    while(map->keys[stop] != empty)
+    {
+        stop += 1;
+    }
+    return map_iterator_next({map, stop, stop});
+}
+
+MapIterator map_iterator_remove(MapIterator it)
+{
+    Map* map = it.map;
+    ASSERT(map_iterator_is_not_end(it));
+
+    if(is_small(map))
+    {
+        // The last pair is swapped in to fill the gap, and still has to be
+        // visited.
+        s64 last = map->count - 1;
+        map->small_keys[it.index] = map->small_keys[last];
+        map->small_values[it.index] = map->small_values[last];
+        map->count -= 1;
+        return {map, it.index - 1, it.stop};
+    }
+    else if(it.index == map->cap)
+    {
+        remove_from_table(map, const_cast<void*>(empty));
+        map->count -= 1;
+        return it;
+    }
+
+    // Another pair may be shifted back into this slot, so step back to visit
+    // it again.
+    remove_slot(map, it.index);
+    map->count -= 1;
+    return {map, (it.index - 1) & (map->cap - 1), it.stop};
+}
+
+// This keeps only the pairs that keep returns true for, where it's given each
+// key, value, and hash. It's a template so that the callers below can have
+// their checks inlined.
+template<typename Keep>
+static void retain_pairs(Map* map, Keep keep)
+{
+    wait_for_growing(map);
+
+    if(is_small(map))
+    {
+        int kept = 0;
+        for(int i = 0; i < map->count; i += 1)
+        {
+            void* key = map->small_keys[i];
+            void* value = map->small_values[i];
+            if(keep(key, value, hash_key(map, key)))
+            {
+                map->small_keys[kept] = key;
+                map->small_values[kept] = value;
+                kept += 1;
+            }
+        }
+        map->count = kept;
+        return;
+    }
+
+    s64 overflow_index = map->cap;
+    if(map->keys[overflow_index] != overflow_empty
+        && !keep(const_cast<void*>(empty),
+            *get_value_address(map, overflow_index),
+            hash_key(map, const_cast<void*>(empty))))
+    {
+        remove_from_table(map, const_cast<void*>(empty));
+        map->count -= 1;
+    }
+
+    // Going around from just past an empty slot, every pair after a removed
+    // one in the same cluster is taken out and put back in the first empty
+    // slot from its home. So the whole table's compacted in one pass, without
+    // shifting any cluster more than once.
+    s64 mask = map->cap - 1;
+    s64 stop = 0;
+    while(map->keys[stop] != empty)
+    {
+        stop += 1;
+    }
+    bool cluster_has_holes = false;
+    for(s64 i = (stop + 1) & mask; i != stop; i = (i + 1) & mask)
+    {
+        void* key = map->keys[i];
+        if(key == empty)
+        {
+            cluster_has_holes = false;
+            continue;
+        }
+
+        u64 hash = get_stored_hash(map, i);
+        if(!keep(key, *get_value_address(map, i), hash))
+        {
+            map_prepare_to_write(map, i);
+            release_value(map, i);
+            map->keys[i] = const_cast<void*>(empty);
+            map->count -= 1;
+            cluster_has_holes = true;
+        }
+        else if(cluster_has_holes)
+        {
+            map_prepare_to_write(map, i);
+            map->keys[i] = const_cast<void*>(empty);
+            s64 slot = find_slot(map->keys, map->cap, key, hash);
+            if(slot != i)
+            {
+                map_prepare_to_write(map, slot);
+                map->values[slot] = map->values[i];
+                store_hash(map, slot, hash);
+                move_reference(map, slot, i);
+            }
+            map->keys[slot] = key;
+        }
+    }
+}
+
+void map_retain_if(Map* map, MapPredicate predicate, void* user_data)
+{
+    retain_pairs(map, [=](void* key, void* value, u64 hash)
+    {
+        return predicate(key, value, user_data);
+    });
+}
+
+// This is the same as map_get, except that the hash is already known.
+static bool get_with_hash(Map* map, void* key, u64 hash, void** value)
+{
+    if(is_small(map))
+    {
+        int slot = find_small_slot(map, key);
+        if(slot == not_found)
+        {
+            return false;
+        }
+        *value = map->small_values[slot];
+        return true;
+    }
+    else if(key == empty)
+    {
+        s64 overflow_index = map->cap;
+        if(map->keys[overflow_index] == overflow_empty)
+        {
+            return false;
+        }
+        *value = *get_value_address(map, overflow_index);
+        return true;
+    }
+
+    s64 slot = find_slot(map->keys, map->cap, key, hash);
+    if(map->keys[slot] != key)
+    {
+        return false;
+    }
+    *value = *get_value_address(map, slot);
+    return true;
+}
+
+// The destination has to be a table with room enough for the pair already,
+// and has to keep its values in the table.
+static void merge_pair(Map* map, void* key, void* value, u64 hash,
+    MapConflict conflict)
+{
+    ASSERT(!map->pool);
+
+    s64 slot;
+    bool is_new;
+    if(key == empty)
+    {
+        slot = map->cap;
+        is_new = map->keys[slot] == overflow_empty;
+    }
+    else
+    {
+        slot = find_slot(map->keys, map->cap, key, hash);
+        is_new = map->keys[slot] == empty;
+    }
+
+    if(!is_new && conflict == MapConflict::Add_Values)
+    {
+        map_prepare_to_write(map, slot);
+        spointer sum = reinterpret_cast<spointer>(map->values[slot])
+            + reinterpret_cast<spointer>(value);
+        map->values[slot] = reinterpret_cast<void*>(sum);
+    }
+    else if(is_new || conflict == MapConflict::Take_Source)
+    {
+        map_prepare_to_write(map, slot);
+        map->keys[slot] = key;
+        map->values[slot] = value;
+        if(key != empty)
+        {
+            store_hash(map, slot, hash);
+        }
+        map->count += is_new;
+    }
+}
+
+static void add_merged_pair(Map* map, void* key, void* value,
+    MapConflict conflict, Heap* heap)
+{
+    void* discard;
+    if(conflict == MapConflict::Add_Values)
+    {
+        map_add_to(map, key, reinterpret_cast<spointer>(value), heap);
+    }
+    else if(conflict == MapConflict::Take_Source
+        || !map_get(map, key, &discard))
+    {
+        map_add(map, key, value, heap);
+    }
+}
+
+void map_merge(Map* destination, Map* source, MapConflict conflict,
+    Heap* heap)
+{
+    if(destination == source)
+    {
+        return;
+    }
+    wait_for_growing(source);
+
+    // A bounded destination has to make room for each new pair in turn, and
+    // one that keeps its values in place needs a cell for each, so their
+    // pairs are added one at a time too.
+    if(is_small(source) || destination->cache || destination->pool)
+    {
+        ITERATE_MAP(it, source)
+        {
+            add_merged_pair(destination, map_iterator_get_key(it),
+                map_iterator_get_value(it), conflict, heap);
+        }
+        return;
+    }
+
+    // The merged map is at least as big as the bigger of the two, so that
+    // much is reserved up front. Reserving for the sum of the two instead
+    // would make a needless grow whenever they share a lot of keys.
+    s64 cap = destination->count;
+    if(source->count > cap)
+    {
+        cap = source->count;
+    }
+    cap = (4 * cap) / 3 + 1;
+    if(cap <= map_small_cap)
+    {
+        cap = map_small_cap + 1;
+    }
+    map_reserve(destination, cap, heap);
+
+    // Going through the source in slot order means its pairs land in the
+    // destination in a few ascending runs when their caps are close, as they
+    // are for maps of about the same size.
+    for(s64 i = 0; i < source->cap; i += 1)
+    {
+        void* key = source->keys[i];
+        if(key == empty)
+        {
+            continue;
+        }
+        s64 load_limit = (3 * destination->cap) / 4;
+        if(destination->count >= load_limit)
+        {
+            map_grow(destination, 2 * destination->cap, heap);
+        }
+        u64 stored_hash = get_stored_hash(source, i);
+        u64 hash = hash_for(destination, source, key, stored_hash);
+        merge_pair(destination, key, *get_value_address(source, i), hash,
+            conflict);
+    }
+    s64 overflow_index = source->cap;
+    if(source->keys[overflow_index] != overflow_empty)
+    {
+        merge_pair(destination, const_cast<void*>(empty),
+            *get_value_address(source, overflow_index), 0, conflict);
+    }
+}
+
+void map_intersect(Map* destination, Map* source)
+{
+    if(destination == source)
+    {
+        return;
+    }
+    wait_for_growing(source);
+    retain_pairs(destination, [=](void* key, void* value, u64 hash)
+    {
+        void* discard;
+        hash = hash_for(source, destination, key, hash);
+        return get_with_hash(source, key, hash, &discard);
+    });
+}
+
+void map_difference(Map* destination, Map* source)
+{
+    wait_for_growing(source);
+    if(destination == source)
+    {
+        retain_pairs(destination, [](void* key, void* value, u64 hash)
+        {
+            return false;
+        });
+        return;
+    }
+    retain_pairs(destination, [=](void* key, void* value, u64 hash)
+    {
+        void* discard;
+        hash = hash_for(source, destination, key, hash);
+        return !get_with_hash(source, key, hash, &discard);
+    });
+}
+
+bool map_iterator_is_not_end(MapIterator it)
+{
+    return it.index != end_index;
+}
+
+void* map_iterator_get_key(MapIterator it)
+{
+    if(is_small(it.map))
+    {
+        ASSERT(it.index >= 0 && it.index < it.map->count);
+        return it.map->small_keys[it.index];
+    }
+    ASSERT(it.index >= 0 && it.index <= it.map->cap);
+    return it.map->keys[it.index];
+}
+
+void* map_iterator_get_value(MapIterator it)
+{
+    if(is_small(it.map))
+    {
+        ASSERT(it.index >= 0 && it.index < it.map->count);
+        return it.map->small_values[it.index];
+    }
+    ASSERT(it.index >= 0 && it.index <= it.map->cap);
+    return *get_value_address(it.map, it.index);
+}
+
+static s64 count_chunks(s64 cap)
+{
+    // The overflow slot at index cap gets covered too.
+    return (cap + snapshot_chunk_slots) / snapshot_chunk_slots;
+}
+
+// Copies a chunk out of the table the snapshot shares. Only publishing the
+// copy needs the lock, since readers only ever read the shared table.
+static void copy_chunk(MapSnapshot* snapshot, s64 chunk)
+{
+    SnapshotChunk* copy = HEAP_ALLOCATE(snapshot->heap, SnapshotChunk, 1);
+
+    s64 first = chunk * snapshot_chunk_slots;
+    s64 slots = snapshot->cap + 1 - first;
+    if(slots > snapshot_chunk_slots)
+    {
+        slots = snapshot_chunk_slots;
+    }
+    s64 hashes = slots;
+    if(first + hashes > snapshot->cap)
+    {
+        hashes = snapshot->cap - first;
+    }
+
+    memcpy(copy->keys, &snapshot->keys[first], sizeof(void*) * slots);
+    memcpy(copy->values, &snapshot->values[first], sizeof(void*) * slots);
+    if(snapshot->hashes)
+    {
+        memcpy(copy->hashes, &snapshot->hashes[first], sizeof(u32) * hashes);
+    }
+
+    std::lock_guard<std::mutex> guard(snapshot->mutex);
+    snapshot->chunks[chunk] = copy;
+}
+
+static void detach_snapshots(Map* map, Heap* heap)
+{
+    MapSnapshot* next;
+    for(MapSnapshot* snapshot = map->snapshots; snapshot; snapshot = next)
+    {
+        for(s64 i = 0; i < snapshot->chunks_count; i += 1)
+        {
+            if(!snapshot->chunks[i])
+            {
+                copy_chunk(snapshot, i);
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(snapshot->mutex);
+        snapshot->map = nullptr;
+        snapshot->keys = nullptr;
+        snapshot->values = nullptr;
+        snapshot->hashes = nullptr;
+        next = snapshot->next;
+        snapshot->next = nullptr;
+    }
+    map->snapshots = nullptr;
+    SAFE_HEAP_DEALLOCATE(heap, map->shared_chunks);
+}
+
+void map_prepare_to_write(Map* map, s64 slot)
+{
+    if(!map->shared_chunks)
+    {
+        return;
+    }
+    s64 chunk = slot / snapshot_chunk_slots;
+    if(!map->shared_chunks[chunk])
+    {
+        return;
+    }
+    for(MapSnapshot* snapshot = map->snapshots; snapshot;
+        snapshot = snapshot->next)
+    {
+        if(!snapshot->chunks[chunk])
+        {
+            copy_chunk(snapshot, chunk);
+        }
+    }
+    map->shared_chunks[chunk] = false;
+}
+
+MapSnapshot* map_snapshot(Map* map, Heap* heap)
+{
+    ASSERT(!map->pool);
+    wait_for_growing(map);
+    MapSnapshot* snapshot = HEAP_ALLOCATE(heap, MapSnapshot, 1);
+    new(snapshot) MapSnapshot();
+    snapshot->heap = heap;
+    snapshot->cap = map->cap;
+    snapshot->count = map->count;
+    snapshot->hash_seed = map->hash_seed;
+
+    // A small map's pairs are copied right away, since there are so few.
+    if(is_small(map))
+    {
+        memcpy(snapshot->small_keys, map->small_keys, sizeof map->small_keys);
+        memcpy(snapshot->small_values, map->small_values,
+            sizeof map->small_values);
+        return snapshot;
+    }
+
+    s64 chunks_count = count_chunks(map->cap);
+    snapshot->map = map;
+    snapshot->keys = map->keys;
+    snapshot->values = map->values;
+    snapshot->hashes = map->hashes;
+    snapshot->chunks = HEAP_ALLOCATE(heap, SnapshotChunk*, chunks_count);
+    snapshot->chunks_count = chunks_count;
+
+    if(!map->shared_chunks)
+    {
+        map->shared_chunks = HEAP_ALLOCATE(heap, bool, chunks_count);
+    }
+    for(s64 i = 0; i < chunks_count; i += 1)
+    {
+        map->shared_chunks[i] = true;
+    }
+    snapshot->next = map->snapshots;
+    map->snapshots = snapshot;
+
+    return snapshot;
+}
+
+void map_snapshot_destroy(MapSnapshot* snapshot, Heap* heap)
+{
+    if(!snapshot)
+    {
+        return;
+    }
+
+    Map* map = snapshot->map;
+    if(map)
+    {
+        MapSnapshot** link = &map->snapshots;
+        while(*link != snapshot)
+        {
+            link = &(*link)->next;
+        }
+        *link = snapshot->next;
+        if(!map->snapshots)
+        {
+            SAFE_HEAP_DEALLOCATE(heap, map->shared_chunks);
+        }
+    }
+
+    for(s64 i = 0; i < snapshot->chunks_count; i += 1)
+    {
+        HEAP_DEALLOCATE(heap, snapshot->chunks[i]);
+    }
+    HEAP_DEALLOCATE(heap, snapshot->chunks);
+    snapshot->~MapSnapshot();
+    HEAP_DEALLOCATE(heap, snapshot);
+}
+
+// These read a slot from wherever it is now, either the shared table or the
+// snapshot's own copy. The snapshot's mutex has to be held while calling them.
+
+static void* get_snapshot_key(MapSnapshot* snapshot, s64 slot)
+{
+    SnapshotChunk* chunk = snapshot->chunks[slot / snapshot_chunk_slots];
+    if(chunk)
+    {
+        return chunk->keys[slot % snapshot_chunk_slots];
+    }
+    return snapshot->keys[slot];
+}
+
+static void* get_snapshot_value(MapSnapshot* snapshot, s64 slot)
+{
+    SnapshotChunk* chunk = snapshot->chunks[slot / snapshot_chunk_slots];
+    if(chunk)
+    {
+        return chunk->values[slot % snapshot_chunk_slots];
+    }
+    return snapshot->values[slot];
+}
+
+bool map_snapshot_get(MapSnapshot* snapshot, void* key, void** value)
+{
+    std::lock_guard<std::mutex> guard(snapshot->mutex);
+
+    if(snapshot->cap == 0)
+    {
+        for(int i = 0; i < snapshot->count; i += 1)
+        {
+            if(snapshot->small_keys[i] == key)
+            {
+                *value = snapshot->small_values[i];
+                return true;
+            }
+        }
+        return false;
+    }
+
+    if(key == empty)
+    {
+        s64 overflow_index = snapshot->cap;
+        if(get_snapshot_key(snapshot, overflow_index) == overflow_empty)
+        {
+            return false;
+        }
+        *value = get_snapshot_value(snapshot, overflow_index);
+        return true;
+    }
+
+    u64 bits = reinterpret_cast<u64>(key);
+    u64 hash = hash_with_seed(bits, snapshot->hash_seed);
+    s64 mask = snapshot->cap - 1;
+    for(s64 probe = hash & mask;; probe = (probe + 1) & mask)
+    {
+        void* found = get_snapshot_key(snapshot, probe);
+        if(found == key)
+        {
+            *value = get_snapshot_value(snapshot, probe);
+            return true;
+        }
+        else if(found == empty)
+        {
+            return false;
+        }
+    }
+}
+
+s64 map_snapshot_count(MapSnapshot* snapshot)
+{
+    return snapshot->count;
+}
+
+MapSnapshotIterator map_snapshot_iterator_next(MapSnapshotIterator it)
+{
+    MapSnapshot* snapshot = it.snapshot;
+    if(snapshot->cap == 0)
+    {
+        if(it.index + 1 < snapshot->count)
+        {
+            return {snapshot, it.index + 1};
+        }
+        return {snapshot, end_index};
+    }
+
+    std::lock_guard<std::mutex> guard(snapshot->mutex);
+
+    s64 index = it.index;
+    do
+    {
+        index += 1;
+        if(index >= snapshot->cap)
+        {
+            if(index == snapshot->cap &&
+                get_snapshot_key(snapshot, index) != overflow_empty)
+            {
+                return {snapshot, index};
+            }
+            return {snapshot, end_index};
+        }
+    } while(get_snapshot_key(snapshot, index) == empty);
+
+    return {snapshot, index};
+}
+
+MapSnapshotIterator map_snapshot_iterator_start(MapSnapshot* snapshot)
+{
+    if(snapshot->count > 0)
+    {
+        // Starting just before the first slot lets next find the first pair.
+        return map_snapshot_iterator_next({snapshot, -1});
+    }
+    else
+    {
+        return {snapshot, end_index};
+    }
+}
+
+bool map_snapshot_iterator_is_not_end(MapSnapshotIterator it)
+{
+    return it.index != end_index;
+}
+
+void* map_snapshot_iterator_get_key(MapSnapshotIterator it)
+{
+    MapSnapshot* snapshot = it.snapshot;
+    if(snapshot->cap == 0)
+    {
+        ASSERT(it.index >= 0 && it.index < snapshot->count);
+        return snapshot->small_keys[it.index];
+    }
+    ASSERT(it.index >= 0 && it.index <= snapshot->cap);
+    std::lock_guard<std::mutex> guard(snapshot->mutex);
+    return get_snapshot_key(snapshot, it.index);
+}
+
+void* map_snapshot_iterator_get_value(MapSnapshotIterator it)
+{
+    MapSnapshot* snapshot = it.snapshot;
+    if(snapshot->cap == 0)
+    {
+        ASSERT(it.index >= 0 && it.index < snapshot->count);
+        return snapshot->small_values[it.index];
+    }
+    ASSERT(it.index >= 0 && it.index <= snapshot->cap);
+    std::lock_guard<std::mutex> guard(snapshot->mutex);
+    return get_snapshot_value(snapshot, it.index);
 }
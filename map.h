@@ -4,30 +4,204 @@
 #include "sized_types.h"
 
 struct Heap;
+struct MapSnapshot;
+struct MapGrowth;
+struct MapCache;
+struct MapPool;
+
+// Tests build with this lowered, to reach tables that store no hashes.
+#if !defined(MAP_STORED_HASH_CAP)
+#define MAP_STORED_HASH_CAP (INT64_C(1) << 32)
+#endif
+
+namespace
+{
+    const int map_small_cap = 8;
+
+    // the most slots a table can have and still find its keys' home slots
+    // from the low halves of their hashes, which is all it stores of them
+    const s64 map_stored_hash_cap = MAP_STORED_HASH_CAP;
+}
 
 // This is a hash table that uses pointer-sized values for its key and value
 // pairs. It uses open addressing and linear probing for its collision
 // resolution.
+//
+// Until it holds more than map_small_cap pairs, a map keeps them inline in
+// small_keys and small_values and finds them by scanning, so that small maps
+// never allocate. It's in this small mode whenever its cap is 0, and it moves
+// to a heap table the first time it overflows.
+//
+// Keys are hashed with map_hash_key until adds start landing far enough from
+// their home slots to show the keys are clustering on it. Then the map picks
+// a seeded hash and rehashes under that instead. The seed is kept in the map,
+// and in every snapshot taken of it, so gets always use the hash the table
+// was built with.
+//
+// Sizes and slot indices are 64-bit, so one table can hold billions of pairs.
+// Each slot only stores the low 32 bits of its key's hash, though, which
+// keeps a table compact and is all of the home slot up to
+// map_stored_hash_cap slots. Tables bigger than that store no hashes at all,
+// leaving hashes null, and hash keys again whenever they need to know where
+// one belongs, such as when growing.
+//
+// Defining MAP_COUNT_PROBES when building makes every get, add, and remove
+// tally how many slots it had to look at, so clustering can be watched on a
+// live table. It's off by default since it costs a little on each operation.
 struct Map
 {
     void** keys;
     void** values;
     u32* hashes;
-    int cap;
-    int count;
+    s64 cap;
+    s64 count;
+    int grows;
+    // the snapshots still sharing this map's table, and a flag for each
+    // chunk of the table saying whether any of them might still share it
+    MapSnapshot* snapshots;
+    bool* shared_chunks;
+    // set when grows are built on a helper thread
+    MapGrowth* growth;
+    // set when the map is bounded, and evicts pairs to stay under its bound
+    MapCache* cache;
+    // set when values are kept in place, in cells of this pool
+    MapPool* pool;
+    // zero while keys are hashed with map_hash_key, and otherwise the seed
+    // of the hash used instead
+    u64 hash_seed;
+    // how far from home the adds since the last check have landed in total
+    u64 window_distance;
+    int window_adds;
+#if defined(MAP_COUNT_PROBES)
+    u64 probes;
+    u64 probed_operations;
+#endif
+    void* small_keys[map_small_cap];
+    void* small_values[map_small_cap];
 };
 
+// This is the hash every Map uses for its keys. It's here in the header so
+// that the typed PointerMap in pointer_map.h can inline it.
+inline u64 map_hash_key(u64 key)
+{
+    key = (~key) + (key << 18); // key = (key << 18) - key - 1;
+    key = key ^ (key >> 31);
+    key = key * 21; // key = (key + (key << 2)) + (key << 4);
+    key = key ^ (key >> 11);
+    key = key + (key << 6);
+    key = key ^ (key >> 22);
+    return key;
+}
+
 void map_create(Map* map, Heap* heap);
 void map_destroy(Map* map, Heap* heap);
 bool map_get(Map* map, void* key, void** value);
 void map_add(Map* map, void* key, void* value, Heap* heap);
 void map_remove(Map* map, void* key);
-void map_reserve(Map* map, int cap, Heap* heap);
 
+// These treat values as integer counts. Adding to a key that isn't there yet
+// adds it with a count of zero first, so map_add_to can tally a histogram
+// with one probe per key rather than a get and an add. It gives the count
+// the key ends up with.
+//
+// The batch adds the deltas to their keys, or one to each key if deltas is
+// null. The batch is sorted by home slot, and repeats of a key that the sort
+// puts next to each other are added up before the table is probed for them.
+spointer map_add_to(Map* map, void* key, spointer delta, Heap* heap);
+void map_add_to_batch(Map* map, void** keys, spointer* deltas, int count,
+    Heap* heap);
+
+// This removes a whole batch of keys at once, which is much faster than
+// removing them one at a time when there are a lot of them. It finds all the
+// keys in a block of the batch before removing any, and then closes the gaps
+// left in each cluster in a single pass over it.
+void map_remove_batch(Map* map, void** keys, int count);
+void map_reserve(Map* map, s64 cap, Heap* heap);
+
+// This makes the map build its bigger tables on a helper thread, so that
+// map_add never has to stop and rehash the whole table itself. A build starts
+// once the map is start_load full, which has to be under the 3/4 load limit,
+// and it works from the stored hashes of a table that stays untouched until
+// the build's done. Until then, adds and removes go to a small log instead,
+// which is replayed onto the new table before it's swapped in. If the log
+// fills up first, the next write waits for the build.
+//
+// A build takes twice the table's memory while it runs, and tables too small
+// to be worth a thread still grow inline. Only map_add starts builds, so a
+// PointerMap still grows inline, and it mustn't be used on a map while one
+// is running.
+void map_grow_in_background(Map* map, float start_load, Heap* heap);
+
+// This bounds the map to hold at most limit pairs, which makes it a cache.
+// Once it's full, adding a new key first evicts another pair, chosen by a
+// CLOCK sweep: a hand goes around the slots, clearing the flag each pair has
+// for having been got or added since the hand last passed, and evicts the
+// first pair whose flag is already clear. So recently used pairs tend to stay
+// without the map keeping any list of them, and a hit costs no more than
+// setting the flag.
+//
+// The evict function, if there is one, is given each evicted pair, along with
+// the user_data. A bounded map's table is made big enough for the limit right
+// away and never grows past it. It can't also grow in the background, and a
+// PointerMap doesn't keep to the bound, so it mustn't add to a bounded map.
+typedef void (*MapEvict)(void* key, void* value, void* user_data);
+
+void map_set_bound(Map* map, s64 limit, MapEvict evict, void* user_data,
+    Heap* heap);
+
+// This moves the map's values out of its table, into a pool of cells that the
+// map owns. The table holds the address of each value's cell instead, so
+// growing or shifting pairs around only moves that address, and a value stays
+// at the same address for as long as its key is in the map. The cells of
+// removed pairs are reused by later adds.
+//
+// map_get_reference gives the address of a key's value, or null if the key
+// isn't there, and map_add_reference adds the key with a null value first if
+// it has to. Both work on any map, but without the pool the address only
+// lasts until the map's next add, remove, or snapshot. With it, the address
+// can be kept across any number of changes to other keys.
+//
+// A map whose values are kept in place can't also grow in the background or
+// be snapshotted. A PointerMap reads and writes values in the table itself, so
+// it mustn't be used on one either.
+void map_keep_values_in_place(Map* map, Heap* heap);
+void** map_get_reference(Map* map, void* key);
+void** map_add_reference(Map* map, void* key, Heap* heap);
+
+namespace
+{
+    const int map_probe_lengths_cap = 16;
+}
+
+// A report on how well a map's keys are spread out, taken by walking its
+// slots. A probe length is how many slots a lookup looks at to find a key, so
+// a key sitting in its own home slot has a probe length of one.
+struct MapStats
+{
+    // Counts of present keys by probe length, where index 0 is a probe length
+    // of one. The last bucket also counts any keys with longer probes.
+    s64 probe_lengths[map_probe_lengths_cap];
+    u64 bytes_allocated;
+    float load_factor;
+    float mean_hit_probe_length;
+    float expected_miss_probe_length;
+    s64 longest_probe_length;
+    s64 longest_cluster;
+    int grows;
+#if defined(MAP_COUNT_PROBES)
+    float mean_live_probe_length;
+#endif
+};
+
+void map_get_stats(Map* map, MapStats* stats);
+
+// The stop is the empty slot that iteration started just past and goes
+// around the table back to.
 struct MapIterator
 {
     Map* map;
-    int index;
+    s64 index;
+    s64 stop;
 };
 
 MapIterator map_iterator_next(MapIterator it);
@@ -36,7 +210,106 @@ bool map_iterator_is_not_end(MapIterator it);
 void* map_iterator_get_key(MapIterator it);
 void* map_iterator_get_value(MapIterator it);
 
+// This removes the pair an iterator's on and gives an iterator that's safe to
+// carry on from, so that inside ITERATE_MAP it's used like
+//
+//     it = map_iterator_remove(it);
+//
+// Every pair left gets visited exactly once, including any that removal
+// shifts back into this slot. The iterator it gives is only meant to be
+// passed to map_iterator_next, and not read from.
+MapIterator map_iterator_remove(MapIterator it);
+
 #define ITERATE_MAP(it, map) \
     for(MapIterator it = map_iterator_start(map); map_iterator_is_not_end(it); it = map_iterator_next(it))
 
+// This removes every pair the predicate returns false for, in a single pass
+// that also closes up the gaps they leave. The user_data is passed along to
+// each call of the predicate.
+typedef bool (*MapPredicate)(void* key, void* value, void* user_data);
+
+void map_retain_if(Map* map, MapPredicate predicate, void* user_data);
+
+// This says which value to keep when a key being merged in is already there.
+// Adding treats the values as counts, like map_add_to does, so that counts
+// tallied in separate maps, such as one per thread, can be combined.
+enum class MapConflict
+{
+    Add_Values,
+    Keep_Destination,
+    Take_Source,
+};
+
+// These combine the pairs of the source map into the destination, and leave
+// the source as it was. A merge reuses the hashes the source has stored
+// rather than hashing its keys again, and reserves room for the bigger of the
+// two maps up front. An intersection keeps only the destination's pairs whose
+// keys are also in the source, and a difference keeps only the ones that
+// aren't. Both of those work in a single pass over the destination, and keep
+// its values.
+void map_merge(Map* destination, Map* source, MapConflict conflict,
+    Heap* heap);
+void map_intersect(Map* destination, Map* source);
+void map_difference(Map* destination, Map* source);
+
+// Probing past a key's home slot, scanning for the next pair while iterating,
+// and hashing the keys of a batch each have versions for SSE4.2 and AVX2 as
+// well as plain C++. The best one the processor has is picked when the
+// program starts, so the same build runs at full speed on any x86 processor
+// without needing to be compiled for it. Every version finds the same slots,
+// so a table can be used under any of them.
+//
+// Picking a set is mostly for comparing them. It fails, and leaves the set
+// as it was, if the processor doesn't have the one asked for.
+enum class MapInstructionSet
+{
+    Scalar,
+    SSE4_2,
+    AVX2,
+};
+
+MapInstructionSet map_get_instruction_set();
+bool map_use_instruction_set(MapInstructionSet instruction_set);
+
+// A snapshot is a read-only view of a map as it was at the moment it was
+// taken. Taking one copies none of the table. Instead, the snapshot shares the
+// table with the map, and the first add or remove that touches a chunk of it
+// copies that chunk's old pairs out to every snapshot still sharing it. So a
+// snapshot only ever costs as much memory as the part of the table that has
+// changed since it was taken.
+//
+// A snapshot can be read from another thread while the map's own thread keeps
+// using the map. However, it has to be destroyed on the map's thread for as
+// long as the map is alive. Growing or destroying the map copies whatever
+// chunks its snapshots still share, after which they stand on their own.
+//
+// Getting from a snapshot uses the default hash, so snapshots of a PointerMap
+// with any other Hash can only be iterated.
+MapSnapshot* map_snapshot(Map* map, Heap* heap);
+void map_snapshot_destroy(MapSnapshot* snapshot, Heap* heap);
+bool map_snapshot_get(MapSnapshot* snapshot, void* key, void** value);
+s64 map_snapshot_count(MapSnapshot* snapshot);
+
+// This copies out the chunk holding the given slot to any snapshots sharing
+// it. Code writing to a map's slots directly, like PointerMap, has to call it
+// before each write whenever shared_chunks is set.
+void map_prepare_to_write(Map* map, s64 slot);
+
+struct MapSnapshotIterator
+{
+    MapSnapshot* snapshot;
+    s64 index;
+};
+
+MapSnapshotIterator map_snapshot_iterator_next(MapSnapshotIterator it);
+MapSnapshotIterator map_snapshot_iterator_start(MapSnapshot* snapshot);
+bool map_snapshot_iterator_is_not_end(MapSnapshotIterator it);
+void* map_snapshot_iterator_get_key(MapSnapshotIterator it);
+void* map_snapshot_iterator_get_value(MapSnapshotIterator it);
+
+#define ITERATE_MAP_SNAPSHOT(it, snapshot) \
+    for(MapSnapshotIterator it = map_snapshot_iterator_start(snapshot); \
+        map_snapshot_iterator_is_not_end(it); \
+        it = map_snapshot_iterator_next(it))
+
 #endif // MAP_H_
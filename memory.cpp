@@ -0,0 +1,219 @@
+#include "memory.h"
+
+#include "platform_definitions.h"
+
+#if defined(OS_WINDOWS)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <Windows.h>
+#include <Psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <cstdio>
+#include <cstring>
+#endif
+
+#if defined(OS_LINUX)
+#include <sys/mman.h>
+#endif
+
+namespace
+{
+    // Each allocation is prefixed with its size so that it can be taken off
+    // of the count when it's freed. The prefix is kept to 16 bytes, so the
+    // allocation after it keeps the same alignment calloc gives.
+    const u64 prefix_bytes = 16;
+
+    // Blocks at least this big are mapped in huge pages of their own. It's
+    // the size of a huge page on x86-64.
+    const u64 huge_page_bytes = UINT64_C(1) << 21;
+}
+
+#if defined(OS_LINUX)
+
+static bool use_huge_pages(u64 bytes)
+{
+    return prefix_bytes + bytes >= huge_page_bytes;
+}
+
+// The block is rounded up to whole huge pages, so that its mapping can be
+// trimmed and unmapped on page boundaries.
+static u64 get_huge_block_bytes(u64 bytes)
+{
+    u64 total = prefix_bytes + bytes + huge_page_bytes - 1;
+    return total & ~(huge_page_bytes - 1);
+}
+
+// Huge pages only back a range that's aligned to them, so the block's mapped
+// one huge page bigger than it needs to be, and trimmed to the aligned part.
+// Then it's marked so that the kernel backs it with huge pages where it can,
+// which takes far fewer TLB entries to walk a big table. Mapped memory comes
+// zeroed already, the same as from calloc.
+static u8* map_huge_pages(u64 bytes)
+{
+    u64 mapped_bytes = bytes + huge_page_bytes;
+    void* mapped = mmap(nullptr, mapped_bytes, PROT_READ | PROT_WRITE,
+        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(mapped == MAP_FAILED)
+    {
+        return nullptr;
+    }
+
+    u8* start = static_cast<u8*>(mapped);
+    upointer address = reinterpret_cast<upointer>(start);
+    u64 head = (huge_page_bytes - (address & (huge_page_bytes - 1)))
+        & (huge_page_bytes - 1);
+    if(head)
+    {
+        munmap(start, head);
+    }
+    u8* block = start + head;
+    u64 tail = huge_page_bytes - head;
+    munmap(block + bytes, tail);
+
+#if defined(MADV_HUGEPAGE)
+    madvise(block, bytes, MADV_HUGEPAGE);
+#endif
+    return block;
+}
+
+#endif // defined(OS_LINUX)
+
+static u8* allocate_block(u64 bytes)
+{
+#if defined(OS_LINUX)
+    if(use_huge_pages(bytes))
+    {
+        return map_huge_pages(get_huge_block_bytes(bytes));
+    }
+#endif
+    return static_cast<u8*>(calloc(1, prefix_bytes + bytes));
+}
+
+static void deallocate_block(u8* block, u64 bytes)
+{
+#if defined(OS_LINUX)
+    if(use_huge_pages(bytes))
+    {
+        munmap(block, get_huge_block_bytes(bytes));
+        return;
+    }
+#endif
+    free(block);
+}
+
+void* heap_allocate(Heap* heap, u64 bytes)
+{
+    u8* block = allocate_block(bytes);
+    if(!block)
+    {
+        return nullptr;
+    }
+    *reinterpret_cast<u64*>(block) = bytes;
+
+    if(heap)
+    {
+        u64 in_use = heap->bytes_in_use.fetch_add(bytes) + bytes;
+        u64 peak = heap->peak_bytes.load();
+        while(in_use > peak)
+        {
+            if(heap->peak_bytes.compare_exchange_weak(peak, in_use))
+            {
+                break;
+            }
+        }
+    }
+
+    return block + prefix_bytes;
+}
+
+void heap_deallocate(Heap* heap, void* memory)
+{
+    if(!memory)
+    {
+        return;
+    }
+    u8* block = static_cast<u8*>(memory) - prefix_bytes;
+    u64 bytes = *reinterpret_cast<u64*>(block);
+    if(heap)
+    {
+        heap->bytes_in_use.fetch_sub(bytes);
+    }
+    deallocate_block(block, bytes);
+}
+
+u64 heap_get_bytes_in_use(Heap* heap)
+{
+    return heap->bytes_in_use.load();
+}
+
+u64 heap_get_peak_bytes(Heap* heap)
+{
+    return heap->peak_bytes.load();
+}
+
+void heap_reset_peak(Heap* heap)
+{
+    heap->peak_bytes.store(heap->bytes_in_use.load());
+}
+
+#if defined(OS_WINDOWS)
+
+u64 get_peak_resident_bytes()
+{
+    PROCESS_MEMORY_COUNTERS counters;
+    if(!GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+            sizeof(counters)))
+    {
+        return 0;
+    }
+    return counters.PeakWorkingSetSize;
+}
+
+bool reset_peak_resident_bytes()
+{
+    return false;
+}
+
+#else
+
+u64 get_peak_resident_bytes()
+{
+    FILE* file = fopen("/proc/self/status", "r");
+    if(!file)
+    {
+        return 0;
+    }
+
+    u64 kilobytes = 0;
+    char line[128];
+    while(fgets(line, sizeof(line), file))
+    {
+        unsigned long long value;
+        if(sscanf(line, "VmHWM: %llu kB", &value) == 1)
+        {
+            kilobytes = value;
+            break;
+        }
+    }
+    fclose(file);
+
+    return 1024 * kilobytes;
+}
+
+// Writing 5 to clear_refs resets the peak resident set size to the current
+// one. It's been supported since Linux 4.0.
+bool reset_peak_resident_bytes()
+{
+    FILE* file = fopen("/proc/self/clear_refs", "w");
+    if(!file)
+    {
+        return false;
+    }
+    bool reset = fputs("5", file) >= 0;
+    reset = (fclose(file) == 0) && reset;
+    return reset;
+}
+
+#endif // defined(OS_WINDOWS)
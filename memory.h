@@ -3,27 +3,45 @@
 
 #include "sized_types.h"
 
+#include <atomic>
 #include <cstdlib>
 
 // Note from Andrew Dawson: This is all part of an interface I normally use for
 // memory. It's not relevant to these tests, so here they're replaced with stubs
 // that just use calloc and free.
+//
+// The stub does keep count of how many bytes are in use and the most that
+// ever were, so the benchmarks can report how much memory each table takes.
+// The counts are atomic since separate threads may share the heap.
 
 struct Heap
 {
-    int placeholder;
+    std::atomic<u64> bytes_in_use;
+    std::atomic<u64> peak_bytes;
 };
 
 #define heap_create(heap, bytes)
 #define heap_destroy(heap)
 
+void* heap_allocate(Heap* heap, u64 bytes);
+void heap_deallocate(Heap* heap, void* memory);
+u64 heap_get_bytes_in_use(Heap* heap);
+u64 heap_get_peak_bytes(Heap* heap);
+void heap_reset_peak(Heap* heap);
+
 #define HEAP_ALLOCATE(heap, type, count)\
-    static_cast<type*>(calloc(count, sizeof(type)))
+    static_cast<type*>(heap_allocate(heap, sizeof(type) * (count)))
 
 #define HEAP_DEALLOCATE(heap, array)\
-    free(array)
+    heap_deallocate(heap, array)
 
 #define SAFE_HEAP_DEALLOCATE(heap, array)\
-    {free(array); (array) = nullptr;}
+    {heap_deallocate(heap, array); (array) = nullptr;}
+
+// These read the operating system's view of the process's memory, which
+// includes what it's using outside of any Heap. Where the peak can't be reset,
+// it stays the peak over the whole life of the process.
+u64 get_peak_resident_bytes();
+bool reset_peak_resident_bytes();
 
 #endif // MEMORY_H_
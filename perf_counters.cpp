@@ -0,0 +1,193 @@
+#include "perf_counters.h"
+
+#include "platform_definitions.h"
+
+#if defined(OS_LINUX)
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#endif
+
+const char* describe_perf_counter(PerfCounter counter)
+{
+    switch(counter)
+    {
+        default:
+        case PerfCounter::Cycles: return "Cycles";
+        case PerfCounter::Instructions: return "Instructions";
+        case PerfCounter::Branch_Misses: return "Branch Misses";
+        case PerfCounter::L1d_Misses: return "L1d Misses";
+        case PerfCounter::Llc_Misses: return "LLC Misses";
+        case PerfCounter::Dtlb_Misses: return "dTLB Misses";
+    }
+}
+
+#if defined(OS_LINUX)
+
+static u64 get_cache_miss_config(u64 cache)
+{
+    return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+        | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+static void describe_event(PerfCounter counter, perf_event_attr* attr)
+{
+    switch(counter)
+    {
+        case PerfCounter::Cycles:
+        {
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        }
+        case PerfCounter::Instructions:
+        {
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        }
+        case PerfCounter::Branch_Misses:
+        {
+            attr->type = PERF_TYPE_HARDWARE;
+            attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        }
+        case PerfCounter::L1d_Misses:
+        {
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = get_cache_miss_config(PERF_COUNT_HW_CACHE_L1D);
+            break;
+        }
+        case PerfCounter::Llc_Misses:
+        {
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = get_cache_miss_config(PERF_COUNT_HW_CACHE_LL);
+            break;
+        }
+        case PerfCounter::Dtlb_Misses:
+        {
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = get_cache_miss_config(PERF_COUNT_HW_CACHE_DTLB);
+            break;
+        }
+    }
+}
+
+// Each counter is opened on its own instead of as a group, so that one the
+// processor lacks doesn't keep the rest from being read.
+bool perf_counters_open(PerfCounters* counters)
+{
+    bool any = false;
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED
+            | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        describe_event(static_cast<PerfCounter>(i), &attr);
+
+        int file = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        counters->files[i] = file;
+        counters->available[i] = file != -1;
+        counters->values[i] = 0;
+        any = any || counters->available[i];
+    }
+    return any;
+}
+
+void perf_counters_close(PerfCounters* counters)
+{
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        if(counters->available[i])
+        {
+            close(counters->files[i]);
+            counters->files[i] = -1;
+            counters->available[i] = false;
+        }
+    }
+}
+
+void perf_counters_start(PerfCounters* counters)
+{
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        if(counters->available[i])
+        {
+            ioctl(counters->files[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->files[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+void perf_counters_stop(PerfCounters* counters)
+{
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        if(counters->available[i])
+        {
+            ioctl(counters->files[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        counters->values[i] = 0;
+        if(!counters->available[i])
+        {
+            continue;
+        }
+
+        // When there are more counters than the processor has registers for,
+        // they take turns and each only runs part of the time. So, scale the
+        // count up by how much of the time it was actually running.
+        u64 data[3];
+        if(read(counters->files[i], data, sizeof(data)) != sizeof(data))
+        {
+            continue;
+        }
+        u64 value = data[0];
+        u64 enabled = data[1];
+        u64 running = data[2];
+        if(running > 0 && running < enabled)
+        {
+            value = static_cast<u64>(static_cast<double>(value) * enabled
+                / running);
+        }
+        counters->values[i] = value;
+    }
+}
+
+#else
+
+bool perf_counters_open(PerfCounters* counters)
+{
+    for(int i = 0; i < perf_counters_cap; i += 1)
+    {
+        counters->files[i] = -1;
+        counters->available[i] = false;
+        counters->values[i] = 0;
+    }
+    return false;
+}
+
+void perf_counters_close(PerfCounters* counters)
+{
+}
+
+void perf_counters_start(PerfCounters* counters)
+{
+}
+
+void perf_counters_stop(PerfCounters* counters)
+{
+}
+
+#endif // defined(OS_LINUX)
@@ -0,0 +1,38 @@
+#ifndef PERF_COUNTERS_H_
+#define PERF_COUNTERS_H_
+
+#include "sized_types.h"
+
+enum class PerfCounter
+{
+    Cycles,
+    Instructions,
+    Branch_Misses,
+    L1d_Misses,
+    Llc_Misses,
+    Dtlb_Misses,
+};
+
+namespace
+{
+    const int perf_counters_cap = 6;
+}
+
+// These are hardware performance counters read around a stretch of code. Any
+// counter the system won't give access to, like when running inside a
+// container or on an operating system without perf_event_open, is marked as
+// unavailable and just reads zero.
+struct PerfCounters
+{
+    u64 values[perf_counters_cap];
+    int files[perf_counters_cap];
+    bool available[perf_counters_cap];
+};
+
+bool perf_counters_open(PerfCounters* counters);
+void perf_counters_close(PerfCounters* counters);
+void perf_counters_start(PerfCounters* counters);
+void perf_counters_stop(PerfCounters* counters);
+const char* describe_perf_counter(PerfCounter counter);
+
+#endif // PERF_COUNTERS_H_
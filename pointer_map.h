@@ -0,0 +1,376 @@
+#ifndef POINTER_MAP_H_
+#define POINTER_MAP_H_
+
+#include "map.h"
+
+#include <cstring>
+#include <type_traits>
+
+// This is a typed front for Map. It keeps the very same layout and algorithm,
+// but its get, add, and remove are inline templates, so the compiler can
+// specialize the probing at each call site instead of going through an
+// out-of-line call on void pointers. Only the rare paths, like growing, call
+// into map.cpp.
+//
+// Keys and values can be any trivially copyable type that fits in a pointer.
+// Their bits are stored in the pointer-sized slots as they are, so a key whose
+// bits are all zero is the one that goes in the overflow slot.
+//
+// The Hash is a type with a static function hash(u64) giving a u64. Any Hash
+// but the default MapHash makes a table that can only be used through these
+// functions, since map_get, map_add, and the rest would look for keys in the
+// wrong slots. Iteration, map_reserve, map_get_stats, and map_destroy all
+// still work on the underlying Map, since they go by the stored hashes. But
+// past map_stored_hash_cap slots, map.cpp hashes keys again with the default
+// hash, so a table with any other Hash can't grow that big.
+// A PointerMap never switches to a seeded hash the way map_add can, so even
+// with the default MapHash, it mustn't share a map with map_add. Nor can it
+// use a map that keeps its values in place, since the values it reads from
+// the table would be the addresses of their cells.
+//
+// The Policy says whether keys can have all zero bits. When a Policy promises
+// they can't, the check for the overflow slot is compiled out entirely.
+//
+// Small maps are scanned inline here too. When one overflows, its pairs are
+// added back through pointer_map_add, so that they land where the Hash puts
+// them and not where map.cpp would.
+
+struct MapHash
+{
+    static u64 hash(u64 key)
+    {
+        return map_hash_key(key);
+    }
+};
+
+struct AnyKeysPolicy
+{
+    static const bool zero_keys = true;
+};
+
+struct NonzeroKeysPolicy
+{
+    static const bool zero_keys = false;
+};
+
+template<typename K, typename V, typename Hash = MapHash,
+    typename Policy = AnyKeysPolicy>
+struct PointerMap
+{
+    static_assert(sizeof(K) <= sizeof(void*),
+            "PointerMap keys have to fit in a pointer.");
+    static_assert(sizeof(V) <= sizeof(void*),
+            "PointerMap values have to fit in a pointer.");
+    static_assert(std::is_trivially_copyable<K>::value,
+            "PointerMap keys have to be trivially copyable.");
+    static_assert(std::is_trivially_copyable<V>::value,
+            "PointerMap values have to be trivially copyable.");
+
+    Map map;
+};
+
+namespace
+{
+    void* const pointer_map_empty = nullptr;
+    void* const pointer_map_overflow_empty = reinterpret_cast<void*>(1);
+}
+
+template<typename T>
+inline void* pointer_map_to_slot(T x)
+{
+    upointer bits = 0;
+    memcpy(&bits, &x, sizeof(T));
+    return reinterpret_cast<void*>(bits);
+}
+
+template<typename T>
+inline T pointer_map_from_slot(void* slot)
+{
+    upointer bits = reinterpret_cast<upointer>(slot);
+    T x;
+    memcpy(&x, &bits, sizeof(T));
+    return x;
+}
+
+inline s64 pointer_map_find_slot(void** keys, s64 cap, void* key, u64 hash)
+{
+    s64 probe = hash & (cap - 1);
+    while(keys[probe] != key && keys[probe] != pointer_map_empty)
+    {
+        probe = (probe + 1) & (cap - 1);
+    }
+    return probe;
+}
+
+inline int pointer_map_find_small_slot(Map* map, void* key)
+{
+    for(int i = 0; i < map->count; i += 1)
+    {
+        if(map->small_keys[i] == key)
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// The check is inline so that a map without snapshots pays nothing more than
+// it for each write.
+inline void pointer_map_prepare_to_write(Map* map, s64 slot)
+{
+    if(map->shared_chunks)
+    {
+        map_prepare_to_write(map, slot);
+    }
+}
+
+#if defined(MAP_COUNT_PROBES)
+inline void pointer_map_count_probes(Map* map, u64 hash, s64 slot)
+{
+    s64 home = hash & (map->cap - 1);
+    map->probes += ((slot - home) & (map->cap - 1)) + 1;
+    map->probed_operations += 1;
+}
+#else
+#define pointer_map_count_probes(map, hash, slot)
+#endif
+
+template<typename K, typename V, typename H, typename P>
+inline void pointer_map_create(PointerMap<K, V, H, P>* map, Heap* heap)
+{
+    map_create(&map->map, heap);
+}
+
+template<typename K, typename V, typename H, typename P>
+inline void pointer_map_destroy(PointerMap<K, V, H, P>* map, Heap* heap)
+{
+    map_destroy(&map->map, heap);
+}
+
+template<typename K, typename V, typename H, typename P>
+inline bool pointer_map_get(PointerMap<K, V, H, P>* pointer_map, K key,
+    V* value)
+{
+    Map* map = &pointer_map->map;
+    void* slot_key = pointer_map_to_slot(key);
+
+    if(map->cap == 0)
+    {
+        int slot = pointer_map_find_small_slot(map, slot_key);
+        if(slot == -1)
+        {
+            return false;
+        }
+        *value = pointer_map_from_slot<V>(map->small_values[slot]);
+        return true;
+    }
+
+    if(P::zero_keys && slot_key == pointer_map_empty)
+    {
+        s64 overflow_index = map->cap;
+        if(map->keys[overflow_index] == pointer_map_overflow_empty)
+        {
+            return false;
+        }
+        *value = pointer_map_from_slot<V>(map->values[overflow_index]);
+        return true;
+    }
+
+    u64 hash = H::hash(reinterpret_cast<upointer>(slot_key));
+    s64 slot = pointer_map_find_slot(map->keys, map->cap, slot_key, hash);
+    pointer_map_count_probes(map, hash, slot);
+
+    bool got = map->keys[slot] == slot_key;
+    if(got)
+    {
+        *value = pointer_map_from_slot<V>(map->values[slot]);
+    }
+    return got;
+}
+
+template<typename K, typename V, typename H, typename P>
+inline void pointer_map_add(PointerMap<K, V, H, P>* pointer_map, K key,
+    V value, Heap* heap)
+{
+    Map* map = &pointer_map->map;
+    void* slot_key = pointer_map_to_slot(key);
+    void* slot_value = pointer_map_to_slot(value);
+
+    if(map->cap == 0)
+    {
+        int slot = pointer_map_find_small_slot(map, slot_key);
+        if(slot != -1)
+        {
+            map->small_values[slot] = slot_value;
+            return;
+        }
+        if(map->count < map_small_cap)
+        {
+            map->small_keys[map->count] = slot_key;
+            map->small_values[map->count] = slot_value;
+            map->count += 1;
+            return;
+        }
+
+        // Empty the small map before moving to a table, then add its pairs
+        // back with this map's Hash.
+        void* keys[map_small_cap];
+        void* values[map_small_cap];
+        int count = static_cast<int>(map->count);
+        memcpy(keys, map->small_keys, sizeof keys);
+        memcpy(values, map->small_values, sizeof values);
+        map->count = 0;
+        map_reserve(map, map_small_cap + 1, heap);
+        for(int i = 0; i < count; i += 1)
+        {
+            pointer_map_add(pointer_map, pointer_map_from_slot<K>(keys[i]),
+                pointer_map_from_slot<V>(values[i]), heap);
+        }
+    }
+
+    if(P::zero_keys && slot_key == pointer_map_empty)
+    {
+        s64 overflow_index = map->cap;
+        pointer_map_prepare_to_write(map, overflow_index);
+        if(map->keys[overflow_index] == pointer_map_overflow_empty)
+        {
+            map->count += 1;
+        }
+        map->keys[overflow_index] = slot_key;
+        map->values[overflow_index] = slot_value;
+        return;
+    }
+
+    s64 load_limit = (3 * map->cap) / 4;
+    if(map->count >= load_limit)
+    {
+        // Reserving always rounds up to the next power of two past the cap
+        // given, so this doubles it.
+        map_reserve(map, map->cap, heap);
+    }
+
+    u64 hash = H::hash(reinterpret_cast<upointer>(slot_key));
+    s64 slot = pointer_map_find_slot(map->keys, map->cap, slot_key, hash);
+    pointer_map_count_probes(map, hash, slot);
+    pointer_map_prepare_to_write(map, slot);
+    if(map->keys[slot] == pointer_map_empty)
+    {
+        map->count += 1;
+    }
+    map->keys[slot] = slot_key;
+    map->values[slot] = slot_value;
+    if(map->cap <= map_stored_hash_cap)
+    {
+        map->hashes[slot] = static_cast<u32>(hash);
+    }
+}
+
+template<typename K, typename V, typename H, typename P>
+inline void pointer_map_remove(PointerMap<K, V, H, P>* pointer_map, K key)
+{
+    Map* map = &pointer_map->map;
+    void* slot_key = pointer_map_to_slot(key);
+
+    if(map->cap == 0)
+    {
+        int slot = pointer_map_find_small_slot(map, slot_key);
+        if(slot != -1)
+        {
+            s64 last = map->count - 1;
+            map->small_keys[slot] = map->small_keys[last];
+            map->small_values[slot] = map->small_values[last];
+            map->count -= 1;
+        }
+        return;
+    }
+
+    if(P::zero_keys && slot_key == pointer_map_empty)
+    {
+        s64 overflow_index = map->cap;
+        if(map->keys[overflow_index] == slot_key)
+        {
+            pointer_map_prepare_to_write(map, overflow_index);
+            map->keys[overflow_index] = pointer_map_overflow_empty;
+            map->values[overflow_index] = nullptr;
+            map->count -= 1;
+        }
+        return;
+    }
+
+    u64 hash = H::hash(reinterpret_cast<upointer>(slot_key));
+    s64 mask = map->cap - 1;
+    s64 slot = pointer_map_find_slot(map->keys, map->cap, slot_key, hash);
+    pointer_map_count_probes(map, hash, slot);
+    if(map->keys[slot] == pointer_map_empty)
+    {
+        return;
+    }
+    map->count -= 1;
+
+    // This is the same backward shift as map_remove, which moves any pairs
+    // that probed past this slot back into it. Tables too big to store hashes
+    // hash each key again instead.
+    bool stores_hashes = map->cap <= map_stored_hash_cap;
+    for(s64 i = slot, j = slot;; i = j)
+    {
+        pointer_map_prepare_to_write(map, i);
+        map->keys[i] = pointer_map_empty;
+        s64 home;
+        do
+        {
+            j = (j + 1) & mask;
+            if(map->keys[j] == pointer_map_empty)
+            {
+                return;
+            }
+            if(stores_hashes)
+            {
+                home = map->hashes[j] & mask;
+            }
+            else
+            {
+                upointer bits = reinterpret_cast<upointer>(map->keys[j]);
+                home = H::hash(bits) & mask;
+            }
+        } while((j > i) ? (home > i && home <= j) : (home > i || home <= j));
+
+        map->keys[i] = map->keys[j];
+        map->values[i] = map->values[j];
+        if(stores_hashes)
+        {
+            map->hashes[i] = map->hashes[j];
+        }
+    }
+}
+
+template<typename K, typename V, typename H, typename P>
+inline void pointer_map_reserve(PointerMap<K, V, H, P>* map, s64 cap,
+    Heap* heap)
+{
+    map_reserve(&map->map, cap, heap);
+}
+
+template<typename K, typename V, typename H, typename P>
+inline s64 pointer_map_count(PointerMap<K, V, H, P>* map)
+{
+    return map->map.count;
+}
+
+template<typename K, typename V, typename H, typename P>
+inline K pointer_map_iterator_get_key(PointerMap<K, V, H, P>* map,
+    MapIterator it)
+{
+    return pointer_map_from_slot<K>(map_iterator_get_key(it));
+}
+
+template<typename K, typename V, typename H, typename P>
+inline V pointer_map_iterator_get_value(PointerMap<K, V, H, P>* map,
+    MapIterator it)
+{
+    return pointer_map_from_slot<V>(map_iterator_get_value(it));
+}
+
+#define ITERATE_POINTER_MAP(it, pointer_map) \
+    ITERATE_MAP(it, &(pointer_map)->map)
+
+#endif // POINTER_MAP_H_
@@ -1,5 +1,7 @@
 #include "random.h"
 
+#include <cmath>
+
 static uint64_t splitmix64(uint64_t* x)
 {
     *x += UINT64_C(0x9E3779B97F4A7C15);
@@ -28,6 +30,94 @@ u64 generate(Sequence* sequence)
     return result;
 }
 
+// Jumping ahead n calls is multiplying by the nth power of the step, which
+// for a linear generator like this one is the same as a sum of some of the
+// next 128 states. Each bit of the polynomial says whether that state is in
+// the sum.
+static void jump_by(Sequence* sequence, const u64* polynomial)
+{
+    u64 s0 = 0;
+    u64 s1 = 0;
+    for(int i = 0; i < 2; i += 1)
+    {
+        for(int b = 0; b < 64; b += 1)
+        {
+            if(polynomial[i] & (UINT64_C(1) << b))
+            {
+                s0 ^= sequence->s[0];
+                s1 ^= sequence->s[1];
+            }
+            generate(sequence);
+        }
+    }
+    sequence->s[0] = s0;
+    sequence->s[1] = s1;
+}
+
+void jump(Sequence* sequence)
+{
+    static const u64 polynomial[2] =
+    {
+        UINT64_C(0xbeac0467eba5facb),
+        UINT64_C(0xd86b048b86aa9922),
+    };
+    jump_by(sequence, polynomial);
+}
+
+void long_jump(Sequence* sequence)
+{
+    static const u64 polynomial[2] =
+    {
+        UINT64_C(0x18f7c399ccebda8d),
+        UINT64_C(0xf2deac28bef3bb07),
+    };
+    jump_by(sequence, polynomial);
+}
+
+namespace
+{
+    // how many streams generate_n draws from side by side
+    const int generate_lanes = 4;
+}
+
+// The first stream carries on from the sequence itself, and each of the
+// others is a jump ahead of the one before. The sequence is left where the
+// first stream stopped, so the next call's streams each carry on from where
+// this call's left off.
+void generate_n(Sequence* sequence, u64* values, int count)
+{
+    u64 s0[generate_lanes];
+    u64 s1[generate_lanes];
+    Sequence lane = *sequence;
+    for(int j = 0; j < generate_lanes; j += 1)
+    {
+        s0[j] = lane.s[0];
+        s1[j] = lane.s[1];
+        jump(&lane);
+    }
+
+    int i = 0;
+    for(; i + generate_lanes <= count; i += generate_lanes)
+    {
+        for(int j = 0; j < generate_lanes; j += 1)
+        {
+            u64 a = s0[j];
+            u64 b = s1[j];
+            values[i + j] = a + b;
+            b ^= a;
+            s0[j] = rotl(a, 55) ^ b ^ (b << 14);
+            s1[j] = rotl(b, 36);
+        }
+    }
+
+    sequence->s[0] = s0[0];
+    sequence->s[1] = s1[0];
+    for(; i < count; i += 1)
+    {
+        values[i] = generate(sequence);
+    }
+}
+
 u64 seed(Sequence* sequence, u64 value)
 {
     u64 old_seed = sequence->seed;
@@ -42,3 +132,71 @@ int random_int_range(Sequence* sequence, int min, int max)
     int x = generate(sequence) % static_cast<u64>(max - min + 1);
     return min + x;
 }
+
+// Gives a double in the range [0, 1) using the top 53 bits of the next number,
+// which is all that a double's significand can hold.
+double generate_unit(Sequence* sequence)
+{
+    return (generate(sequence) >> 11) * (1.0 / (UINT64_C(1) << 53));
+}
+
+static double zeta(u64 count, double theta)
+{
+    double sum = 0.0;
+    for(u64 i = 1; i <= count; i += 1)
+    {
+        sum += 1.0 / pow(static_cast<double>(i), theta);
+    }
+    return sum;
+}
+
+// This is the method from "Quickly Generating Billion-Record Synthetic
+// Databases" by Gray et al., which is also what YCSB uses. The setup is
+// linear in the count, but then each rank is drawn in constant time.
+void zipf_create(Zipf* zipf, u64 count, double theta)
+{
+    double zeta_2 = zeta(2, theta);
+    zipf->count = count;
+    zipf->theta = theta;
+    zipf->zeta_n = zeta(count, theta);
+    zipf->alpha = 1.0 / (1.0 - theta);
+    zipf->eta = (1.0 - pow(2.0 / count, 1.0 - theta))
+        / (1.0 - (zeta_2 / zipf->zeta_n));
+    zipf->half_pow_theta = pow(0.5, theta);
+}
+
+u64 zipf_generate(Zipf* zipf, Sequence* sequence)
+{
+    double u = generate_unit(sequence);
+    double uz = u * zipf->zeta_n;
+    if(uz < 1.0)
+    {
+        return 0;
+    }
+    if(uz < 1.0 + zipf->half_pow_theta)
+    {
+        return 1;
+    }
+    double spread = pow((zipf->eta * u) - zipf->eta + 1.0, zipf->alpha);
+    u64 rank = static_cast<u64>(zipf->count * spread);
+    if(rank >= zipf->count)
+    {
+        rank = zipf->count - 1;
+    }
+    return rank;
+}
+
+u64 hotspot_generate(Sequence* sequence, u64 count, double hot_set,
+    double hot_operations)
+{
+    u64 hot_count = static_cast<u64>(count * hot_set);
+    if(hot_count == 0)
+    {
+        hot_count = 1;
+    }
+    if(hot_count >= count || generate_unit(sequence) < hot_operations)
+    {
+        return generate(sequence) % hot_count;
+    }
+    return hot_count + (generate(sequence) % (count - hot_count));
+}
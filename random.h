@@ -12,5 +12,41 @@ struct Sequence
 u64 generate(Sequence* sequence);
 u64 seed(Sequence* sequence, u64 value);
 int random_int_range(Sequence* sequence, int min, int max);
+double generate_unit(Sequence* sequence);
+
+// These move a sequence ahead as far as 2^64 and 2^96 calls to generate would,
+// in the time of a few hundred. Jumping copies of one sequence different
+// numbers of times gives streams that won't overlap, which can then be drawn
+// from on separate threads. Long jumps make streams of streams: each can be
+// jumped 2^32 times before reaching the next.
+void jump(Sequence* sequence);
+void long_jump(Sequence* sequence);
+
+// This fills values with count numbers, drawn from several streams jumped
+// apart and stepped side by side. With no chain from one number to the next,
+// the compiler can interleave or vectorize the steps. They aren't the numbers
+// calling generate count times would give, but they're just as random.
+void generate_n(Sequence* sequence, u64* values, int count);
+
+// This gives ranks from 0 to count - 1 with a Zipfian distribution, where rank
+// 0 is the most likely and each rank after gets rarer following a power law.
+struct Zipf
+{
+    double theta;
+    double alpha;
+    double eta;
+    double zeta_n;
+    double half_pow_theta;
+    u64 count;
+};
+
+void zipf_create(Zipf* zipf, u64 count, double theta);
+u64 zipf_generate(Zipf* zipf, Sequence* sequence);
+
+// This gives ranks from 0 to count - 1 where a hot set made of the lowest
+// hot_set fraction of them is picked a hot_operations fraction of the time,
+// and every rank is equally likely within the hot and cold sets.
+u64 hotspot_generate(Sequence* sequence, u64 count, double hot_set,
+    double hot_operations);
 
 #endif // RANDOM_H_
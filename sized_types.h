@@ -13,6 +13,7 @@ typedef int16_t s16;
 typedef int32_t s32;
 typedef int64_t s64;
 
+typedef intptr_t spointer;
 typedef uintptr_t upointer;
 
 #define U64_MAX UINT64_MAX
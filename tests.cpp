@@ -1,16 +1,36 @@
+#include "cuckoo_map.h"
 #include "map.h"
+#include "pointer_map.h"
 
 #include <cstdio>
 
 enum class Test
 {
+    Add_To,
+    Background_Grow,
+    Bound,
+    Cuckoo,
     Get,
     Get_Missing,
     Get_Overflow,
+    Instruction_Sets,
     Iterate,
+    Iterate_Remove,
+    Merge,
     Remove,
+    Remove_Batch,
+    Remove_Many,
     Remove_Overflow,
+    Reseed,
     Reserve,
+    Retain_If,
+    Set_Operations,
+    Small,
+    Snapshot,
+    Stats,
+    Typed,
+    Unstored_Hashes,
+    Values_In_Place,
 };
 
 static const char* describe_test(Test test)
@@ -18,16 +38,251 @@ static const char* describe_test(Test test)
     switch(test)
     {
         default:
+        case Test::Add_To:          return "Add To";
+        case Test::Background_Grow: return "Background Grow";
+        case Test::Bound:           return "Bound";
+        case Test::Cuckoo:          return "Cuckoo";
         case Test::Get:             return "Get";
         case Test::Get_Missing:     return "Get Missing";
         case Test::Get_Overflow:    return "Get Overflow";
+        case Test::Instruction_Sets: return "Instruction Sets";
         case Test::Iterate:         return "Iterate";
+        case Test::Iterate_Remove:  return "Iterate Remove";
+        case Test::Merge:           return "Merge";
         case Test::Remove:          return "Remove";
+        case Test::Remove_Batch:    return "Remove Batch";
+        case Test::Remove_Many:     return "Remove Many";
         case Test::Remove_Overflow: return "Remove Overflow";
+        case Test::Reseed:          return "Reseed";
         case Test::Reserve:         return "Reserve";
+        case Test::Retain_If:       return "Retain If";
+        case Test::Set_Operations:  return "Set Operations";
+        case Test::Small:           return "Small";
+        case Test::Snapshot:        return "Snapshot";
+        case Test::Stats:           return "Stats";
+        case Test::Typed:           return "Typed";
+        case Test::Unstored_Hashes: return "Unstored Hashes";
+        case Test::Values_In_Place: return "Values In Place";
     }
 }
 
+static bool test_add_to(Map* map, Heap* heap)
+{
+    const int keys_count = 10000;
+    const int distinct = 1000;
+
+    // Each batch repeats every key ten times, including the null key, and the
+    // map starts out small so that the first batch has to move to a table.
+    void* keys[keys_count];
+    spointer deltas[keys_count];
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        keys[i] = reinterpret_cast<void*>(static_cast<upointer>(i % distinct));
+        deltas[i] = 2;
+    }
+    map_add_to_batch(map, keys, nullptr, keys_count, heap);
+    map_add_to_batch(map, keys, deltas, keys_count, heap);
+    spointer single = map_add_to(map, reinterpret_cast<void*>(5), -3, heap);
+
+    // Counts tallied separately, one of them small, merge by adding up.
+    Map other = {};
+    map_create(&other, heap);
+    Map small = {};
+    map_create(&small, heap);
+    for(int i = 0; i < distinct; i += 1)
+    {
+        map_add_to(&other, reinterpret_cast<void*>(i), 1, heap);
+    }
+    map_add_to(&small, reinterpret_cast<void*>(distinct), 4, heap);
+    map_add_to(&small, reinterpret_cast<void*>(7), 4, heap);
+    map_merge(map, &other, MapConflict::Add_Values, heap);
+    map_merge(map, &small, MapConflict::Add_Values, heap);
+
+    int mismatches = 0;
+    for(int i = 0; i <= distinct; i += 1)
+    {
+        spointer expected = (i == distinct) ? 4 : 31;
+        expected += (i == 5) ? -3 : 0;
+        expected += (i == 7) ? 4 : 0;
+        void* value;
+        bool got = map_get(map, reinterpret_cast<void*>(i), &value);
+        mismatches += !got || reinterpret_cast<spointer>(value) != expected;
+    }
+
+    map_destroy(&other, heap);
+    map_destroy(&small, heap);
+
+    return mismatches == 0 && single == 27 && map->count == distinct + 1;
+}
+
+static bool test_background_grow(Map* map, Heap* heap)
+{
+    const int keys_count = 100000;
+
+    map_grow_in_background(map, 0.5f, heap);
+
+    // Every third key is removed again right away, while most of the grows
+    // are likely still being built.
+    int mismatches = 0;
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        map_add(map, key, key, heap);
+        if(i % 3 == 0)
+        {
+            map_remove(map, key);
+        }
+        void* value;
+        bool got = map_get(map, key, &value);
+        mismatches += got != (i % 3 != 0) || (got && value != key);
+    }
+    bool counted = map->count == keys_count - (keys_count / 3);
+
+    int iterated = 0;
+    ITERATE_MAP(it, map)
+    {
+        void* key = map_iterator_get_key(it);
+        upointer bits = reinterpret_cast<upointer>(key);
+        mismatches += bits % 3 == 0 || map_iterator_get_value(it) != key;
+        iterated += 1;
+    }
+
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        void* value;
+        bool got = map_get(map, reinterpret_cast<void*>(i), &value);
+        mismatches += got != (i % 3 != 0);
+    }
+
+    MapStats stats;
+    map_get_stats(map, &stats);
+
+    return mismatches == 0 && counted && iterated == map->count
+        && stats.grows > 0;
+}
+
+struct Evictions
+{
+    int count;
+    int hot;
+};
+
+static void count_eviction(void* key, void* value, void* user_data)
+{
+    Evictions* evictions = static_cast<Evictions*>(user_data);
+    evictions->count += 1;
+    evictions->hot += reinterpret_cast<upointer>(key) < 50;
+}
+
+static bool test_bound(Map* map, Heap* heap)
+{
+    const int limit = 100;
+
+    Evictions evictions = {};
+    map_set_bound(map, limit, count_eviction, &evictions, heap);
+    for(int i = 0; i <= limit; i += 1)
+    {
+        map_add(map, reinterpret_cast<void*>(i), nullptr, heap);
+    }
+    bool first_evicted = map->count == limit && evictions.count == 1;
+
+    // The first eviction cleared every flag but the last key's, so once the
+    // hot keys are got again, all the keys evicted next have to be cold ones.
+    // That includes the null key in the overflow slot.
+    int first_hot = evictions.hot;
+    void* discard;
+    for(int i = 0; i < 50; i += 1)
+    {
+        map_get(map, reinterpret_cast<void*>(i), &discard);
+    }
+    for(int i = 0; i < 40; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(1000 + i);
+        map_add(map, key, nullptr, heap);
+    }
+    int hot_kept = 0;
+    for(int i = 0; i < 50; i += 1)
+    {
+        hot_kept += map_get(map, reinterpret_cast<void*>(i), &discard);
+    }
+    bool cold_evicted = map->count == limit && evictions.count == 41
+        && evictions.hot == first_hot && hot_kept == 50 - first_hot;
+
+    // Bounding a map that's already bigger evicts it down to the limit.
+    Map big = {};
+    map_create(&big, heap);
+    for(int i = 0; i < 1000; i += 1)
+    {
+        map_add(&big, reinterpret_cast<void*>(i), nullptr, heap);
+    }
+    map_set_bound(&big, limit, nullptr, nullptr, heap);
+    bool shrunk = big.count == limit;
+    map_destroy(&big, heap);
+
+    return first_evicted && cold_evicted && shrunk;
+}
+
+// The CuckooMap is tested here too, though it doesn't use the given map.
+static bool test_cuckoo(Map* map, Heap* heap)
+{
+    const int keys_count = 20000;
+
+    CuckooMap cuckoo = {};
+    cuckoo_map_create(&cuckoo, heap);
+
+    // Key 0 is among these, and goes on the side.
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        cuckoo_map_add(&cuckoo, key, key, heap);
+    }
+    upointer address = reinterpret_cast<upointer>(cuckoo.buckets);
+    bool aligned = address % 64 == 0;
+    bool added = cuckoo.count == keys_count;
+
+    for(int i = 0; i < keys_count; i += 3)
+    {
+        cuckoo_map_remove(&cuckoo, reinterpret_cast<void*>(i));
+    }
+    cuckoo_map_add(&cuckoo, reinterpret_cast<void*>(1), nullptr, heap);
+
+    int mismatches = 0;
+    for(int i = 0; i < keys_count + 100; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        void* value;
+        bool got = cuckoo_map_get(&cuckoo, key, &value);
+        bool expected = i < keys_count && i % 3 != 0;
+        mismatches += got != expected;
+        mismatches += got && value != ((i == 1) ? nullptr : key);
+    }
+
+    int iterated = 0;
+    ITERATE_CUCKOO_MAP(it, &cuckoo)
+    {
+        upointer key =
+            reinterpret_cast<upointer>(cuckoo_map_iterator_get_key(it));
+        iterated += key % 3 != 0;
+    }
+    int kept = keys_count - (keys_count + 2) / 3;
+    bool counted = cuckoo.count == kept && iterated == kept;
+
+    // Reserving up front leaves nothing to grow while adding.
+    CuckooMap reserved = {};
+    cuckoo_map_create(&reserved, heap);
+    cuckoo_map_reserve(&reserved, keys_count, heap);
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        cuckoo_map_add(&reserved, reinterpret_cast<void*>(i), nullptr, heap);
+    }
+    bool no_grows = reserved.grows == 0;
+
+    cuckoo_map_destroy(&cuckoo, heap);
+    cuckoo_map_destroy(&reserved, heap);
+
+    return aligned && added && mismatches == 0 && counted && no_grows;
+}
+
 static bool test_get(Map* map, Heap* heap)
 {
     void* key = reinterpret_cast<void*>(253);
@@ -56,6 +311,67 @@ static bool test_get_overflow(Map* map, Heap* heap)
     return got && found == value;
 }
 
+// The same pairs are counted, looked up, iterated, and removed under every
+// instruction set the processor has. A table that's most of the way full has
+// long clusters, some of which wrap around its end.
+static bool test_instruction_sets(Map* map, Heap* heap)
+{
+    const int keys_count = 3000;
+    const int removed_count = 1000;
+    void* keys[keys_count];
+
+    Sequence sequence;
+    seed(&sequence, 52207);
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        keys[i] = reinterpret_cast<void*>(generate(&sequence) | 1);
+    }
+
+    MapInstructionSet best = map_get_instruction_set();
+    int mismatches = 0;
+    for(int i = 0; i <= static_cast<int>(best); i += 1)
+    {
+        MapInstructionSet instruction_set = static_cast<MapInstructionSet>(i);
+        mismatches += !map_use_instruction_set(instruction_set);
+
+        Map counts = {};
+        map_create(&counts, heap);
+        map_reserve(&counts, keys_count, heap);
+        map_add_to_batch(&counts, keys, nullptr, keys_count, heap);
+        map_add(&counts, nullptr, nullptr, heap);
+
+        for(int j = 0; j < keys_count; j += 1)
+        {
+            void* value;
+            mismatches += !map_get(&counts, keys[j], &value)
+                || value != reinterpret_cast<void*>(1);
+            void* missing = reinterpret_cast<void*>(
+                reinterpret_cast<upointer>(keys[j]) + 1);
+            mismatches += map_get(&counts, missing, &value);
+        }
+        int found = 0;
+        ITERATE_MAP(it, &counts)
+        {
+            found += 1;
+        }
+        mismatches += found != keys_count + 1;
+
+        map_remove_batch(&counts, keys, removed_count);
+        for(int j = 0; j < keys_count; j += 1)
+        {
+            void* value;
+            mismatches += map_get(&counts, keys[j], &value)
+                != (j >= removed_count);
+        }
+        mismatches += counts.count != keys_count - removed_count + 1;
+
+        map_destroy(&counts, heap);
+    }
+    map_use_instruction_set(best);
+
+    return mismatches == 0;
+}
+
 static bool test_iterate(Map* map, Heap* heap)
 {
     const int pairs_count = 256;
@@ -118,6 +434,182 @@ static bool test_iterate(Map* map, Heap* heap)
     return mismatches == 0;
 }
 
+// Keys here are 0 through keys_count - 1, so the ones divisible by three can be
+// told apart just by looking at them.
+static bool is_divisible_by_three(void* key, void* value, void* user_data)
+{
+    return reinterpret_cast<upointer>(key) % 3 == 0;
+}
+
+// Removing during iteration should still visit every pair exactly once, so
+// this tallies the visits in a second map.
+static bool test_iterate_remove(Map* map, Heap* heap)
+{
+    const int keys_count = 3000;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        map_add(map, key, key, heap);
+    }
+
+    Map visits = {};
+    map_create(&visits, heap);
+    int mismatches = 0;
+    ITERATE_MAP(it, map)
+    {
+        void* key = map_iterator_get_key(it);
+        void* count = nullptr;
+        map_get(&visits, key, &count);
+        map_add(&visits, key, static_cast<char*>(count) + 1, heap);
+        mismatches += map_iterator_get_value(it) != key;
+        if(!is_divisible_by_three(key, nullptr, nullptr))
+        {
+            it = map_iterator_remove(it);
+        }
+    }
+
+    ITERATE_MAP(it, &visits)
+    {
+        mismatches += map_iterator_get_value(it) != reinterpret_cast<void*>(1);
+    }
+    bool all_visited = visits.count == keys_count;
+    map_destroy(&visits, heap);
+
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        void* value;
+        bool got = map_get(map, key, &value);
+        mismatches += got != is_divisible_by_three(key, nullptr, nullptr);
+    }
+
+    int left = (keys_count + 2) / 3;
+    return mismatches == 0 && all_visited && map->count == left;
+}
+
+static bool test_retain_if(Map* map, Heap* heap)
+{
+    const int keys_count = 3000;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        map_add(map, key, key, heap);
+    }
+
+    map_retain_if(map, is_divisible_by_three, nullptr);
+
+    int mismatches = 0;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        void* value;
+        bool got = map_get(map, key, &value);
+        mismatches += got != is_divisible_by_three(key, nullptr, nullptr);
+    }
+
+    int left = (keys_count + 2) / 3;
+    return mismatches == 0 && map->count == left;
+}
+
+// The first map gets keys 0 through 1999 and the second gets 0 and 1000
+// through 3999, so that they share 0 and 1000 through 1999. The first map's
+// values are its keys, and the second's are one more than its keys.
+static void add_overlapping_keys(Map* first, Map* second, Heap* heap)
+{
+    for(int i = 0; i < 4000; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        void* next = reinterpret_cast<void*>(i + 1);
+        if(i < 2000)
+        {
+            map_add(first, key, key, heap);
+        }
+        if(i == 0 || i >= 1000)
+        {
+            map_add(second, key, next, heap);
+        }
+    }
+}
+
+static bool test_merge(Map* map, Heap* heap)
+{
+    Map source = {};
+    map_create(&source, heap);
+    add_overlapping_keys(map, &source, heap);
+
+    Map taken = {};
+    map_create(&taken, heap);
+    map_merge(&taken, map, MapConflict::Keep_Destination, heap);
+
+    map_merge(map, &source, MapConflict::Keep_Destination, heap);
+    map_merge(&taken, &source, MapConflict::Take_Source, heap);
+
+    // A small source goes down another path.
+    Map small = {};
+    map_create(&small, heap);
+    void* extra = reinterpret_cast<void*>(5000);
+    map_add(&small, extra, extra, heap);
+    map_merge(map, &small, MapConflict::Keep_Destination, heap);
+
+    int mismatches = 0;
+    for(int i = 0; i < 4000; i += 1)
+    {
+        upointer key = i;
+        void* kept;
+        void* replaced;
+        bool got = map_get(map, reinterpret_cast<void*>(key), &kept)
+            && map_get(&taken, reinterpret_cast<void*>(key), &replaced);
+        upointer kept_value = (i < 2000) ? key : key + 1;
+        upointer replaced_value = (i == 0 || i >= 1000) ? key + 1 : key;
+        mismatches += !got
+            || kept != reinterpret_cast<void*>(kept_value)
+            || replaced != reinterpret_cast<void*>(replaced_value);
+    }
+    void* discard;
+    bool got_extra = map_get(map, extra, &discard);
+
+    bool counted = map->count == 4001 && taken.count == 4000
+        && source.count == 3001;
+
+    map_destroy(&source, heap);
+    map_destroy(&taken, heap);
+    map_destroy(&small, heap);
+
+    return mismatches == 0 && got_extra && counted;
+}
+
+static bool test_set_operations(Map* map, Heap* heap)
+{
+    Map source = {};
+    map_create(&source, heap);
+    add_overlapping_keys(map, &source, heap);
+
+    Map difference = {};
+    map_create(&difference, heap);
+    map_merge(&difference, map, MapConflict::Keep_Destination, heap);
+
+    map_intersect(map, &source);
+    map_difference(&difference, &source);
+
+    int mismatches = 0;
+    for(int i = 0; i < 4000; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        void* value;
+        bool shared = i == 0 || (i >= 1000 && i < 2000);
+        bool got = map_get(map, key, &value);
+        mismatches += got != shared || (got && value != key);
+        got = map_get(&difference, key, &value);
+        mismatches += got != (!shared && i < 2000) || (got && value != key);
+    }
+    bool counted = map->count == 1001 && difference.count == 999;
+
+    map_destroy(&source, heap);
+    map_destroy(&difference, heap);
+
+    return mismatches == 0 && counted;
+}
+
 static bool test_remove(Map* map, Heap* heap)
 {
     void* key = reinterpret_cast<void*>(6356);
@@ -130,6 +622,93 @@ static bool test_remove(Map* map, Heap* heap)
     return was_in && !is_in;
 }
 
+static bool test_remove_many(Map* map, Heap* heap)
+{
+    const int keys_count = 2000;
+    void* keys[keys_count];
+
+    Sequence sequence;
+    seed(&sequence, 4417);
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        keys[i] = reinterpret_cast<void*>(generate(&sequence) | 1);
+        map_add(map, keys[i], keys[i], heap);
+    }
+    // Adding a key that's already there should replace its value without
+    // counting it twice.
+    map_add(map, keys[0], keys[0], heap);
+
+    for(int i = 0; i < keys_count; i += 2)
+    {
+        map_remove(map, keys[i]);
+    }
+
+    // Every key that's left should still be found, even ones that had to be
+    // shifted back over the removed slots.
+    int mismatches = 0;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* value;
+        bool got = map_get(map, keys[i], &value);
+        bool should_have = i % 2 == 1;
+        mismatches += got != should_have || (got && value != keys[i]);
+    }
+
+    return mismatches == 0 && map->count == keys_count / 2;
+}
+
+static bool test_remove_batch(Map* map, Heap* heap)
+{
+    const int keys_count = 20000;
+    void** keys = HEAP_ALLOCATE(heap, void*, keys_count);
+    void** batch = HEAP_ALLOCATE(heap, void*, keys_count);
+    bool* removed = HEAP_ALLOCATE(heap, bool, keys_count);
+
+    Sequence sequence;
+    seed(&sequence, 90211);
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        keys[i] = reinterpret_cast<void*>(generate(&sequence) | 1);
+        map_add(map, keys[i], keys[i], heap);
+    }
+    map_add(map, nullptr, nullptr, heap);
+
+    // Take out two thirds of the keys, so that most clusters lose several at
+    // once. The batch also repeats a key, and has one that isn't there.
+    int batch_count = 0;
+    for(int i = 0; i < keys_count - 3; i += 1)
+    {
+        if(i % 3 != 0)
+        {
+            batch[batch_count] = keys[i];
+            removed[i] = true;
+            batch_count += 1;
+        }
+    }
+    batch[batch_count] = keys[1];
+    batch[batch_count + 1] = reinterpret_cast<void*>(2);
+    batch[batch_count + 2] = nullptr;
+    batch_count += 3;
+    map_remove_batch(map, batch, batch_count);
+
+    int mismatches = 0;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* value;
+        bool got = map_get(map, keys[i], &value);
+        mismatches += got == removed[i] || (got && value != keys[i]);
+    }
+    void* discard;
+    bool removed_null = !map_get(map, nullptr, &discard);
+    int left = keys_count - (batch_count - 3);
+
+    HEAP_DEALLOCATE(heap, keys);
+    HEAP_DEALLOCATE(heap, batch);
+    HEAP_DEALLOCATE(heap, removed);
+
+    return mismatches == 0 && removed_null && map->count == left;
+}
+
 static bool test_remove_overflow(Map* map, Heap* heap)
 {
     void* key = reinterpret_cast<void*>(0);
@@ -142,6 +721,66 @@ static bool test_remove_overflow(Map* map, Heap* heap)
     return had && !got;
 }
 
+static bool test_reseed(Map* map, Heap* heap)
+{
+    const int keys_count = 2000;
+
+    // These keys all share their low twelve bits of hash, so they pile up in
+    // one long cluster until the map switches to a seeded hash.
+    void* keys[keys_count];
+    u64 candidate = 0;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        do
+        {
+            candidate += 1;
+        } while(map_hash_key(candidate) & 0xfff);
+        keys[i] = reinterpret_cast<void*>(candidate);
+    }
+
+    // Too few adds to make up a window go in before the snapshot.
+    int first_count = 100;
+    for(int i = 0; i < first_count; i += 1)
+    {
+        map_add(map, keys[i], keys[i], heap);
+    }
+    bool unseeded = map->hash_seed == 0;
+    MapSnapshot* before = map_snapshot(map, heap);
+    for(int i = first_count; i < keys_count; i += 1)
+    {
+        map_add(map, keys[i], keys[i], heap);
+    }
+    bool reseeded = unseeded && map->hash_seed != 0;
+    MapSnapshot* after = map_snapshot(map, heap);
+
+    // Other maps that still use the default hash have to look the keys up
+    // again rather than reuse the stored hashes.
+    Map merged = {};
+    map_create(&merged, heap);
+    map_add(&merged, keys[0], nullptr, heap);
+    map_merge(&merged, map, MapConflict::Keep_Destination, heap);
+    map_intersect(&merged, map);
+
+    int mismatches = 0;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* value;
+        mismatches += !map_get(map, keys[i], &value) || value != keys[i];
+        mismatches += !map_snapshot_get(after, keys[i], &value);
+        bool was_before = map_snapshot_get(before, keys[i], &value);
+        mismatches += was_before != (i < first_count);
+        mismatches += !map_get(&merged, keys[i], &value)
+            || value != ((i == 0) ? nullptr : keys[i]);
+    }
+    bool counted = map->count == keys_count && merged.count == keys_count;
+
+    map_snapshot_destroy(before, heap);
+    map_snapshot_destroy(after, heap);
+    map_destroy(&merged, heap);
+
+    return reseeded && mismatches == 0 && counted;
+}
+
 static bool test_reserve(Map* map, Heap* heap)
 {
     int reserve = 1254;
@@ -151,33 +790,504 @@ static bool test_reserve(Map* map, Heap* heap)
     return was_smaller && is_enough;
 }
 
+static bool test_small(Map* map, Heap* heap)
+{
+    // Key 0 is among these to check that it survives the move to a table,
+    // where it goes in the overflow slot.
+    for(int i = 0; i < map_small_cap; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        map_add(map, key, key, heap);
+    }
+    map_remove(map, reinterpret_cast<void*>(3));
+
+    u64 heap_bytes = heap_get_bytes_in_use(heap);
+    bool stayed_small = map->cap == 0;
+
+    int iterated = 0;
+    ITERATE_MAP(it, map)
+    {
+        iterated += map_iterator_get_key(it) == map_iterator_get_value(it);
+    }
+
+    map_add(map, reinterpret_cast<void*>(3), nullptr, heap);
+    map_add(map, reinterpret_cast<void*>(100), nullptr, heap);
+    bool moved = map->cap > 0 && heap_get_bytes_in_use(heap) > heap_bytes;
+
+    int mismatches = 0;
+    for(int i = 0; i < map_small_cap; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        void* value;
+        bool got = map_get(map, key, &value);
+        void* expected = (i == 3) ? nullptr : key;
+        mismatches += !got || value != expected;
+    }
+
+    bool counted = map->count == map_small_cap + 1
+        && iterated == map_small_cap - 1;
+    return stayed_small && moved && mismatches == 0 && counted;
+}
+
+static bool test_snapshot(Map* map, Heap* heap)
+{
+    const int pairs_count = 5000;
+
+    // Keys are 1 through pairs_count, each with itself as its value.
+    for(int i = 1; i <= pairs_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(i);
+        map_add(map, key, key, heap);
+    }
+    map_add(map, nullptr, nullptr, heap);
+
+    u64 heap_bytes = heap_get_bytes_in_use(heap);
+    MapSnapshot* snapshot = map_snapshot(map, heap);
+
+    void* one = reinterpret_cast<void*>(1);
+    map_add(map, one, nullptr, heap);
+    map_remove(map, reinterpret_cast<void*>(2));
+    map_remove(map, nullptr);
+
+    // Only the changed chunks should have been copied, not the whole table.
+    u64 table_bytes = (2 * sizeof(void*) + sizeof(u32)) * map->cap;
+    bool copied_less = heap_get_bytes_in_use(heap) - heap_bytes < table_bytes;
+
+    void* value;
+    bool kept = map_snapshot_get(snapshot, one, &value) && value == one
+        && map_snapshot_get(snapshot, reinterpret_cast<void*>(2), &value)
+        && map_snapshot_get(snapshot, nullptr, &value)
+        && map_get(map, one, &value) && value == nullptr
+        && !map_get(map, reinterpret_cast<void*>(2), &value);
+
+    // Growing the map cuts the snapshot loose from it.
+    map_reserve(map, 4 * map->cap, heap);
+    for(int i = 1; i <= pairs_count; i += 1)
+    {
+        map_remove(map, reinterpret_cast<void*>(i));
+    }
+
+    int mismatches = 0;
+    int iterated = 0;
+    ITERATE_MAP_SNAPSHOT(it, snapshot)
+    {
+        void* key = map_snapshot_iterator_get_key(it);
+        mismatches += key != map_snapshot_iterator_get_value(it);
+        iterated += 1;
+    }
+    bool counted = iterated == pairs_count + 1
+        && map_snapshot_count(snapshot) == pairs_count + 1;
+
+    map_snapshot_destroy(snapshot, heap);
+
+    // Replacing the value of a null key that's already there still has to
+    // copy out the overflow slot's chunk first.
+    Map overflowing = {};
+    map_create(&overflowing, heap);
+    for(int i = 1; i <= 20; i += 1)
+    {
+        map_add(&overflowing, reinterpret_cast<void*>(i), nullptr, heap);
+    }
+    map_add(&overflowing, nullptr, reinterpret_cast<void*>(111), heap);
+    MapSnapshot* overflow_snapshot = map_snapshot(&overflowing, heap);
+    map_add(&overflowing, nullptr, reinterpret_cast<void*>(222), heap);
+    spointer sum = map_add_to(&overflowing, nullptr, 5, heap);
+    bool overflow_kept = map_snapshot_get(overflow_snapshot, nullptr, &value)
+        && value == reinterpret_cast<void*>(111) && sum == 227;
+    map_snapshot_destroy(overflow_snapshot, heap);
+    map_destroy(&overflowing, heap);
+
+    Map small = {};
+    map_create(&small, heap);
+    map_add(&small, one, one, heap);
+    MapSnapshot* small_snapshot = map_snapshot(&small, heap);
+    map_remove(&small, one);
+    bool small_kept = map_snapshot_get(small_snapshot, one, &value)
+        && value == one;
+    map_snapshot_destroy(small_snapshot, heap);
+    map_destroy(&small, heap);
+
+    return copied_less && kept && mismatches == 0 && counted && small_kept
+        && overflow_kept;
+}
+
+static bool test_stats(Map* map, Heap* heap)
+{
+    const int pairs_count = 100;
+
+    Sequence sequence;
+    seed(&sequence, 8812633);
+    for(int i = 0; i < pairs_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(generate(&sequence));
+        map_add(map, key, key, heap);
+    }
+
+    MapStats stats;
+    map_get_stats(map, &stats);
+
+    int counted = 0;
+    for(int i = 0; i < map_probe_lengths_cap; i += 1)
+    {
+        counted += stats.probe_lengths[i];
+    }
+
+    bool all_counted = counted == pairs_count;
+    bool grew = stats.grows > 0 && map->cap >= pairs_count;
+    bool loaded = stats.load_factor == static_cast<float>(pairs_count) / map->cap;
+    bool probed = stats.mean_hit_probe_length >= 1.0f
+        && stats.expected_miss_probe_length >= 1.0f
+        && stats.longest_cluster >= stats.longest_probe_length;
+    return all_counted && grew && loaded && probed;
+}
+
+static bool test_typed(Map* map, Heap* heap)
+{
+    const int keys_count = 1000;
+
+    PointerMap<int, float> typed;
+    pointer_map_create(&typed, heap);
+
+    // Negative keys check that keys narrower than a pointer come back the
+    // same, and key 0 goes in the overflow slot.
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        pointer_map_add(&typed, i - (keys_count / 2), 0.5f * i, heap);
+    }
+    for(int i = 0; i < keys_count; i += 2)
+    {
+        pointer_map_remove(&typed, i - (keys_count / 2));
+    }
+
+    int mismatches = 0;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        float value;
+        bool got = pointer_map_get(&typed, i - (keys_count / 2), &value);
+        bool should_have = i % 2 == 1;
+        mismatches += got != should_have || (got && value != 0.5f * i);
+    }
+
+    int iterated = 0;
+    ITERATE_POINTER_MAP(it, &typed)
+    {
+        int key = pointer_map_iterator_get_key(&typed, it);
+        float value = pointer_map_iterator_get_value(&typed, it);
+        mismatches += value != 0.5f * (key + (keys_count / 2));
+        iterated += 1;
+    }
+
+    // With the default hash, the untyped functions see the same table.
+    void* untyped_value;
+    void* untyped_key = pointer_map_to_slot(1 - (keys_count / 2));
+    bool untyped_got = map_get(&typed.map, untyped_key, &untyped_value);
+
+    bool counted = pointer_map_count(&typed) == keys_count / 2
+        && iterated == keys_count / 2;
+
+    pointer_map_destroy(&typed, heap);
+
+    PointerMap<u32, u32, MapHash, NonzeroKeysPolicy> nonzero;
+    pointer_map_create(&nonzero, heap);
+    pointer_map_add(&nonzero, 7u, 49u, heap);
+    u32 found = 0;
+    bool nonzero_got = pointer_map_get(&nonzero, 7u, &found) && found == 49u;
+    pointer_map_destroy(&nonzero, heap);
+
+    return mismatches == 0 && counted && untyped_got && nonzero_got;
+}
+
+// Tables past map_stored_hash_cap slots keep no hashes, and hash their keys
+// again to find home slots. The cap is too big to reach in a test unless it's
+// lowered by building with something like -DMAP_STORED_HASH_CAP=1024.
+// Otherwise, this goes through the same operations on tables that do store
+// their hashes.
+static bool test_unstored_hashes(Map* map, Heap* heap)
+{
+    const int keys_count = 20000;
+
+    // Adding one at a time grows the table across the cap. Then every fourth
+    // key is removed on its own, the ones after those in a batch, and a few
+    // more by the predicate.
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        map_add(map, key, key, heap);
+    }
+    bool stores_hashes = map->cap <= map_stored_hash_cap;
+    bool hashes_left_out = stores_hashes == (map->hashes != nullptr);
+
+    void* batch[keys_count];
+    int batch_count = 0;
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        if(i % 4 == 0)
+        {
+            map_remove(map, key);
+        }
+        else if(i % 4 == 1)
+        {
+            batch[batch_count] = key;
+            batch_count += 1;
+        }
+    }
+    map_remove_batch(map, batch, batch_count);
+    map_retain_if(map, [](void* key, void* value, void* user_data)
+    {
+        return reinterpret_cast<upointer>(key) % 8 != 2;
+    }, nullptr);
+
+    batch_count = 0;
+    for(int i = 3; i <= keys_count; i += 4)
+    {
+        batch[batch_count] = reinterpret_cast<void*>(static_cast<upointer>(i));
+        batch_count += 1;
+    }
+    map_add_to_batch(map, batch, nullptr, batch_count, heap);
+
+    int mismatches = 0;
+    int left = 0;
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        void* value;
+        bool got = map_get(map, key, &value);
+        bool should_have = i % 4 == 3 || i % 8 == 6;
+        upointer expected = (i % 4 == 3) ? i + 1 : i;
+        mismatches += got != should_have
+            || (got && reinterpret_cast<upointer>(value) != expected);
+        left += should_have;
+    }
+
+    int iterated = 0;
+    ITERATE_MAP(it, map)
+    {
+        void* value;
+        void* key = map_iterator_get_key(it);
+        mismatches += !map_get(map, key, &value)
+            || value != map_iterator_get_value(it);
+        iterated += 1;
+    }
+
+    // A merge can't reuse hashes the source doesn't have, nor place keys in a
+    // big destination by the ones it does.
+    Map merged = {};
+    map_create(&merged, heap);
+    map_add(&merged, reinterpret_cast<void*>(3), nullptr, heap);
+    map_merge(&merged, map, MapConflict::Keep_Destination, heap);
+    ITERATE_MAP(it, &merged)
+    {
+        if(reinterpret_cast<upointer>(map_iterator_get_key(it)) % 3 == 0)
+        {
+            it = map_iterator_remove(it);
+        }
+    }
+    int merged_left = 0;
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        void* value;
+        bool should_have = (i % 4 == 3 || i % 8 == 6) && i % 3 != 0;
+        mismatches += map_get(&merged, key, &value) != should_have;
+        merged_left += should_have;
+    }
+    bool merged_counted = merged.count == merged_left;
+    map_destroy(&merged, heap);
+
+    PointerMap<int, int> typed;
+    pointer_map_create(&typed, heap);
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        pointer_map_add(&typed, i, -i, heap);
+    }
+    for(int i = 1; i <= keys_count; i += 2)
+    {
+        pointer_map_remove(&typed, i);
+    }
+    for(int i = 1; i <= keys_count; i += 1)
+    {
+        int value;
+        bool got = pointer_map_get(&typed, i, &value);
+        mismatches += got != (i % 2 == 0) || (got && value != -i);
+    }
+    bool typed_counted = pointer_map_count(&typed) == keys_count / 2;
+    pointer_map_destroy(&typed, heap);
+
+    // The stats only count hashes for a table that keeps them.
+    MapStats stats;
+    map_get_stats(map, &stats);
+    u64 table_bytes = 2 * sizeof(void*) * (map->cap + 1);
+    if(stores_hashes)
+    {
+        table_bytes += sizeof(u32) * map->cap;
+    }
+
+    return mismatches == 0 && hashes_left_out && map->count == left
+        && iterated == left && merged_counted && typed_counted
+        && stats.bytes_allocated == table_bytes;
+}
+
+// The values of the first keys are referred to all the way through, while
+// later keys are added, removed one at a time and in a batch, counted, and
+// filtered, all of which grow the table or shift its pairs around.
+static bool test_values_in_place(Map* map, Heap* heap)
+{
+    const int early_count = 100;
+    const int keys_count = 20000;
+
+    // Key 0 has the overflow slot, and the first few keys start out in the
+    // small map, so that both have their values moved to the pool.
+    for(int i = 0; i < early_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        map_add(map, key, key, heap);
+    }
+    map_keep_values_in_place(map, heap);
+
+    void** references[early_count];
+    for(int i = 0; i < early_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        references[i] = map_get_reference(map, key);
+    }
+
+    void* later[keys_count];
+    int batch_count = 0;
+    for(int i = early_count; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        map_add(map, key, key, heap);
+    }
+    for(int i = early_count; i < keys_count; i += 2)
+    {
+        map_remove(map, reinterpret_cast<void*>(static_cast<upointer>(i)));
+    }
+    for(int i = early_count + 1; i < keys_count; i += 4)
+    {
+        later[batch_count] = reinterpret_cast<void*>(static_cast<upointer>(i));
+        batch_count += 1;
+    }
+    map_remove_batch(map, later, batch_count);
+    batch_count = 0;
+    for(int i = early_count + 3; i < keys_count; i += 4)
+    {
+        later[batch_count] = reinterpret_cast<void*>(static_cast<upointer>(i));
+        batch_count += 1;
+    }
+    map_add_to_batch(map, later, nullptr, batch_count, heap);
+    map_retain_if(map, [](void* key, void* value, void* user_data)
+    {
+        upointer i = reinterpret_cast<upointer>(key);
+        return i < early_count || i % 8 != 7;
+    }, nullptr);
+
+    int mismatches = 0;
+    for(int i = 0; i < early_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        mismatches += map_get_reference(map, key) != references[i];
+        *references[i] = reinterpret_cast<void*>(static_cast<upointer>(2 * i));
+    }
+
+    int left = early_count;
+    for(int i = 0; i < keys_count; i += 1)
+    {
+        void* key = reinterpret_cast<void*>(static_cast<upointer>(i));
+        void* value;
+        bool got = map_get(map, key, &value);
+        upointer expected = 2 * i;
+        bool should_have = true;
+        if(i >= early_count)
+        {
+            expected = i + 1;
+            should_have = i % 8 == 3;
+            left += should_have;
+        }
+        mismatches += got != should_have
+            || (got && reinterpret_cast<upointer>(value) != expected);
+    }
+
+    int iterated = 0;
+    ITERATE_MAP(it, map)
+    {
+        void* value;
+        void* key = map_iterator_get_key(it);
+        mismatches += !map_get(map, key, &value)
+            || value != map_iterator_get_value(it);
+        iterated += 1;
+    }
+
+    MapStats stats;
+    map_get_stats(map, &stats);
+
+    return mismatches == 0 && map->count == left && iterated == left
+        && stats.bytes_allocated > 0;
+}
+
 static bool run_test(Test test, Map* map, Heap* heap)
 {
     switch(test)
     {
         default:
+        case Test::Add_To:          return test_add_to(map, heap);
+        case Test::Background_Grow: return test_background_grow(map, heap);
+        case Test::Bound:           return test_bound(map, heap);
+        case Test::Cuckoo:          return test_cuckoo(map, heap);
         case Test::Get:             return test_get(map, heap);
         case Test::Get_Missing:     return test_get_missing(map, heap);
         case Test::Get_Overflow:    return test_get_overflow(map, heap);
+        case Test::Instruction_Sets: return test_instruction_sets(map, heap);
         case Test::Iterate:         return test_iterate(map, heap);
+        case Test::Iterate_Remove:  return test_iterate_remove(map, heap);
+        case Test::Merge:           return test_merge(map, heap);
         case Test::Remove:          return test_remove(map, heap);
+        case Test::Remove_Batch:    return test_remove_batch(map, heap);
+        case Test::Remove_Many:     return test_remove_many(map, heap);
         case Test::Remove_Overflow: return test_remove_overflow(map, heap);
+        case Test::Reseed:          return test_reseed(map, heap);
         case Test::Reserve:         return test_reserve(map, heap);
+        case Test::Retain_If:       return test_retain_if(map, heap);
+        case Test::Set_Operations:  return test_set_operations(map, heap);
+        case Test::Small:           return test_small(map, heap);
+        case Test::Snapshot:        return test_snapshot(map, heap);
+        case Test::Stats:           return test_stats(map, heap);
+        case Test::Typed:           return test_typed(map, heap);
+        case Test::Unstored_Hashes: return test_unstored_hashes(map, heap);
+        case Test::Values_In_Place: return test_values_in_place(map, heap);
     }
 }
 
 static void test_map(Heap* heap, FILE* file)
 {
-    const int tests_count = 7;
+    const int tests_count = 25;
     const Test tests[tests_count] =
     {
+        Test::Add_To,
+        Test::Background_Grow,
+        Test::Bound,
+        Test::Cuckoo,
         Test::Get,
         Test::Get_Missing,
         Test::Get_Overflow,
+        Test::Instruction_Sets,
         Test::Iterate,
+        Test::Iterate_Remove,
+        Test::Merge,
         Test::Remove,
+        Test::Remove_Batch,
+        Test::Remove_Many,
         Test::Remove_Overflow,
+        Test::Reseed,
         Test::Reserve,
+        Test::Retain_If,
+        Test::Set_Operations,
+        Test::Small,
+        Test::Snapshot,
+        Test::Stats,
+        Test::Typed,
+        Test::Unstored_Hashes,
+        Test::Values_In_Place,
     };
     bool which_failed[tests_count] = {};
 